@@ -0,0 +1,194 @@
+#!/usr/bin/perl -w
+
+# this script converts access logs written with a "format=binary"
+# log_format into text or JSON lines
+#
+# usage: binlog2text.pl [-j] [file ...]
+#
+# a log is a sequence of records, each record is a 32-bit length of the
+# rest of the record, a type byte, and a 32-bit format id; integers are
+# in network byte order.  Schema records ('S') carry the format name and
+# the type and the name of each field, data records ('R') carry fields:
+#
+#   H  16-bit unsigned ($status)
+#   I  32-bit milliseconds ($request_time)
+#   Q  64-bit unsigned ($bytes_sent, $body_bytes_sent, $request_length)
+#   T  64-bit milliseconds since the Epoch ($msec, $time_local, ...)
+#   S  16-bit length and raw bytes, the length 0xffff if not found
+
+
+use warnings;
+use strict;
+
+my $json = 0;
+
+if (@ARGV && $ARGV[0] eq '-j') {
+	$json = 1;
+	shift @ARGV;
+}
+
+my %schemas;
+
+push @ARGV, '-' unless @ARGV;
+
+for my $file (@ARGV) {
+	my $fh;
+
+	if ($file eq '-') {
+		$fh = \*STDIN;
+	} else {
+		open($fh, '<', $file) or die "cannot open $file: $!\n";
+	}
+
+	binmode $fh;
+
+	while (1) {
+		my $hdr = readn($fh, 4, $file);
+		last unless defined $hdr;
+
+		my $len = unpack('N', $hdr);
+		my $rec = readn($fh, $len, $file);
+
+		die "$file: truncated record\n"
+			unless defined $rec && $len >= 5;
+
+		my ($type, $id) = unpack('a N', $rec);
+
+		if ($type eq 'S') {
+			$schemas{$id} = schema(substr($rec, 5), $file);
+			next;
+		}
+
+		die "$file: unknown record type\n" unless $type eq 'R';
+
+		my $schema = $schemas{$id}
+			or die "$file: record of an unknown format $id\n";
+
+		output($schema, fields($schema, substr($rec, 5), $file));
+	}
+
+	close $fh unless $file eq '-';
+}
+
+
+sub readn {
+	my ($fh, $n, $file) = @_;
+	my $buf = '';
+
+	while (length($buf) < $n) {
+		my $rc = read($fh, $buf, $n - length($buf), length($buf));
+		die "$file: $!\n" unless defined $rc;
+		last if $rc == 0;
+	}
+
+	return undef if length($buf) == 0 && $n > 0;
+	die "$file: truncated record\n" if length($buf) < $n;
+
+	return $buf;
+}
+
+
+sub schema {
+	my ($data, $file) = @_;
+
+	my ($name, $n, $rest) = unpack('C/a C a*', $data);
+	my @fields;
+
+	for (1 .. $n) {
+		my ($type, $field);
+		($type, $field, $rest) = unpack('a C/a a*', $rest);
+		push @fields, [ $type, $field ];
+	}
+
+	return { name => $name, fields => \@fields };
+}
+
+
+sub fields {
+	my ($schema, $data, $file) = @_;
+	my @values;
+	my $pos = 0;
+
+	for my $f (@{$schema->{fields}}) {
+		my $type = $f->[0];
+		my $value;
+
+		if ($type eq 'H') {
+			$value = unpack("x$pos n", $data);
+			$pos += 2;
+
+		} elsif ($type eq 'I') {
+			my $ms = unpack("x$pos N", $data);
+			$value = sprintf('%d.%03d', int($ms / 1000), $ms % 1000);
+			$pos += 4;
+
+		} elsif ($type eq 'Q' || $type eq 'T') {
+			my ($hi, $lo) = unpack("x$pos N N", $data);
+			$value = $hi * 4294967296 + $lo;
+			$pos += 8;
+
+			$value = sprintf('%d.%03d', int($value / 1000), $value % 1000)
+				if $type eq 'T';
+
+		} elsif ($type eq 'S') {
+			my $len = unpack("x$pos n", $data);
+			$pos += 2;
+
+			if ($len == 0xffff) {
+				$value = undef;
+
+			} else {
+				$value = substr($data, $pos, $len);
+				$pos += $len;
+			}
+
+		} else {
+			die "$file: unknown field type \"$type\"\n";
+		}
+
+		die "$file: truncated record\n" if $pos > length($data);
+
+		push @values, $value;
+	}
+
+	return @values;
+}
+
+
+sub output {
+	my ($schema, @values) = @_;
+	my @fields = @{$schema->{fields}};
+
+	if (!$json) {
+		print join(' ', map { defined $_ ? $_ : '-' } @values), "\n";
+		return;
+	}
+
+	my @pairs;
+
+	for my $i (0 .. $#fields) {
+		my ($type, $name) = @{$fields[$i]};
+		my $value = $values[$i];
+
+		if (!defined $value) {
+			$value = 'null';
+
+		} elsif ($type eq 'S') {
+			$value = json_string($value);
+		}
+
+		push @pairs, json_string($name) . ':' . $value;
+	}
+
+	print '{', join(',', @pairs), "}\n";
+}
+
+
+sub json_string {
+	my ($s) = @_;
+
+	$s =~ s/(["\\])/\\$1/g;
+	$s =~ s/([\x00-\x1f])/sprintf('\\u%04x', ord($1))/ge;
+
+	return '"' . $s . '"';
+}
@@ -0,0 +1,115 @@
+#!/bin/sh
+
+# HTTP/2 frame scheduling load: many concurrent streams per connection
+# with small stream windows, so that most DATA frames wait in the output
+# queues and the scheduler runs once per frame.  Reports the wall clock
+# request rate and the CPU time spent by the worker per request.
+#
+# Usage: sh misc/h2bench.sh objs/nginx [clients] [rounds] [files] [multiply]
+#
+# Each client runs "rounds" connections of files * multiply streams.
+# H2BENCH_SIZE and H2BENCH_WINDOW set the smallest response size and
+# the stream window bits of the client, H2BENCH_PORT the port to use.
+# Requires nghttp from nghttp2, or set NGHTTP.
+
+NGINX=${1:?usage: $0 nginx [clients] [rounds] [files] [multiply]}
+CLIENTS=${2:-4}
+ROUNDS=${3:-20}
+FILES=${4:-32}
+MULTIPLY=${5:-8}
+
+SIZE=${H2BENCH_SIZE:-16384}
+WINDOW=${H2BENCH_WINDOW:-14}
+PORT=${H2BENCH_PORT:-18443}
+NGHTTP=${NGHTTP:-nghttp}
+
+case $NGINX in
+    /*) ;;
+    *)  NGINX=`pwd`/$NGINX ;;
+esac
+
+DIR=`mktemp -d /tmp/h2bench.XXXXXX` || exit 1
+trap 'kill `cat $DIR/nginx.pid 2>/dev/null` 2>/dev/null; rm -rf $DIR' 0
+
+chmod 755 $DIR
+mkdir $DIR/logs $DIR/html
+
+URLS=
+i=0
+
+while [ $i -lt $FILES ]; do
+    head -c $((SIZE + i * 1024)) /dev/zero > $DIR/html/f$i
+    URLS="$URLS http://127.0.0.1:$PORT/f$i"
+    i=$((i + 1))
+done
+
+cat > $DIR/nginx.conf << END
+daemon on;
+worker_processes 1;
+error_log $DIR/logs/error.log;
+pid $DIR/nginx.pid;
+
+events {
+}
+
+http {
+    access_log off;
+
+    server {
+        listen 127.0.0.1:$PORT http2;
+        http2_max_concurrent_streams 1024;
+        root $DIR/html;
+    }
+}
+END
+
+$NGINX -p $DIR/ -c $DIR/nginx.conf || exit 1
+
+for n in 1 2 3 4 5 6 7 8 9 10; do
+    [ -s $DIR/nginx.pid ] && break
+    sleep 0.1
+done
+
+WORKER=`pgrep -P \`cat $DIR/nginx.pid\``
+
+cpu() {
+    awk '{ print $14 + $15 }' /proc/$WORKER/stat
+}
+
+client() {
+    r=0
+
+    while [ $r -lt $ROUNDS ]; do
+        $NGHTTP -n -w $WINDOW -m $MULTIPLY $URLS || echo failed
+        r=$((r + 1))
+    done
+}
+
+CPU0=`cpu`
+START=`date +%s.%N`
+
+c=0
+
+while [ $c -lt $CLIENTS ]; do
+    client > $DIR/client$c.log 2>&1 &
+    c=$((c + 1))
+done
+
+wait
+
+END=`date +%s.%N`
+CPU1=`cpu`
+
+cat $DIR/client*.log $DIR/logs/error.log | grep -c . \
+    | awk '{ if ($1) print "errors:", $1 }'
+
+awk -v c=$CLIENTS -v r=$ROUNDS -v f=$FILES -v m=$MULTIPLY \
+    -v s=$START -v e=$END -v u0=$CPU0 -v u1=$CPU1 \
+    -v hz=`getconf CLK_TCK` '
+BEGIN {
+    n = c * r * f * m;
+    printf "requests: %d, streams per connection: %d\n", n, f * m;
+    printf "time: %.2fs, %.0f req/s\n", e - s, n / (e - s);
+    printf "worker cpu: %.2fs, %.1f us/req\n", (u1 - u0) / hz,
+           (u1 - u0) / hz * 1000000 / n;
+}'
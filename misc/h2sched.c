@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * HTTP/2 frame scheduling microbenchmark.  A connection keeps a backlog
+ * of one DATA frame per stream; in each round every stream queues one
+ * more frame, then the output queue is sent as it is done by
+ * ngx_http_v2_send_output_queue(), with the socket accepting only as
+ * many frames as there are streams.
+ *
+ * Build it in a configured and built tree with HTTP/2:
+ *
+ *     cc -O2 -o objs/h2sched misc/h2sched.c -I src/core -I src/event \
+ *         -I src/event/modules -I src/os/unix -I objs -I src/http \
+ *         -I src/http/modules -I src/http/v2
+ *
+ *     objs/h2sched [streams] [rounds]
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <time.h>
+
+
+static ngx_uint_t ngx_h2sched_send(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t budget);
+
+
+int
+main(int argc, char *argv[])
+{
+    double                     ns;
+    ngx_uint_t                 i, r, streams, rounds, sent, *next;
+    struct timespec            start, end;
+    ngx_http_v2_node_t        *nodes;
+    ngx_http_v2_stream_t      *s;
+    ngx_http_v2_out_frame_t   *frames, *f;
+    ngx_http_v2_connection_t   h2c;
+
+    streams = (argc > 1) ? (ngx_uint_t) atoi(argv[1]) : 256;
+    rounds = (argc > 2) ? (ngx_uint_t) atoi(argv[2]) : 10000;
+
+    if (streams == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [streams] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    nodes = calloc(streams, sizeof(ngx_http_v2_node_t));
+    s = calloc(streams, sizeof(ngx_http_v2_stream_t));
+
+    /* frames are recycled, a stream has at most two of them queued */
+
+    frames = calloc(2 * streams, sizeof(ngx_http_v2_out_frame_t));
+    next = calloc(streams, sizeof(ngx_uint_t));
+
+    if (nodes == NULL || s == NULL || frames == NULL || next == NULL) {
+        return 1;
+    }
+
+    ngx_memzero(&h2c, sizeof(ngx_http_v2_connection_t));
+
+    for (i = 0; i < streams; i++) {
+        nodes[i].id = 2 * i + 1;
+        nodes[i].urgency = i % NGX_HTTP_V2_URGENCY_LEVELS;
+
+        s[i].node = &nodes[i];
+
+        frames[2 * i].stream = &s[i];
+        frames[2 * i + 1].stream = &s[i];
+    }
+
+    for (i = 0; i < streams; i++) {
+        ngx_http_v2_queue_frame(&h2c, &frames[2 * i]);
+        s[i].queued++;
+        next[i] = 1;
+    }
+
+    sent = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (r = 0; r < rounds; r++) {
+
+        for (i = 0; i < streams; i++) {
+
+            if (s[i].queued == 2) {
+                continue;
+            }
+
+            f = &frames[2 * i + next[i]];
+            next[i] ^= 1;
+
+            ngx_http_v2_queue_frame(&h2c, f);
+            s[i].queued++;
+        }
+
+        sent += ngx_h2sched_send(&h2c, streams);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    printf("streams: %lu, frames sent: %lu, %.1f ns/frame, "
+           "%.0f frames/s\n", (unsigned long) streams,
+           (unsigned long) sent, ns / sent, sent * 1e9 / ns);
+
+    return 0;
+}
+
+
+static ngx_uint_t
+ngx_h2sched_send(ngx_http_v2_connection_t *h2c, ngx_uint_t budget)
+{
+    ngx_uint_t                n;
+    ngx_http_v2_out_frame_t  *out, *frame, *fn;
+
+    ngx_http_v2_dequeue_frames(h2c);
+
+    out = NULL;
+
+    for (frame = h2c->last_out; frame; frame = fn) {
+        fn = frame->next;
+        frame->next = out;
+        out = frame;
+    }
+
+    for (n = 0; out && n < budget; out = out->next, n++) {
+        out->stream->queued--;
+    }
+
+    frame = NULL;
+
+    for ( /* void */ ; out; out = fn) {
+        fn = out->next;
+        out->next = frame;
+        frame = out;
+    }
+
+    h2c->last_out = frame;
+
+    ngx_http_v2_requeue_frames(h2c);
+
+    return n;
+}
@@ -0,0 +1,228 @@
+#!/usr/bin/perl
+
+# Tests for proxy_coalesce: a stalled follower must not hold up
+# the leader and the other followers.
+#
+# Usage: TEST_NGINX_BINARY=objs/nginx prove misc/tests/proxy_coalesce.t
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use File::Temp qw/ tempdir /;
+use POSIX ();
+use IO::Select;
+use IO::Socket::INET;
+use Socket qw/ SOL_SOCKET SO_RCVBUF inet_aton pack_sockaddr_in /;
+use Time::HiRes qw/ sleep time /;
+
+use constant CRLF => "\x0d\x0a";
+
+###############################################################################
+
+my $nginx = $ENV{TEST_NGINX_BINARY}
+    or plan(skip_all => 'TEST_NGINX_BINARY is not set');
+
+plan(tests => 4);
+
+alarm(60);
+
+my $port = 18080;
+my $backend_port = 18081;
+my $size = 16 * 1024 * 1024;
+
+my $d = tempdir('nginx-test-XXXXXXXX', TMPDIR => 1,
+    CLEANUP => not $ENV{TEST_NGINX_LEAVE});
+mkdir "$d/logs";
+
+open my $fh, '>', "$d/nginx.conf" or die "Can't create nginx.conf: $!";
+print $fh <<"EOF";
+daemon off;
+master_process off;
+error_log $d/error.log info;
+pid $d/nginx.pid;
+
+events {
+}
+
+http {
+    access_log off;
+    client_body_temp_path $d/client_body_temp;
+    proxy_temp_path $d/proxy_temp;
+
+    server {
+        listen 127.0.0.1:$port;
+
+        location / {
+            proxy_pass http://127.0.0.1:$backend_port;
+            proxy_coalesce on;
+            proxy_buffers 4 16k;
+            proxy_read_timeout 5s;
+        }
+    }
+}
+EOF
+close $fh;
+
+my ($backend, $pid);
+
+END {
+    kill 'TERM', grep { $_ } $backend, $pid;
+}
+
+$backend = start_backend();
+$pid = start_nginx();
+
+# the leader, then a stalled follower and three fast ones
+
+my $leader = request();
+sleep 0.2;
+
+my $slow = request(4096);
+my @fast = map { request() } 1 .. 3;
+
+my %done = read_all(10, $leader, @fast);
+
+is($done{$leader}, $size, 'leader got the whole response');
+is(scalar(grep { $done{$_} == $size } @fast), 3,
+    'fast followers got the whole response');
+
+my $got = drain($slow);
+cmp_ok($got, '<', $size, 'stalled follower is detached');
+
+close $_ for $leader, $slow, @fast;
+
+kill 'TERM', $pid;
+waitpid($pid, 0);
+
+like(slurp("$d/error.log"), qr/client is too slow for coalesced response/,
+    'detach logged');
+
+###############################################################################
+
+sub request {
+    my ($rcvbuf) = @_;
+
+    my $s = IO::Socket::INET->new(Proto => 'tcp');
+
+    setsockopt($s, SOL_SOCKET, SO_RCVBUF, $rcvbuf) if $rcvbuf;
+
+    $s->connect(pack_sockaddr_in($port, inet_aton('127.0.0.1')))
+        or die "Can't connect to nginx: $!";
+
+    $s->syswrite("GET /file HTTP/1.0" . CRLF . "Host: localhost" . CRLF
+        . CRLF);
+
+    return $s;
+}
+
+sub read_all {
+    my ($timeout, @socks) = @_;
+
+    my (%body, %header, %in_body);
+    my $sel = IO::Select->new(@socks);
+    my $end = time() + $timeout;
+
+    while ($sel->count && time() < $end) {
+        for my $s ($sel->can_read(0.5)) {
+            my $n = $s->sysread(my $buf, 65536);
+
+            if (!$n) {
+                $sel->remove($s);
+                next;
+            }
+
+            if ($in_body{$s}) {
+                $body{$s} += $n;
+                next;
+            }
+
+            $header{$s} .= $buf;
+
+            if ($header{$s} =~ /\x0d\x0a\x0d\x0a(.*)\z/s) {
+                $body{$s} = length $1;
+                $in_body{$s} = 1;
+            }
+        }
+    }
+
+    return map { $_ => $body{$_} || 0 } @socks;
+}
+
+sub drain {
+    my ($s) = @_;
+
+    my %r = read_all(10, $s);
+    return $r{$s};
+}
+
+sub start_backend {
+    my $server = IO::Socket::INET->new(
+        Proto => 'tcp',
+        LocalAddr => "127.0.0.1:$backend_port",
+        Listen => 5,
+        Reuse => 1
+    ) or die "Can't create backend socket: $!";
+
+    my $pid = fork();
+    die "Can't fork: $!" unless defined $pid;
+
+    return $pid if $pid;
+
+    $SIG{PIPE} = 'IGNORE';
+
+    while (my $client = $server->accept()) {
+        while (<$client>) {
+            last if /^\x0d?\x0a?$/;
+        }
+
+        # let the followers join while the leader waits for the header
+
+        sleep 1;
+
+        print $client "HTTP/1.1 200 OK" . CRLF
+            . "Content-Length: $size" . CRLF
+            . "Connection: close" . CRLF . CRLF;
+
+        my $chunk = 'x' x 65536;
+
+        for (1 .. $size / 65536) {
+            print $client $chunk;
+            sleep 0.01;
+        }
+
+        close $client;
+    }
+
+    POSIX::_exit(0);
+}
+
+sub start_nginx {
+    my $pid = fork();
+    die "Can't fork: $!" unless defined $pid;
+
+    if ($pid == 0) {
+        { exec($nginx, '-p', "$d/", '-c', "$d/nginx.conf") };
+        POSIX::_exit(1);
+    }
+
+    for (1 .. 50) {
+        last if -e "$d/nginx.pid";
+        sleep 0.1;
+    }
+
+    return $pid;
+}
+
+sub slurp {
+    my ($file) = @_;
+
+    local $/;
+    open my $fh, '<', $file or return '';
+    return <$fh>;
+}
+
+###############################################################################
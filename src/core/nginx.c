@@ -95,6 +95,13 @@ static ngx_command_t  ngx_core_commands[] = {
       0,
       NULL },
 
+    { ngx_string("cache_manager_processes"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_core_conf_t, cache_manager_processes),
+      NULL },
+
     // ֌WȂ
     // fobOɎgp
     { ngx_string("debug_points"),
@@ -1344,6 +1351,7 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->shutdown_timeout = NGX_CONF_UNSET_MSEC;
 
     ccf->worker_processes = NGX_CONF_UNSET;
+    ccf->cache_manager_processes = NGX_CONF_UNSET;
     ccf->debug_points = NGX_CONF_UNSET;
 
     ccf->rlimit_nofile = NGX_CONF_UNSET;
@@ -1381,8 +1389,15 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_msec_value(ccf->shutdown_timeout, 0);
 
     ngx_conf_init_value(ccf->worker_processes, 1);
+    ngx_conf_init_value(ccf->cache_manager_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
 
+    if (ccf->cache_manager_processes < 1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "\"cache_manager_processes\" must be at least 1");
+        return NGX_CONF_ERROR;
+    }
+
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (!ccf->cpu_affinity_auto
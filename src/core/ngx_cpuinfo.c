@@ -9,6 +9,9 @@
 #include <ngx_core.h>
 
 
+ngx_uint_t  ngx_cpu_sse42;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
@@ -119,6 +122,10 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    /* CPUID.01H:ECX.SSE4_2[bit 20] */
+
+    ngx_cpu_sse42 = (cpu[3] & 0x100000) ? 1 : 0;
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
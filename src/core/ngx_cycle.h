@@ -140,6 +140,7 @@ typedef struct {
 
     // [JvZX̐w肷
     ngx_int_t                 worker_processes;
+    ngx_int_t                 cache_manager_processes;
     ngx_int_t                 debug_points;
 
     ngx_int_t                 rlimit_nofile;
@@ -9,6 +9,122 @@
 #include <ngx_core.h>
 
 
+#if (NGX_SWISS_HASH)
+
+/*
+ * Open addressing hash tables: slots are split into groups of 16, and
+ * each slot has a control byte, either 0 for an empty slot or 0x80 with
+ * 7 bits of the hash as a tag.  A lookup probes the tags of a whole group
+ * at once and compares keys only for matching tags.  As elements are
+ * never deleted, a group with an empty slot ends the probe sequence.
+ */
+
+#if (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#define NGX_HASH_GROUP  16
+
+
+static ngx_inline uint32_t
+ngx_hash_mix(ngx_uint_t key)
+{
+    uint32_t  h;
+
+    h = (uint32_t) ((uint64_t) key ^ ((uint64_t) key >> 32));
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_hash_group_match(u_char *ctrl, u_char tag)
+{
+#if (__SSE2__)
+
+    __m128i  group;
+
+    group = _mm_loadu_si128((__m128i *) ctrl);
+
+    return (ngx_uint_t) _mm_movemask_epi8(
+                             _mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+
+#else
+
+    ngx_uint_t  i, mask;
+
+    mask = 0;
+
+    for (i = 0; i < NGX_HASH_GROUP; i++) {
+        if (ctrl[i] == tag) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+
+#endif
+}
+
+#endif
+
+
+#if (NGX_SWISS_HASH)
+
+void *
+ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
+{
+    u_char          *ctrl, tag;
+    uint32_t         h;
+    ngx_uint_t       i, g, mask, probe, ngroups;
+    ngx_hash_elt_t  *elt;
+
+    h = ngx_hash_mix(key);
+    tag = (u_char) (0x80 | (h & 0x7f));
+
+    ngroups = hash->size / NGX_HASH_GROUP;
+    g = (h >> 7) & (ngroups - 1);
+
+    for (probe = 1; /* void */ ; probe++) {
+
+        ctrl = hash->ctrl + g * NGX_HASH_GROUP;
+
+        for (mask = ngx_hash_group_match(ctrl, tag), i = 0;
+             mask;
+             mask >>= 1, i++)
+        {
+            if ((mask & 1) == 0) {
+                continue;
+            }
+
+            elt = hash->buckets[g * NGX_HASH_GROUP + i];
+
+            if (len == (size_t) elt->len
+                && ngx_memcmp(name, elt->name, len) == 0)
+            {
+                return elt->value;
+            }
+        }
+
+        if (ngx_hash_group_match(ctrl, 0)) {
+            return NULL;
+        }
+
+        /* triangular probing visits every group of a power of 2 table */
+
+        g = (g + probe) & (ngroups - 1);
+    }
+}
+
+#else
+
 /**
  * @brief
  *     ̃nbVe[uÃL[găo[TĕԂ
@@ -53,6 +169,8 @@ ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
     return NULL;
 }
 
+#endif
+
 
 void *
 ngx_hash_find_wc_head(ngx_hash_wildcard_t *hwc, u_char *name, size_t len)
@@ -254,6 +372,121 @@ ngx_hash_find_combined(ngx_hash_combined_t *hash, ngx_uint_t key, u_char *name,
 #define NGX_HASH_ELT_SIZE(name)                                               \
     (sizeof(void *) + ngx_align((name)->key.len + 2, sizeof(void *)))
 
+#if (NGX_SWISS_HASH)
+
+ngx_int_t
+ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
+{
+    u_char          *elts, *ctrl;
+    size_t           len;
+    uint32_t         h;
+    ngx_uint_t       i, n, g, mask, probe, size, ngroups;
+    ngx_hash_elt_t  *elt, **buckets;
+
+    /*
+     * the table is sized directly from the number of keys, so
+     * hinit->max_size and hinit->bucket_size are not used
+     */
+
+    len = 0;
+    i = 0;
+
+    for (n = 0; n < nelts; n++) {
+        if (names[n].key.data == NULL) {
+            continue;
+        }
+
+        if (names[n].key.len > 65535) {
+            ngx_log_error(NGX_LOG_EMERG, hinit->pool->log, 0,
+                          "could not build %s, too long key \"%V\"",
+                          hinit->name, &names[n].key);
+            return NGX_ERROR;
+        }
+
+        len += NGX_HASH_ELT_SIZE(&names[n]);
+        i++;
+    }
+
+    /* keep the load factor at most 7/8 */
+
+    for (ngroups = 1; ngroups * NGX_HASH_GROUP * 7 < i * 8; ngroups *= 2) {
+        /* void */
+    }
+
+    size = ngroups * NGX_HASH_GROUP;
+
+    if (hinit->hash == NULL) {
+        hinit->hash = ngx_pcalloc(hinit->pool, sizeof(ngx_hash_wildcard_t));
+        if (hinit->hash == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    buckets = ngx_pcalloc(hinit->pool,
+                          size * sizeof(ngx_hash_elt_t *) + size);
+    if (buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctrl = (u_char *) &buckets[size];
+
+    elts = ngx_palloc(hinit->pool, len + ngx_cacheline_size);
+    if (elts == NULL) {
+        return NGX_ERROR;
+    }
+
+    elts = ngx_align_ptr(elts, ngx_cacheline_size);
+
+    for (n = 0; n < nelts; n++) {
+        if (names[n].key.data == NULL) {
+            continue;
+        }
+
+        elt = (ngx_hash_elt_t *) elts;
+        elts += NGX_HASH_ELT_SIZE(&names[n]);
+
+        elt->value = names[n].value;
+        elt->len = (u_short) names[n].key.len;
+
+        ngx_strlow(elt->name, names[n].key.data, names[n].key.len);
+
+        /*
+         * the first free slot on the probe sequence, so duplicate keys
+         * are found in the order they were added
+         */
+
+        h = ngx_hash_mix(names[n].key_hash);
+        g = (h >> 7) & (ngroups - 1);
+
+        for (probe = 1; /* void */ ; probe++) {
+            mask = ngx_hash_group_match(ctrl + g * NGX_HASH_GROUP, 0);
+
+            if (mask) {
+                break;
+            }
+
+            g = (g + probe) & (ngroups - 1);
+        }
+
+        for (i = 0; (mask & 1) == 0; i++) {
+            mask >>= 1;
+        }
+
+        i += g * NGX_HASH_GROUP;
+
+        ctrl[i] = (u_char) (0x80 | (h & 0x7f));
+        buckets[i] = elt;
+    }
+
+    hinit->hash->buckets = buckets;
+    hinit->hash->size = size;
+    hinit->hash->ctrl = ctrl;
+
+    return NGX_OK;
+}
+
+#else
+
 /**
  * @brief
  *     nbVe[u쐬
@@ -500,6 +733,8 @@ found:
     return NGX_OK;
 }
 
+#endif
+
 
 ngx_int_t
 ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
@@ -35,6 +35,9 @@ typedef struct {
     ngx_hash_elt_t  **buckets;
     // nbVĂ邩
     ngx_uint_t        size;
+#if (NGX_SWISS_HASH)
+    u_char           *ctrl;
+#endif
 } ngx_hash_t;
 
 
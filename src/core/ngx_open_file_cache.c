@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 /*
  * open file cache caches
@@ -21,6 +25,31 @@
 #define NGX_MIN_READ_AHEAD  (128 * 1024)
 
 
+typedef struct ngx_open_file_waiter_s  ngx_open_file_waiter_t;
+
+struct ngx_open_file_waiter_s {
+    ngx_event_t              *event;
+    ngx_open_file_waiter_t   *next;
+};
+
+
+/* an open() and stat() done in a thread pool on a cache miss */
+
+typedef struct {
+    ngx_queue_t               queue;
+    ngx_str_t                 name;
+    ngx_open_file_info_t      of;
+    ngx_int_t                 rc;
+    ngx_open_file_waiter_t   *waiters;
+    ngx_event_t               event;
+#if (NGX_THREADS)
+    ngx_thread_task_t         task;
+#endif
+    unsigned                  done:1;
+    unsigned                  consumed:1;
+} ngx_open_file_pending_t;
+
+
 static void ngx_open_file_cache_cleanup(void *data);
 #if (NGX_HAVE_OPENAT)
 static ngx_fd_t ngx_openat_file_owner(ngx_fd_t at_fd, const u_char *name,
@@ -35,6 +64,20 @@ static ngx_fd_t ngx_open_file_wrapper(ngx_str_t *name,
     ngx_int_t access, ngx_log_t *log);
 static ngx_int_t ngx_file_info_wrapper(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_file_info_t *fi, ngx_log_t *log);
+static ngx_uint_t ngx_open_file_valid(ngx_cached_open_file_t *file,
+    ngx_open_file_info_t *of, time_t now);
+static ngx_int_t ngx_open_file_stat(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_open_file_pending_t *p, ngx_log_t *log);
+#if (NGX_THREADS)
+static ngx_int_t ngx_open_file_thread(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, ngx_open_file_info_t *of, ngx_pool_t *pool,
+    ngx_open_file_pending_t **pending);
+static ngx_int_t ngx_open_file_thread_wait(ngx_open_file_pending_t *p,
+    ngx_open_file_info_t *of, ngx_pool_t *pool);
+static void ngx_open_file_thread_handler(void *data, ngx_log_t *log);
+static void ngx_open_file_thread_event_handler(ngx_event_t *ev);
+static void ngx_open_file_thread_cleanup(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_open_and_stat_file(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_log_t *log);
 static void ngx_open_file_add_event(ngx_open_file_cache_t *cache,
@@ -73,6 +116,11 @@ ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
     cache->max = max;
     cache->inactive = inactive;
 
+#if (NGX_THREADS || NGX_COMPAT)
+    cache->thread_pool = NULL;
+    ngx_queue_init(&cache->pending);
+#endif
+
     cln = ngx_pool_cleanup_add(pool, 0);
     if (cln == NULL) {
         return NULL;
@@ -151,6 +199,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
     ngx_pool_cleanup_file_t        *clnf;
+    ngx_open_file_pending_t        *pending;
     ngx_open_file_cache_cleanup_t  *ofcln;
 
     of->fd = NGX_INVALID_FILE;
@@ -208,6 +257,26 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     file = ngx_open_file_lookup(cache, name, hash);
 
+    pending = NULL;
+
+#if (NGX_THREADS)
+
+    if (cache->thread_pool
+        && of->thread_event
+        && (file == NULL
+            || (file->fd == NGX_INVALID_FILE && file->err == 0
+                && !file->is_dir)
+            || !ngx_open_file_valid(file, of, now)))
+    {
+        rc = ngx_open_file_thread(cache, name, of, pool, &pending);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+#endif
+
     if (file) {
 
         file->uses++;
@@ -218,7 +287,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             /* file was not used often enough to keep open */
 
-            rc = ngx_open_and_stat_file(name, of, pool->log);
+            rc = ngx_open_file_stat(name, of, pending, pool->log);
 
             if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
                 goto failed;
@@ -227,16 +296,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             goto add_event;
         }
 
-        if (file->use_event
-            || (file->event == NULL
-                && (of->uniq == 0 || of->uniq == file->uniq)
-                && now - file->created < of->valid
-#if (NGX_HAVE_OPENAT)
-                && of->disable_symlinks == file->disable_symlinks
-                && of->disable_symlinks_from == file->disable_symlinks_from
-#endif
-            ))
-        {
+        if (ngx_open_file_valid(file, of, now)) {
             if (file->err == 0) {
 
                 of->fd = file->fd;
@@ -286,7 +346,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
         of->fd = file->fd;
         of->uniq = file->uniq;
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_file_stat(name, of, pending, pool->log);
 
         if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
             goto failed;
@@ -351,7 +411,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
-    rc = ngx_open_and_stat_file(name, of, pool->log);
+    rc = ngx_open_file_stat(name, of, pending, pool->log);
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
         goto failed;
@@ -836,6 +896,238 @@ ngx_file_info_wrapper(ngx_str_t *name, ngx_open_file_info_t *of,
 }
 
 
+static ngx_uint_t
+ngx_open_file_valid(ngx_cached_open_file_t *file, ngx_open_file_info_t *of,
+    time_t now)
+{
+    return file->use_event
+           || (file->event == NULL
+               && (of->uniq == 0 || of->uniq == file->uniq)
+               && now - file->created < of->valid
+#if (NGX_HAVE_OPENAT)
+               && of->disable_symlinks == file->disable_symlinks
+               && of->disable_symlinks_from == file->disable_symlinks_from
+#endif
+              );
+}
+
+
+static ngx_int_t
+ngx_open_file_stat(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_open_file_pending_t *p, ngx_log_t *log)
+{
+    if (p == NULL) {
+        return ngx_open_and_stat_file(name, of, log);
+    }
+
+    /* use the result of ngx_open_and_stat_file() done in a thread */
+
+    p->consumed = 1;
+
+    if (p->rc != NGX_OK) {
+        of->fd = NGX_INVALID_FILE;
+        of->err = p->of.err;
+        of->failed = p->of.failed;
+
+        return p->rc;
+    }
+
+    if (of->fd != NGX_INVALID_FILE && of->uniq == p->of.uniq) {
+
+        /* the file was not changed, keep the cached descriptor */
+
+        if (p->of.fd != NGX_INVALID_FILE
+            && ngx_close_file(p->of.fd) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", name);
+        }
+
+    } else {
+        of->fd = p->of.fd;
+        of->is_directio = p->of.is_directio;
+    }
+
+    of->uniq = p->of.uniq;
+    of->mtime = p->of.mtime;
+    of->size = p->of.size;
+    of->fs_size = p->of.fs_size;
+    of->is_dir = p->of.is_dir;
+    of->is_file = p->of.is_file;
+    of->is_link = p->of.is_link;
+    of->is_exec = p->of.is_exec;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * a miss is resolved in a thread pool, concurrent misses for the same
+ * file wait for the same task; NGX_OK is returned with a completed result
+ * in *pending or, if the task could not be posted, with NULL there
+ */
+
+static ngx_int_t
+ngx_open_file_thread(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_pool_t *pool,
+    ngx_open_file_pending_t **pending)
+{
+    ngx_queue_t              *q;
+    ngx_open_file_pending_t  *p;
+
+    for (q = ngx_queue_head(&cache->pending);
+         q != ngx_queue_sentinel(&cache->pending);
+         q = ngx_queue_next(q))
+    {
+        p = ngx_queue_data(q, ngx_open_file_pending_t, queue);
+
+        if (p->name.len != name->len
+            || ngx_strncmp(p->name.data, name->data, name->len) != 0
+            || p->of.directio != of->directio
+#if (NGX_HAVE_OPENAT)
+            || p->of.disable_symlinks != of->disable_symlinks
+            || p->of.disable_symlinks_from != of->disable_symlinks_from
+#endif
+           )
+        {
+            continue;
+        }
+
+        if (!p->done) {
+            return ngx_open_file_thread_wait(p, of, pool);
+        }
+
+        /* an error is not cached with "open_file_cache_errors off" */
+
+        if (!p->consumed || p->rc != NGX_OK) {
+            *pending = p;
+            return NGX_OK;
+        }
+    }
+
+    p = ngx_calloc(sizeof(ngx_open_file_pending_t) + name->len + 1,
+                   pool->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p->name.len = name->len;
+    p->name.data = (u_char *) p + sizeof(ngx_open_file_pending_t);
+    ngx_cpystrn(p->name.data, name->data, name->len + 1);
+
+    p->of = *of;
+    p->of.fd = NGX_INVALID_FILE;
+    p->of.test_dir = 0;
+    p->of.thread_event = NULL;
+
+    p->task.ctx = p;
+    p->task.handler = ngx_open_file_thread_handler;
+    p->task.event.data = p;
+    p->task.event.handler = ngx_open_file_thread_event_handler;
+    p->task.event.log = ngx_cycle->log;
+
+    p->event.data = p;
+    p->event.handler = ngx_open_file_thread_cleanup;
+    p->event.log = ngx_cycle->log;
+
+    if (ngx_open_file_thread_wait(p, of, pool) != NGX_AGAIN) {
+        ngx_free(p);
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_task_post(cache->thread_pool, &p->task) != NGX_OK) {
+        ngx_free(p);
+        return NGX_OK;
+    }
+
+    ngx_queue_insert_tail(&cache->pending, &p->queue);
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_open_file_thread_wait(ngx_open_file_pending_t *p, ngx_open_file_info_t *of,
+    ngx_pool_t *pool)
+{
+    ngx_open_file_waiter_t  *w;
+
+    w = ngx_palloc(pool, sizeof(ngx_open_file_waiter_t));
+    if (w == NULL) {
+        return NGX_ERROR;
+    }
+
+    w->event = of->thread_event;
+    w->next = p->waiters;
+    p->waiters = w;
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_open_file_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_open_file_pending_t  *p = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "thread open file: \"%V\"", &p->name);
+
+    p->rc = ngx_open_and_stat_file(&p->name, &p->of, log);
+}
+
+
+static void
+ngx_open_file_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_open_file_waiter_t   *w;
+    ngx_open_file_pending_t  *p;
+
+    p = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                   "thread open file done: %s, fd:%d",
+                   p->name.data, p->of.fd);
+
+    p->done = 1;
+
+    /*
+     * the first waiter to run adds the result to the cache, and the rest
+     * find it there; the result is released after all of them have run
+     */
+
+    for (w = p->waiters; w; w = w->next) {
+        ngx_post_event(w->event, &ngx_posted_events);
+    }
+
+    ngx_post_event(&p->event, &ngx_posted_events);
+}
+
+
+static void
+ngx_open_file_thread_cleanup(ngx_event_t *ev)
+{
+    ngx_open_file_pending_t  *p;
+
+    p = ev->data;
+
+    ngx_queue_remove(&p->queue);
+
+    if (!p->consumed && p->rc == NGX_OK && p->of.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(p->of.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", &p->name);
+        }
+    }
+
+    ngx_free(p);
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_open_and_stat_file(ngx_str_t *name, ngx_open_file_info_t *of,
     ngx_log_t *log)
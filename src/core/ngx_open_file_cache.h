@@ -48,6 +48,11 @@ typedef struct {
     unsigned                 is_link:1;
     unsigned                 is_exec:1;
     unsigned                 is_directio:1;
+
+#if (NGX_THREADS || NGX_COMPAT)
+    /* posted when an asynchronous open is complete, see ngx_open_cached_file */
+    ngx_event_t             *thread_event;
+#endif
 } ngx_open_file_info_t;
 
 
@@ -96,6 +101,11 @@ typedef struct {
     ngx_uint_t               current;
     ngx_uint_t               max;
     time_t                   inactive;
+
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_pool_t       *thread_pool;
+    ngx_queue_t              pending;
+#endif
 } ngx_open_file_cache_t;
 
 
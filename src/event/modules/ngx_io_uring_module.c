@@ -0,0 +1,1125 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The io_uring event method uses IORING_OP_POLL_ADD requests instead of
+ * epoll_ctl() calls.  Registration changes are only queued into
+ * the submission ring and are passed to the kernel together with waiting
+ * for completions in a single io_uring_enter() call per event loop
+ * iteration, so keepalive connections, which change their interest
+ * set on almost every request, do not cost separate syscalls.
+ *
+ * Connections added with NGX_CLEAR_EVENT use multishot polls and are
+ * handled as edge-triggered ones, just like in epoll; other events, e.g.,
+ * listening sockets, use oneshot polls that are rearmed after
+ * a notification, that is, they are level-triggered.
+ *
+ * The state of a poll request is kept in the read event index of
+ * the connection: the interest mask and the "armed" and "multishot" bits.
+ * The user data of a request is the connection slot and a 32-bit
+ * sequence number of the request.  The sequence numbers are kept per slot
+ * and are not reset when the slot is reused by another connection, this
+ * allows to ignore completions of the already replaced requests.
+ */
+
+
+#define NGX_IO_URING_MASK       0x0000ffff
+#define NGX_IO_URING_ARMED      0x00010000
+#define NGX_IO_URING_MULTISHOT  0x00020000
+
+/* sequence numbers start from 1, so the user data never match these */
+
+#define NGX_IO_URING_REMOVE     0
+#define NGX_IO_URING_NOTIFY     0xffffffff
+
+#define ngx_io_uring_data(slot, seq)                                          \
+    (((uint64_t) (seq) << 32) | (slot))
+
+
+typedef struct {
+    ngx_uint_t  entries;
+} ngx_io_uring_conf_t;
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_setup(ngx_cycle_t *cycle,
+    ngx_io_uring_conf_t *urcf);
+static ngx_int_t ngx_io_uring_probe(ngx_cycle_t *cycle);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_notify_poll(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_set_events(ngx_connection_t *c,
+    ngx_uint_t multishot);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_submit(ngx_log_t *log);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_io_uring_process_poll(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static int                   ring = -1;
+
+static u_char               *sq_ring;
+static size_t                sq_ring_size;
+static u_char               *cq_ring;
+static struct io_uring_sqe  *sqes;
+static size_t                sqes_size;
+static struct io_uring_cqe  *cqes;
+
+static uint32_t             *sq_head;
+static uint32_t             *sq_tail;
+static uint32_t              sq_mask;
+static uint32_t              sq_entries;
+static uint32_t              sq_pending;
+
+static uint32_t             *cq_head;
+static uint32_t             *cq_tail;
+static uint32_t              cq_mask;
+
+static uint32_t             *seqs;
+
+#if (NGX_HAVE_EVENTFD)
+static int                   notify_fd = -1;
+static ngx_event_t           notify_event;
+#endif
+
+extern ngx_module_t          ngx_epoll_module;
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        ngx_io_uring_add_connection,     /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage, the same way as it is done for Linux AIO.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_event_module_t   *module;
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (ring == -1) {
+
+        if (ngx_io_uring_setup(cycle, urcf) != NGX_OK) {
+
+            /* the kernel lacks the required io_uring features */
+
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "io_uring is not usable, falling back to epoll");
+
+            module = ngx_epoll_module.ctx;
+
+            return module->actions.init(cycle, timer);
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+    }
+
+    if (seqs == NULL) {
+        seqs = ngx_calloc(sizeof(uint32_t) * cycle->connection_n, cycle->log);
+        if (seqs == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_HAVE_FILE_AIO)
+
+    /*
+     * Linux AIO completions are reported via eventfd
+     * handled by the epoll module only
+     */
+
+    ngx_file_aio = 0;
+
+#endif
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    /* the events are reported with the same semantics as in epoll */
+
+#if (NGX_HAVE_CLEAR_EVENT)
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+#else
+    ngx_event_flags = NGX_USE_LEVEL_EVENT
+#endif
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_setup(ngx_cycle_t *cycle, ngx_io_uring_conf_t *urcf)
+{
+    size_t                   size;
+    uint32_t                *array, i;
+    struct io_uring_params   p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    ring = io_uring_setup(urcf->entries, &p);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if ((p.features & (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP
+                       |IORING_FEAT_EXT_ARG))
+        != (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG))
+    {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "io_uring features %08XD are not supported",
+                      p.features);
+        goto failed;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (size > sq_ring_size) {
+        sq_ring_size = size;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        sq_ring = NULL;
+        goto failed;
+    }
+
+    /* IORING_FEAT_SINGLE_MMAP: the completion ring shares the mapping */
+
+    cq_ring = sq_ring;
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        sqes = NULL;
+        goto failed;
+    }
+
+    sq_head = (uint32_t *) (sq_ring + p.sq_off.head);
+    sq_tail = (uint32_t *) (sq_ring + p.sq_off.tail);
+    sq_mask = *(uint32_t *) (sq_ring + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_pending = 0;
+
+    array = (uint32_t *) (sq_ring + p.sq_off.array);
+
+    for (i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    cq_head = (uint32_t *) (cq_ring + p.cq_off.head);
+    cq_tail = (uint32_t *) (cq_ring + p.cq_off.tail);
+    cq_mask = *(uint32_t *) (cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+
+    if (ngx_io_uring_probe(cycle) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_io_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_io_uring_probe(ngx_cycle_t *cycle)
+{
+    int                   n;
+    uint32_t              head;
+    ngx_int_t             rc;
+    struct io_uring_cqe  *cqe;
+    struct io_uring_sqe  *sqe;
+
+    /*
+     * multishot polls and poll updates were introduced together
+     * in Linux 5.13; older kernels reject the update with EINVAL,
+     * while newer ones report that there is no such request
+     */
+
+    sqe = ngx_io_uring_get_sqe(cycle->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) -1;
+    sqe->len = IORING_POLL_UPDATE_EVENTS|IORING_POLL_ADD_MULTI;
+    sqe->user_data = NGX_IO_URING_REMOVE;
+
+    n = io_uring_enter(ring, sq_pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    sq_pending = 0;
+
+    head = *cq_head;
+
+    ngx_memory_barrier();
+
+    if (head == *cq_tail) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "io_uring_enter() returned no completions");
+        return NGX_ERROR;
+    }
+
+    cqe = &cqes[head & cq_mask];
+
+    rc = (cqe->res == -ENOENT) ? NGX_OK : NGX_ERROR;
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, -cqe->res,
+                      "io_uring multishot poll is not supported");
+    }
+
+    ngx_memory_barrier();
+
+    *cq_head = head + 1;
+
+    return rc;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    if (ngx_io_uring_notify_poll(log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_notify_poll(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = notify_fd;
+    sqe->poll32_events = EPOLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = NGX_IO_URING_NOTIFY;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+    if (sqes) {
+        if (munmap(sqes, sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(io_uring sqes) failed");
+        }
+
+        sqes = NULL;
+    }
+
+    if (sq_ring) {
+        if (munmap(sq_ring, sq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(io_uring rings) failed");
+        }
+
+        sq_ring = NULL;
+        cq_ring = NULL;
+    }
+
+    if (ring != -1 && close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+    sq_pending = 0;
+
+    if (seqs) {
+        ngx_free(seqs);
+        seqs = NULL;
+    }
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d ev:%i fl:%Xi",
+                   c->fd, event, flags);
+
+    ev->active = 1;
+
+    return ngx_io_uring_set_events(c, flags & NGX_CLEAR_EVENT);
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d ev:%i fl:%Xi",
+                   c->fd, event, flags);
+
+    ev->active = 0;
+
+    /*
+     * unlike epoll, an io_uring poll request holds a reference to the file,
+     * so the request has to be removed even if the descriptor is closed
+     */
+
+    return ngx_io_uring_set_events(c, 0);
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    return ngx_io_uring_set_events(c, 1);
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return ngx_io_uring_set_events(c, 0);
+}
+
+
+static ngx_int_t
+ngx_io_uring_set_events(ngx_connection_t *c, ngx_uint_t multishot)
+{
+    uint32_t              events;
+    ngx_uint_t            state, slot;
+    struct io_uring_sqe  *sqe;
+
+    slot = c - ngx_cycle->connections;
+
+    state = c->read->index;
+
+    if (state == NGX_INVALID_INDEX) {
+        state = 0;
+    }
+
+    events = 0;
+
+    if (c->read->active) {
+        events |= EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (c->write && c->write->active) {
+        events |= EPOLLOUT;
+    }
+
+    if (state & NGX_IO_URING_ARMED) {
+
+        if (events == (state & NGX_IO_URING_MASK)) {
+            return NGX_OK;
+        }
+
+        sqe = ngx_io_uring_get_sqe(c->log);
+        if (sqe == NULL) {
+            return NGX_ERROR;
+        }
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ngx_io_uring_data(slot, seqs[slot]);
+        sqe->user_data = NGX_IO_URING_REMOVE;
+
+        if (events == 0) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "io_uring poll remove: fd:%d q:%uD",
+                           c->fd, seqs[slot]);
+
+            c->read->index = 0;
+            return NGX_OK;
+        }
+
+        /* the update rechecks the current state, as EPOLL_CTL_MOD does */
+
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+
+        if (state & NGX_IO_URING_MULTISHOT) {
+            sqe->len |= IORING_POLL_ADD_MULTI;
+        }
+
+        sqe->poll32_events = events;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring poll update: fd:%d ev:%04XD q:%uD",
+                       c->fd, events, seqs[slot]);
+
+        c->read->index = (state & ~NGX_IO_URING_MASK) | events;
+        return NGX_OK;
+    }
+
+    if (events == 0) {
+        return NGX_OK;
+    }
+
+    sqe = ngx_io_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (++seqs[slot] == 0) {
+        seqs[slot] = 1;
+    }
+
+    state = NGX_IO_URING_ARMED | events;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = ngx_io_uring_data(slot, seqs[slot]);
+
+    if (multishot) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+        state |= NGX_IO_URING_MULTISHOT;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll add: fd:%d ev:%04XD q:%uD m:%ui",
+                   c->fd, events, seqs[slot], multishot ? 1 : 0);
+
+    c->read->index = state;
+
+    return NGX_OK;
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    uint32_t              tail;
+    struct io_uring_sqe  *sqe;
+
+    tail = *sq_tail;
+
+    if (tail - *sq_head >= sq_entries) {
+
+        /* the submission ring is full, pass it to the kernel right now */
+
+        if (ngx_io_uring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (tail - *sq_head >= sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue overflow");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[tail & sq_mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    ngx_memory_barrier();
+
+    *sq_tail = tail + 1;
+    sq_pending++;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_io_uring_submit(ngx_log_t *log)
+{
+    int  n;
+
+    n = io_uring_enter(ring, sq_pending, 0, 0, NULL, 0);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    sq_pending -= n;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                              n;
+    u_int                            wait, enter;
+    uint32_t                         head, tail;
+    ngx_err_t                        err;
+    ngx_uint_t                       level, events;
+    struct io_uring_cqe              cqe;
+    struct __kernel_timespec         ts;
+    struct io_uring_getevents_arg    arg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD", timer, sq_pending);
+
+    /* do not wait if there are completions left from the previous call */
+
+    wait = (*cq_head == *cq_tail) ? 1 : 0;
+
+    enter = 0;
+    err = 0;
+
+    if (wait) {
+        ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+        if (timer != NGX_TIMER_INFINITE) {
+            ts.tv_sec = timer / 1000;
+            ts.tv_nsec = (timer % 1000) * 1000000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+
+        n = io_uring_enter(ring, sq_pending, 1,
+                           IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                           &arg, sizeof(struct io_uring_getevents_arg));
+        enter = 1;
+
+    } else if (sq_pending) {
+        n = io_uring_enter(ring, sq_pending, 0, 0, NULL, 0);
+        enter = 1;
+
+    } else {
+        n = 0;
+    }
+
+    if (n == -1) {
+        err = ngx_errno;
+
+    } else if (enter) {
+        sq_pending -= n;
+    }
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err == ETIME || err == NGX_EBUSY || err == NGX_EAGAIN) {
+
+        /*
+         * ETIME: the timeout has expired;
+         * EBUSY, EAGAIN: the completion ring overflowed
+         * and completions have to be reaped first
+         */
+
+        err = 0;
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    head = *cq_head;
+    tail = *cq_tail;
+
+    ngx_memory_barrier();
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    for (events = 0; head != tail; head++, events++) {
+
+        cqe = cqes[head & cq_mask];
+
+        /* release the entry before handlers may enter the kernel */
+
+        ngx_memory_barrier();
+
+        *cq_head = head + 1;
+
+        ngx_io_uring_process_poll(cycle, &cqe, flags);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: %ui completions", events);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_process_poll(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    uint32_t           revents, seq;
+    uint64_t           data;
+    ngx_int_t          instance;
+    ngx_uint_t         state, slot, rearm;
+    ngx_event_t       *rev, *wev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+
+    data = cqe->user_data;
+
+    if (data == NGX_IO_URING_REMOVE) {
+
+        /* poll removal or update */
+
+        if (cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                          "io_uring poll remove failed");
+        }
+
+        return;
+    }
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (data == NGX_IO_URING_NOTIFY) {
+
+        if (!(cqe->flags & IORING_CQE_F_MORE) && notify_fd != -1) {
+            (void) ngx_io_uring_notify_poll(cycle->log);
+        }
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(&notify_event, &ngx_posted_events);
+
+        } else {
+            notify_event.handler(&notify_event);
+        }
+
+        return;
+    }
+
+#endif
+
+    slot = (uint32_t) data;
+    seq = (uint32_t) (data >> 32);
+
+    if (slot >= cycle->connection_n) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring: invalid user data %uL", data);
+        return;
+    }
+
+    c = &cycle->connections[slot];
+    rev = c->read;
+
+    if (c->fd == -1) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed in this iteration
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p", c);
+        return;
+    }
+
+    state = rev->index;
+
+    if (seqs[slot] != seq
+        || state == NGX_INVALID_INDEX
+        || !(state & NGX_IO_URING_ARMED))
+    {
+        /* a notification from a removed or replaced poll request */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale poll %p q:%uD", c, seq);
+        return;
+    }
+
+    instance = rev->instance;
+
+    if (cqe->res == -ECANCELED) {
+
+        /* the poll request was cancelled by the kernel, not by us */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: cancelled poll %p q:%uD", c, seq);
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            rev->index = state & ~NGX_IO_URING_ARMED;
+            (void) ngx_io_uring_set_events(c, state & NGX_IO_URING_MULTISHOT);
+        }
+
+        return;
+    }
+
+    rearm = 0;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+        /* oneshot poll fired or multishot poll was terminated */
+
+        rev->index = state & ~NGX_IO_URING_ARMED;
+        rearm = (cqe->res >= 0);
+    }
+
+    if (cqe->res < 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                      "io_uring poll on fd:%d failed", c->fd);
+
+        revents = EPOLLERR;
+
+    } else {
+        revents = cqe->res;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d ev:%04XD q:%uD", c->fd, revents, seq);
+
+    if (revents & (EPOLLERR|EPOLLHUP)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring poll error on fd:%d ev:%04XD",
+                       c->fd, revents);
+
+        /*
+         * if the error events were returned, add EPOLLIN and EPOLLOUT
+         * to handle the events at least in one active handler
+         */
+
+        revents |= EPOLLIN|EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+
+        rev->ready = 1;
+        rev->available = -1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = rev->accept ? &ngx_posted_accept_events
+                                : &ngx_posted_events;
+
+            ngx_post_event(rev, queue);
+
+        } else {
+            rev->handler(rev);
+        }
+    }
+
+    wev = c->write;
+
+    if ((revents & EPOLLOUT) && wev->active) {
+
+        if (c->fd == -1 || wev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            return;
+        }
+
+        wev->ready = 1;
+#if (NGX_THREADS)
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(wev, &ngx_posted_events);
+
+        } else {
+            wev->handler(wev);
+        }
+    }
+
+    if (rearm && c->fd != -1 && rev->instance == instance
+        && !(rev->index & NGX_IO_URING_ARMED))
+    {
+        (void) ngx_io_uring_set_events(c, state & NGX_IO_URING_MULTISHOT);
+    }
+}
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
@@ -113,6 +113,11 @@ struct ngx_event_s {
 
     ngx_rbtree_node_t   timer;
 
+#if (NGX_EVENT_TIMER_WHEEL)
+    /* the timer wheel slot queue */
+    ngx_queue_t      timer_queue;
+#endif
+
     /* the posted queue */
     ngx_queue_t      queue;
 
@@ -198,11 +198,11 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
             }
 #endif
 
-            if (p->limit_rate) {
-                if (p->upstream->read->delayed) {
-                    break;
-                }
+            if (p->upstream->read->delayed) {
+                break;
+            }
 
+            if (p->limit_rate) {
                 limit = (off_t) p->limit_rate * (ngx_time() - p->start_sec + 1)
                         - p->read_length;
 
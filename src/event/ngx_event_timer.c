@@ -10,7 +10,10 @@
 #include <ngx_event.h>
 
 
+#if !(NGX_EVENT_TIMER_WHEEL)
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
+
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
 /*
@@ -150,3 +153,382 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+#else
+
+/*
+ * The timer wheel has four levels of 64 slots each.  A level 0 slot
+ * covers one millisecond and every next level is 64 times coarser, so
+ * the wheel spans about 4.6 hours; timers beyond that are parked in
+ * the last level and are re-added as the wheel turns.  A timer is added
+ * to and deleted from a slot in O(1), the upper level slots are cascaded
+ * down when the lower level wraps around.  The exact expiry time is kept
+ * in ev->timer.key.  Timers added when already expired are kept in
+ * a separate queue and are run on the next ngx_event_expire_timers() call.
+ */
+
+#define NGX_TIMER_WHEEL_BITS    6
+#define NGX_TIMER_WHEEL_SIZE    (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK    (NGX_TIMER_WHEEL_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVELS  4
+
+#define NGX_TIMER_WHEEL_SPAN                                                  \
+    ((ngx_msec_int_t) 1 << (NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_BITS))
+
+#define ngx_timer_wheel_index(key, level)                                     \
+    (((key) >> ((level) * NGX_TIMER_WHEEL_BITS)) & NGX_TIMER_WHEEL_MASK)
+
+
+typedef struct {
+    ngx_queue_t   slots[NGX_TIMER_WHEEL_LEVELS][NGX_TIMER_WHEEL_SIZE];
+
+    /* the set bits may refer to the emptied slots, they are cleared lazily */
+    uint64_t      bitmap[NGX_TIMER_WHEEL_LEVELS];
+
+    /* the timers which have already expired when added */
+    ngx_queue_t   expired;
+
+    /* the next tick to process */
+    ngx_msec_t    now;
+} ngx_event_timer_wheel_t;
+
+
+static ngx_uint_t ngx_event_timer_wheel_next(ngx_uint_t level,
+    ngx_uint_t index);
+static ngx_uint_t ngx_event_timer_wheel_cascade(ngx_uint_t level);
+static void ngx_event_timer_wheel_run(ngx_queue_t *queue);
+
+
+static ngx_event_timer_wheel_t  ngx_event_timer_wheel;
+
+
+ngx_int_t
+ngx_event_timer_init(ngx_log_t *log)
+{
+    ngx_uint_t  level, index;
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        for (index = 0; index < NGX_TIMER_WHEEL_SIZE; index++) {
+            ngx_queue_init(&ngx_event_timer_wheel.slots[level][index]);
+        }
+
+        ngx_event_timer_wheel.bitmap[level] = 0;
+    }
+
+    ngx_queue_init(&ngx_event_timer_wheel.expired);
+
+    ngx_event_timer_wheel.now = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_event_timer_wheel_insert(ngx_event_t *ev)
+{
+    ngx_msec_t       key;
+    ngx_uint_t       level, index;
+    ngx_msec_int_t   diff;
+
+    key = ev->timer.key;
+
+    if ((ngx_msec_int_t) (key - ngx_current_msec) <= 0) {
+        ngx_queue_insert_tail(&ngx_event_timer_wheel.expired,
+                              &ev->timer_queue);
+        return;
+    }
+
+    diff = (ngx_msec_int_t) (key - ngx_event_timer_wheel.now);
+
+    if (diff < 0) {
+        level = 0;
+        key = ngx_event_timer_wheel.now;
+
+    } else {
+        for (level = 0; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+            if (diff < (ngx_msec_int_t) 1 << ((level + 1)
+                                              * NGX_TIMER_WHEEL_BITS))
+            {
+                break;
+            }
+        }
+
+        if (diff >= NGX_TIMER_WHEEL_SPAN) {
+            key = ngx_event_timer_wheel.now + NGX_TIMER_WHEEL_SPAN - 1;
+        }
+    }
+
+    index = ngx_timer_wheel_index(key, level);
+
+    ngx_queue_insert_tail(&ngx_event_timer_wheel.slots[level][index],
+                          &ev->timer_queue);
+
+    ngx_event_timer_wheel.bitmap[level] |= (uint64_t) 1 << index;
+}
+
+
+/*
+ * The level 0 slots hold the timers expiring exactly at the slot's tick,
+ * while an upper level slot is only known to expire not earlier than
+ * the slot starts, so the returned value is a lower bound: the worker
+ * wakes up to cascade the slot and then sleeps until the exact time.
+ *
+ * The current upper level slot holds the timers of the next turn, unless
+ * the wheel stands on the slot's boundary and the slot is not cascaded yet:
+ * then its timers are due right now.
+ */
+
+ngx_msec_t
+ngx_event_find_timer(void)
+{
+    ngx_uint_t       level, shift, index, n, found, current;
+    ngx_msec_t       start, min;
+    ngx_msec_int_t   timer;
+
+    if (!ngx_queue_empty(&ngx_event_timer_wheel.expired)) {
+        return 0;
+    }
+
+    found = 0;
+    min = 0;
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        shift = level * NGX_TIMER_WHEEL_BITS;
+        index = ngx_timer_wheel_index(ngx_event_timer_wheel.now, level);
+
+        current = (level == 0
+                   || (ngx_event_timer_wheel.now
+                       & (((ngx_msec_t) 1 << shift) - 1)) == 0);
+
+        n = current ? index : index + 1;
+
+        n = (n < NGX_TIMER_WHEEL_SIZE) ? ngx_event_timer_wheel_next(level, n)
+                                       : NGX_TIMER_WHEEL_SIZE;
+
+        if (n == NGX_TIMER_WHEEL_SIZE) {
+            n = ngx_event_timer_wheel_next(level, 0);
+
+            if (n == NGX_TIMER_WHEEL_SIZE) {
+                continue;
+            }
+        }
+
+        n = (n - index) & NGX_TIMER_WHEEL_MASK;
+
+        if (!current && n == 0) {
+            n = NGX_TIMER_WHEEL_SIZE;
+        }
+
+        start = ((ngx_event_timer_wheel.now >> shift) + n) << shift;
+
+        if (!found || (ngx_msec_int_t) (start - min) < 0) {
+            min = start;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (min - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+void
+ngx_event_expire_timers(void)
+{
+    ngx_msec_t    next;
+    ngx_uint_t    level, index;
+    ngx_queue_t  *slot;
+
+    while ((ngx_msec_int_t) (ngx_current_msec - ngx_event_timer_wheel.now)
+           >= 0)
+    {
+        index = ngx_event_timer_wheel.now & NGX_TIMER_WHEEL_MASK;
+
+        if (index == 0) {
+            for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+                if (ngx_event_timer_wheel_cascade(level) != 0) {
+                    break;
+                }
+            }
+
+            /* the cascaded timers may have expired already */
+
+            ngx_event_timer_wheel_run(&ngx_event_timer_wheel.expired);
+        }
+
+        /* skip the empty slots up to the end of the level 0 turn */
+
+        index = ngx_event_timer_wheel_next(0, index);
+
+        next = ngx_event_timer_wheel.now
+               - (ngx_event_timer_wheel.now & NGX_TIMER_WHEEL_MASK) + index;
+
+        if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+            ngx_event_timer_wheel.now = ngx_current_msec + 1;
+            break;
+        }
+
+        if (index == NGX_TIMER_WHEEL_SIZE) {
+            ngx_event_timer_wheel.now = next;
+            continue;
+        }
+
+        ngx_event_timer_wheel.now = next + 1;
+
+        slot = &ngx_event_timer_wheel.slots[0][index];
+
+        ngx_event_timer_wheel.bitmap[0] &= ~((uint64_t) 1 << index);
+
+        ngx_event_timer_wheel_run(slot);
+    }
+
+    /* the timers added with zero or negative timeout by the handlers */
+
+    while (!ngx_queue_empty(&ngx_event_timer_wheel.expired)) {
+        ngx_event_timer_wheel_run(&ngx_event_timer_wheel.expired);
+    }
+}
+
+
+ngx_int_t
+ngx_event_no_timers_left(void)
+{
+    ngx_uint_t    level, index;
+    ngx_queue_t  *q, *slot;
+    ngx_event_t  *ev;
+
+    slot = &ngx_event_timer_wheel.expired;
+
+    for (q = ngx_queue_head(slot);
+         q != ngx_queue_sentinel(slot);
+         q = ngx_queue_next(q))
+    {
+        ev = ngx_queue_data(q, ngx_event_t, timer_queue);
+
+        if (!ev->cancelable) {
+            return NGX_AGAIN;
+        }
+    }
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        for (index = 0; index < NGX_TIMER_WHEEL_SIZE; index++) {
+
+            slot = &ngx_event_timer_wheel.slots[level][index];
+
+            for (q = ngx_queue_head(slot);
+                 q != ngx_queue_sentinel(slot);
+                 q = ngx_queue_next(q))
+            {
+                ev = ngx_queue_data(q, ngx_event_t, timer_queue);
+
+                if (!ev->cancelable) {
+                    return NGX_AGAIN;
+                }
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_event_timer_wheel_run(ngx_queue_t *queue)
+{
+    ngx_queue_t   expired, *q;
+    ngx_event_t  *ev;
+
+    if (ngx_queue_empty(queue)) {
+        return;
+    }
+
+    ngx_queue_init(&expired);
+    ngx_queue_add(&expired, queue);
+    ngx_queue_init(queue);
+
+    while (!ngx_queue_empty(&expired)) {
+
+        q = ngx_queue_head(&expired);
+        ngx_queue_remove(q);
+
+        ev = ngx_queue_data(q, ngx_event_t, timer_queue);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_next(ngx_uint_t level, ngx_uint_t index)
+{
+    uint64_t  bits;
+
+    bits = ngx_event_timer_wheel.bitmap[level] >> index;
+
+    while (bits) {
+
+        if (bits & 1) {
+            if (!ngx_queue_empty(&ngx_event_timer_wheel.slots[level][index])) {
+                return index;
+            }
+
+            ngx_event_timer_wheel.bitmap[level] &= ~((uint64_t) 1 << index);
+        }
+
+        bits >>= 1;
+        index++;
+    }
+
+    return NGX_TIMER_WHEEL_SIZE;
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_cascade(ngx_uint_t level)
+{
+    ngx_uint_t    index;
+    ngx_queue_t   queue, *q, *slot;
+    ngx_event_t  *ev;
+
+    index = ngx_timer_wheel_index(ngx_event_timer_wheel.now, level);
+    slot = &ngx_event_timer_wheel.slots[level][index];
+
+    ngx_event_timer_wheel.bitmap[level] &= ~((uint64_t) 1 << index);
+
+    if (ngx_queue_empty(slot)) {
+        return index;
+    }
+
+    ngx_queue_init(&queue);
+    ngx_queue_add(&queue, slot);
+    ngx_queue_init(slot);
+
+    while (!ngx_queue_empty(&queue)) {
+        q = ngx_queue_head(&queue);
+        ngx_queue_remove(q);
+
+        ev = ngx_queue_data(q, ngx_event_t, timer_queue);
+
+        ngx_event_timer_wheel_insert(ev);
+    }
+
+    return index;
+}
+
+#endif
@@ -25,8 +25,16 @@ void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
 
 
+#if (NGX_EVENT_TIMER_WHEEL)
+
+void ngx_event_timer_wheel_insert(ngx_event_t *ev);
+
+#else
+
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
 
+#endif
+
 
 static ngx_inline void
 ngx_event_del_timer(ngx_event_t *ev)
@@ -35,12 +43,20 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
+#if (NGX_EVENT_TIMER_WHEEL)
+
+    ngx_queue_remove(&ev->timer_queue);
+
+#else
+
     ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
     ev->timer.right = NULL;
     ev->timer.parent = NULL;
+#endif
+
 #endif
 
     ev->timer_set = 0;
@@ -83,7 +99,11 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
     // Cxg^C}QǗԍ؂ɑ}
+#if (NGX_EVENT_TIMER_WHEEL)
+    ngx_event_timer_wheel_insert(ev);
+#else
     ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+#endif
 
     // ^C}Ǘԍ؂ɑ}ꂽƂtOt
     ev->timer_set = 1;
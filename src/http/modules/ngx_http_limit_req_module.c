@@ -34,16 +34,36 @@ typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+
+    /* the shard's own mutex, or the slab pool mutex if not sharded */
+    ngx_shmtx_t                  *mutex;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   shard_mutex;
+#endif
 } ngx_http_limit_req_shctx_t;
 
 
+#define NGX_HTTP_LIMIT_REQ_SHARD_SIZE                                         \
+    ngx_align(sizeof(ngx_http_limit_req_shctx_t), NGX_CPU_CACHE_LINE)
+
+#define ngx_http_limit_req_shard(ctx, hash)                                   \
+    ((ngx_http_limit_req_shctx_t *)                                           \
+        ((u_char *) (ctx)->sh                                                 \
+         + ((hash) % (ctx)->shards) * NGX_HTTP_LIMIT_REQ_SHARD_SIZE))
+
+
 typedef struct {
+    /* an array of "shards" elements, NGX_HTTP_LIMIT_REQ_SHARD_SIZE each */
     ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
+    ngx_uint_t                   shards;
+
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shctx_t  *shard;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -66,11 +86,16 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n);
+static void *ngx_http_limit_req_alloc(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, size_t size);
+static void ngx_http_limit_req_free(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, void *p);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -102,7 +127,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -200,6 +225,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
     ngx_http_limit_req_limit_t  *limit, *limits;
+    ngx_http_limit_req_shctx_t  *sh;
 
     if (r->main->limit_req_status) {
         return NGX_DECLINED;
@@ -240,12 +266,14 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        sh = ngx_http_limit_req_shard(ctx, hash);
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
+        ngx_shmtx_lock(sh->mutex);
+
+        rc = ngx_http_limit_req_lookup(limit, sh, hash, &key, &excess,
                                        (n == lrcf->limits.nelts - 1));
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(sh->mutex);
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -277,11 +305,11 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(ctx->shard->mutex);
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(ctx->shard->mutex);
 
             ctx->node = NULL;
         }
@@ -408,8 +436,9 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
 {
     size_t                      size;
     ngx_int_t                   rc, excess;
@@ -423,8 +452,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -446,7 +475,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&sh->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -482,6 +511,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = sh;
 
             return NGX_AGAIN;
         }
@@ -495,14 +525,14 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, sh, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_http_limit_req_alloc(ctx, sh, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, sh, 0);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        node = ngx_http_limit_req_alloc(ctx, sh, size);
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", ctx->shpool->log_ctx);
@@ -519,9 +549,9 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ngx_memcpy(lr->data, key->data, key->len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&sh->queue, &lr->queue);
 
     if (account) {
         lr->last = now;
@@ -533,6 +563,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->shard = sh;
 
     return NGX_AGAIN;
 }
@@ -566,7 +597,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(ctx->shard->mutex);
 
         now = ngx_current_msec;
         ms = (ngx_msec_int_t) (now - lr->last);
@@ -591,7 +622,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(ctx->shard->mutex);
 
         ctx->node = NULL;
 
@@ -613,7 +644,8 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now;
@@ -632,11 +664,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -671,10 +703,40 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&sh->rbtree, node);
+
+        ngx_http_limit_req_free(ctx, sh, node);
+    }
+}
+
+
+/*
+ * A shard that uses the slab pool mutex already holds it, the shards
+ * with their own mutexes lock the pool for allocations only.
+ */
+
+static void *
+ngx_http_limit_req_alloc(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, size_t size)
+{
+    if (sh->mutex == &ctx->shpool->mutex) {
+        return ngx_slab_alloc_locked(ctx->shpool, size);
+    }
+
+    return ngx_slab_alloc(ctx->shpool, size);
+}
+
 
-        ngx_slab_free_locked(ctx->shpool, node);
+static void
+ngx_http_limit_req_free(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, void *p)
+{
+    if (sh->mutex == &ctx->shpool->mutex) {
+        ngx_slab_free_locked(ctx->shpool, p);
+        return;
     }
+
+    ngx_slab_free(ctx->shpool, p);
 }
 
 
@@ -683,8 +745,10 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -702,6 +766,14 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->shards != octx->shards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->shards, octx->shards);
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
@@ -716,17 +788,36 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              ctx->shards * NGX_HTTP_LIMIT_REQ_SHARD_SIZE);
     if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
     ctx->shpool->data = ctx->sh;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+    for (i = 0; i < ctx->shards; i++) {
+        sh = ngx_http_limit_req_shard(ctx, i);
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
 
-    ngx_queue_init(&ctx->sh->queue);
+        sh->mutex = &ctx->shpool->mutex;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        if (ctx->shards > 1) {
+            if (ngx_shmtx_create(&sh->shard_mutex, &sh->lock, NULL) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            sh->mutex = &sh->shard_mutex;
+        }
+
+#endif
+    }
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
@@ -819,7 +910,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                             len;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_int_t                          rate, scale;
+    ngx_int_t                          rate, scale, shards;
     ngx_uint_t                         i;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
@@ -845,6 +936,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -907,6 +999,27 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"shards\" are not supported "
+                                   "on this platform");
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -920,6 +1033,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     ctx->rate = rate * 1000 / scale;
+    ctx->shards = shards;
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -37,6 +37,10 @@ typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+
+    /* the schema record of a binary format */
+    ngx_str_t                   schema;
+    uint32_t                    id;
 } ngx_http_log_fmt_t;
 
 
@@ -47,6 +51,10 @@ typedef struct {
 } ngx_http_log_main_conf_t;
 
 
+/* the number of buffers of an "async" log, including the one being filled */
+#define NGX_HTTP_LOG_THREAD_BUFS     4
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -55,9 +63,41 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+    unsigned                    async:1;
+    unsigned                    drop:1;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+    ngx_thread_mutex_t          mutex;
+
+    u_char                     *bufs;
+    size_t                      size;
+    size_t                      len[NGX_HTTP_LOG_THREAD_BUFS];
+    ngx_uint_t                  tail;
+    ngx_uint_t                  nfull;
+    ngx_uint_t                  nbusy;
+    ngx_uint_t                  dropped;
+#endif
 } ngx_http_log_buf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_fd_t                    fd;
+    u_char                     *name;
+    ngx_int_t                   gzip;
+    ngx_thread_mutex_t         *mutex;
+    ngx_uint_t                  done;       /* unsigned  done:1 */
+    ngx_uint_t                  niovs;
+    struct iovec                iovs[NGX_HTTP_LOG_THREAD_BUFS];
+} ngx_http_log_thread_ctx_t;
+
+#endif
+
+
 typedef struct {
     ngx_array_t                *lengths;
     ngx_array_t                *values;
@@ -93,11 +133,32 @@ typedef struct {
 } ngx_http_log_var_t;
 
 
+typedef struct {
+    ngx_str_t                   name;
+    size_t                      len;
+    u_char                      type;
+    ngx_http_log_op_run_pt      run;
+} ngx_http_log_binary_var_t;
+
+
 #define NGX_HTTP_LOG_ESCAPE_DEFAULT  0
 #define NGX_HTTP_LOG_ESCAPE_JSON     1
 #define NGX_HTTP_LOG_ESCAPE_NONE     2
 
 
+/*
+ * binary records: a 32-bit length of the rest of the record, a type byte,
+ * and a 32-bit format id; all integers are in network byte order
+ */
+
+#define NGX_HTTP_LOG_BINARY_HEADER   9
+
+#define NGX_HTTP_LOG_BINARY_SCHEMA   'S'
+#define NGX_HTTP_LOG_BINARY_RECORD   'R'
+
+#define NGX_HTTP_LOG_BINARY_NULL     0xffff
+
+
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -114,6 +175,22 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_log_thread_reserve(ngx_open_file_t *file, size_t len,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_log_thread_seal(ngx_open_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_log_thread_post(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_thread_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_thread_event_handler(ngx_event_t *ev);
+static void ngx_http_log_thread_dropped(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_writev(ngx_fd_t fd, u_char *name, struct iovec *iovs,
+    ngx_uint_t niovs, ngx_int_t gzip, ngx_log_t *log);
+static ngx_int_t ngx_http_log_thread_init(ngx_conf_t *cf,
+    ngx_open_file_t *file, ngx_str_t *name);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -124,6 +201,7 @@ static u_char *ngx_http_log_msec(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
+static ngx_uint_t ngx_http_log_get_status(ngx_http_request_t *r);
 static u_char *ngx_http_log_status(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
@@ -150,6 +228,26 @@ static u_char *ngx_http_log_unescaped_variable(ngx_http_request_t *r,
     u_char *buf, ngx_http_log_op_t *op);
 
 
+static u_char *ngx_http_log_binary_uint(u_char *p, uint64_t n, size_t size);
+static void ngx_http_log_binary_record(u_char *rec, u_char *last,
+    ngx_http_log_fmt_t *fmt);
+static u_char *ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_length(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_time(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+
 static void *ngx_http_log_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_log_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_log_merge_loc_conf(ngx_conf_t *cf, void *parent,
@@ -160,6 +258,8 @@ static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
     ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+static char *ngx_http_log_compile_binary_format(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt, ngx_array_t *args, ngx_uint_t s);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
@@ -253,15 +353,32 @@ static ngx_http_log_var_t  ngx_http_log_vars[] = {
 };
 
 
+static ngx_http_log_binary_var_t  ngx_http_log_binary_vars[] = {
+    { ngx_string("status"), 2, 'H', ngx_http_log_binary_status },
+    { ngx_string("bytes_sent"), 8, 'Q', ngx_http_log_binary_bytes_sent },
+    { ngx_string("body_bytes_sent"), 8, 'Q',
+                          ngx_http_log_binary_body_bytes_sent },
+    { ngx_string("request_length"), 8, 'Q',
+                          ngx_http_log_binary_request_length },
+    { ngx_string("request_time"), 4, 'I', ngx_http_log_binary_request_time },
+    { ngx_string("msec"), 8, 'T', ngx_http_log_binary_msec },
+    { ngx_string("time_local"), 8, 'T', ngx_http_log_binary_msec },
+    { ngx_string("time_iso8601"), 8, 'T', ngx_http_log_binary_msec },
+
+    { ngx_null_string, 0, 0, NULL }
+};
+
+
 static ngx_int_t
 ngx_http_log_handler(ngx_http_request_t *r)
 {
-    u_char                   *line, *p;
+    u_char                   *line, *p, *rec;
     size_t                    len, size;
     ssize_t                   n;
     ngx_str_t                 val;
     ngx_uint_t                i, l;
     ngx_http_log_t           *log;
+    ngx_http_log_fmt_t       *fmt;
     ngx_http_log_op_t        *op;
     ngx_http_log_buf_t       *buffer;
     ngx_http_log_loc_conf_t  *lcf;
@@ -299,11 +416,14 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_http_script_flush_no_cacheable_variables(r, log[l].format->flushes);
+        fmt = log[l].format;
+        rec = NULL;
+
+        ngx_http_script_flush_no_cacheable_variables(r, fmt->flushes);
 
         len = 0;
-        op = log[l].format->ops->elts;
-        for (i = 0; i < log[l].format->ops->nelts; i++) {
+        op = fmt->ops->elts;
+        for (i = 0; i < fmt->ops->nelts; i++) {
             if (op[i].len == 0) {
                 len += op[i].getlen(r, op[i].data);
 
@@ -322,7 +442,14 @@ ngx_http_log_handler(ngx_http_request_t *r)
             goto alloc_line;
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (fmt->schema.len) {
+
+            /* the schema is only written at the start of a buffer */
+            len += fmt->schema.len + NGX_HTTP_LOG_BINARY_HEADER;
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
 
         buffer = log[l].file ? log[l].file->data : NULL;
 
@@ -330,10 +457,27 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
+#if (NGX_THREADS)
+                if (buffer->async) {
+                    if (ngx_http_log_thread_reserve(log[l].file, len,
+                                                    r->connection->log)
+                        == NGX_DECLINED)
+                    {
+                        continue;
+                    }
+
+                } else {
+                    ngx_http_log_write(r, &log[l], buffer->start,
+                                       buffer->pos - buffer->start);
+
+                    buffer->pos = buffer->start;
+                }
+#else
                 ngx_http_log_write(r, &log[l], buffer->start,
                                    buffer->pos - buffer->start);
 
                 buffer->pos = buffer->start;
+#endif
             }
 
             if (len <= (size_t) (buffer->last - buffer->pos)) {
@@ -344,11 +488,25 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
-                for (i = 0; i < log[l].format->ops->nelts; i++) {
+                if (fmt->schema.len) {
+                    if (p == buffer->start) {
+                        p = ngx_cpymem(p, fmt->schema.data, fmt->schema.len);
+                    }
+
+                    rec = p;
+                    p += NGX_HTTP_LOG_BINARY_HEADER;
+                }
+
+                for (i = 0; i < fmt->ops->nelts; i++) {
                     p = op[i].run(r, p, &op[i]);
                 }
 
-                ngx_linefeed(p);
+                if (rec) {
+                    ngx_http_log_binary_record(rec, p, fmt);
+
+                } else {
+                    ngx_linefeed(p);
+                }
 
                 buffer->pos = p;
 
@@ -373,7 +531,14 @@ ngx_http_log_handler(ngx_http_request_t *r)
             p = ngx_syslog_add_header(log[l].syslog_peer, line);
         }
 
-        for (i = 0; i < log[l].format->ops->nelts; i++) {
+        if (fmt->schema.len) {
+            p = ngx_cpymem(p, fmt->schema.data, fmt->schema.len);
+
+            rec = p;
+            p += NGX_HTTP_LOG_BINARY_HEADER;
+        }
+
+        for (i = 0; i < fmt->ops->nelts; i++) {
             p = op[i].run(r, p, &op[i]);
         }
 
@@ -396,7 +561,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_linefeed(p);
+        if (rec) {
+            ngx_http_log_binary_record(rec, p, fmt);
+
+        } else {
+            ngx_linefeed(p);
+        }
 
         ngx_http_log_write(r, &log[l], line, p - line);
     }
@@ -735,6 +905,13 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
     // t@C data oɏނׂf[^obt@`ŕۊǂĂ
     buffer = file->data;
 
+#if (NGX_THREADS)
+    if (buffer->async) {
+        ngx_http_log_thread_flush(file, log);
+        return;
+    }
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -782,13 +959,349 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "http log buffer flush handler");
 
+#if (NGX_THREADS)
+
+    file = ev->data;
+    buffer = file->data;
+
+    if (buffer->async) {
+
+        /* all buffers are busy, retry once some of them are written */
+
+        if (ngx_http_log_thread_seal(file, ev->log) == NGX_DECLINED) {
+            ngx_add_timer(ev, buffer->flush);
+        }
+
+        return;
+    }
+
+#endif
+
     ngx_http_log_flush(ev->data, ev->log);
 }
 
 
+#if (NGX_THREADS)
+
+/*
+ * An "async" log has NGX_HTTP_LOG_THREAD_BUFS buffers used as a ring:
+ * lines are added to the current buffer, full buffers are queued after
+ * "tail", and all queued buffers are written by a single thread task
+ * with one writev() call.  Buffers are only reused by the worker after
+ * the task completion event, so no locking is needed on the fast path.
+ * The mutex only serializes the task with synchronous flushes made on
+ * overflow=block, on log reopening, and on exit.
+ */
+
+#define ngx_http_log_thread_buf(buffer, n)                                    \
+    ((buffer)->bufs + ((n) % NGX_HTTP_LOG_THREAD_BUFS) * (buffer)->size)
+
+
+static ngx_int_t
+ngx_http_log_thread_reserve(ngx_open_file_t *file, size_t len, ngx_log_t *log)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (len <= buffer->size) {
+
+        if (ngx_http_log_thread_seal(file, log) == NGX_OK) {
+            return NGX_OK;
+        }
+
+        if (buffer->drop) {
+            buffer->dropped++;
+            return NGX_DECLINED;
+        }
+    }
+
+    /*
+     * overflow=block, or the line does not fit into a buffer and
+     * is written directly after everything queued before it
+     */
+
+    ngx_http_log_thread_flush(file, log);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_thread_seal(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer->pos == buffer->start) {
+        return NGX_OK;
+    }
+
+    if (buffer->nfull == NGX_HTTP_LOG_THREAD_BUFS - 1) {
+        return NGX_DECLINED;
+    }
+
+    buffer->len[(buffer->tail + buffer->nfull) % NGX_HTTP_LOG_THREAD_BUFS] =
+                                                 buffer->pos - buffer->start;
+    buffer->nfull++;
+
+    buffer->start = ngx_http_log_thread_buf(buffer,
+                                            buffer->tail + buffer->nfull);
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + buffer->size;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    ngx_http_log_thread_post(file, log);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_thread_post(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_uint_t                  i, n;
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+    task = buffer->task;
+
+    if (task->event.active || buffer->nfull == 0) {
+        return;
+    }
+
+    ctx = task->ctx;
+
+    for (i = 0; i < buffer->nfull; i++) {
+        n = buffer->tail + i;
+
+        ctx->iovs[i].iov_base = (void *) ngx_http_log_thread_buf(buffer, n);
+        ctx->iovs[i].iov_len = buffer->len[n % NGX_HTTP_LOG_THREAD_BUFS];
+    }
+
+    ctx->niovs = buffer->nfull;
+    ctx->fd = file->fd;
+    ctx->done = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log thread post: %ui buffers, fd:%d",
+                   ctx->niovs, ctx->fd);
+
+    if (ngx_thread_task_post(buffer->thread_pool, task) != NGX_OK) {
+        ngx_http_log_writev(ctx->fd, ctx->name, ctx->iovs, ctx->niovs,
+                            ctx->gzip, log);
+
+        buffer->tail = (buffer->tail + buffer->nfull)
+                       % NGX_HTTP_LOG_THREAD_BUFS;
+        buffer->nfull = 0;
+        return;
+    }
+
+    buffer->nbusy = buffer->nfull;
+}
+
+
+static void
+ngx_http_log_thread_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_uint_t                  i, n, niovs;
+    struct iovec                iovs[NGX_HTTP_LOG_THREAD_BUFS];
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+    ctx = buffer->task->ctx;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log thread flush: %ui buffers, %ui busy, %uz",
+                   buffer->nfull, buffer->nbusy, buffer->pos - buffer->start);
+
+    (void) ngx_thread_mutex_lock(&buffer->mutex, log);
+
+    /* the task is not yet started, write its buffers first to keep order */
+
+    if (buffer->nbusy && !ctx->done) {
+        ngx_http_log_writev(ctx->fd, ctx->name, ctx->iovs, ctx->niovs,
+                            ctx->gzip, log);
+        ctx->done = 1;
+    }
+
+    niovs = 0;
+
+    for (i = buffer->nbusy; i < buffer->nfull; i++) {
+        n = buffer->tail + i;
+
+        iovs[niovs].iov_base = (void *) ngx_http_log_thread_buf(buffer, n);
+        iovs[niovs].iov_len = buffer->len[n % NGX_HTTP_LOG_THREAD_BUFS];
+        niovs++;
+    }
+
+    if (buffer->pos != buffer->start) {
+        iovs[niovs].iov_base = (void *) buffer->start;
+        iovs[niovs].iov_len = buffer->pos - buffer->start;
+        niovs++;
+    }
+
+    ngx_http_log_writev(file->fd, file->name.data, iovs, niovs, buffer->gzip,
+                        log);
+
+    (void) ngx_thread_mutex_unlock(&buffer->mutex, log);
+
+    /* busy buffers are released by the task completion handler */
+
+    buffer->nfull = buffer->nbusy;
+
+    buffer->start = ngx_http_log_thread_buf(buffer,
+                                            buffer->tail + buffer->nfull);
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + buffer->size;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    ngx_http_log_thread_dropped(file, log);
+}
+
+
+static void
+ngx_http_log_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_log_thread_ctx_t  *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "http log thread");
+
+    (void) ngx_thread_mutex_lock(ctx->mutex, log);
+
+    if (!ctx->done) {
+        ngx_http_log_writev(ctx->fd, ctx->name, ctx->iovs, ctx->niovs,
+                            ctx->gzip, log);
+        ctx->done = 1;
+    }
+
+    (void) ngx_thread_mutex_unlock(ctx->mutex, log);
+}
+
+
+static void
+ngx_http_log_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+
+    file = ev->data;
+    buffer = file->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log thread done: %ui buffers", buffer->nbusy);
+
+    buffer->tail = (buffer->tail + buffer->nbusy) % NGX_HTTP_LOG_THREAD_BUFS;
+    buffer->nfull -= buffer->nbusy;
+    buffer->nbusy = 0;
+
+    ngx_http_log_thread_dropped(file, ev->log);
+
+    ngx_http_log_thread_post(file, ev->log);
+}
+
+
+static void
+ngx_http_log_thread_dropped(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer->dropped == 0) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "%ui lines dropped from access log \"%s\"",
+                  buffer->dropped, file->name.data);
+
+    buffer->dropped = 0;
+}
+
+
+static void
+ngx_http_log_writev(ngx_fd_t fd, u_char *name, struct iovec *iovs,
+    ngx_uint_t niovs, ngx_int_t gzip, ngx_log_t *log)
+{
+    size_t      size;
+    ssize_t     n;
+    ngx_err_t   err;
+    ngx_uint_t  i;
+
+    if (niovs == 0) {
+        return;
+    }
+
+#if (NGX_ZLIB)
+
+    if (gzip) {
+        for (i = 0; i < niovs; i++) {
+            n = ngx_http_log_gzip(fd, iovs[i].iov_base, iovs[i].iov_len, gzip,
+                                  log);
+
+            if (n == -1) {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_write_fd_n " to \"%s\" failed", name);
+                return;
+            }
+        }
+
+        return;
+    }
+
+#endif
+
+    size = 0;
+
+    for (i = 0; i < niovs; i++) {
+        size += iovs[i].iov_len;
+    }
+
+eintr:
+
+    n = writev(fd, iovs, niovs);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_EINTR) {
+            goto eintr;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, log, err,
+                      "writev() to \"%s\" failed", name);
+        return;
+    }
+
+    if ((size_t) n != size) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "writev() to \"%s\" was incomplete: %z of %uz",
+                      name, n, size);
+    }
+}
+
+#endif
+
+
 /**
  * @brief
  *     OIy[Vɓo^ꂽf[^obt@Ɉڂ
@@ -833,65 +1346,208 @@ ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
  *     Rs[obt@̃AhX
  */
 static u_char *
-ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+/**
+ * @brief
+ *     NGXg̃pCvCLȂ p ̕obt@ɏ
+ *     łȂȂ . 
+ * @param[out]
+ *     buf: ݐobt@
+ * @param[in]
+ *     r: ̃NGXg̃pCvCŏ򂷂
+ *     op: gpȂ
+ * @retval
+ *     ݐobt@̃AhX
+ */
+static u_char *
+ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    if (r->pipeline) {
+        *buf = 'p';
+    } else {
+        *buf = '.';
+    }
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
+                      ngx_cached_http_log_time.len);
+}
+
+static u_char *
+ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
+                      ngx_cached_http_log_iso8601.len);
+}
+
+static u_char *
+ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+}
+
+
+static ngx_uint_t
+ngx_http_log_get_status(ngx_http_request_t *r)
+{
+    if (r->err_status) {
+        return r->err_status;
+    }
+
+    if (r->headers_out.status) {
+        return r->headers_out.status;
+    }
+
+    if (r->http_version == NGX_HTTP_VERSION_9) {
+        return 9;
+    }
+
+    return 0;
+}
+
+
+static u_char *
+ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%03ui", ngx_http_log_get_status(r));
+}
+
+
+static u_char *
+ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->connection->sent);
+}
+
+
+/*
+ * although there is a real $body_bytes_sent variable,
+ * this log operation code function is more optimized for logging
+ */
+
+static u_char *
+ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    if (length > 0) {
+        return ngx_sprintf(buf, "%O", length);
+    }
+
+    *buf = '0';
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+    return ngx_sprintf(buf, "%O", r->request_length);
 }
 
 
-/**
- * @brief
- *     NGXg̃pCvCLȂ p ̕obt@ɏ
- *     łȂȂ . 
- * @param[out]
- *     buf: ݐobt@
- * @param[in]
- *     r: ̃NGXg̃pCvCŏ򂷂
- *     op: gpȂ
- * @retval
- *     ݐobt@̃AhX
- */
 static u_char *
-ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_uint(u_char *p, uint64_t n, size_t size)
 {
-    if (r->pipeline) {
-        *buf = 'p';
-    } else {
-        *buf = '.';
+    size_t  i;
+
+    for (i = size; i; i--) {
+        p[i - 1] = (u_char) (n & 0xff);
+        n >>= 8;
     }
 
-    return buf + 1;
+    return p + size;
+}
+
+
+static void
+ngx_http_log_binary_record(u_char *rec, u_char *last, ngx_http_log_fmt_t *fmt)
+{
+    ngx_http_log_binary_uint(rec, last - rec - 4, 4);
+
+    rec[4] = NGX_HTTP_LOG_BINARY_RECORD;
+
+    ngx_http_log_binary_uint(rec + 5, fmt->id, 4);
 }
 
 
 static u_char *
-ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
-                      ngx_cached_http_log_time.len);
+    return ngx_http_log_binary_uint(buf, ngx_http_log_get_status(r), 2);
 }
 
+
 static u_char *
-ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
-                      ngx_cached_http_log_iso8601.len);
+    return ngx_http_log_binary_uint(buf, r->connection->sent, 8);
 }
 
+
 static u_char *
-ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    ngx_time_t  *tp;
+    off_t  length;
 
-    tp = ngx_timeofday();
+    length = r->connection->sent - r->header_size;
 
-    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+    return ngx_http_log_binary_uint(buf, length > 0 ? length : 0, 8);
 }
 
 
 static u_char *
-ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_http_log_binary_uint(buf, r->request_length, 8);
+}
+
+
+static u_char *
+ngx_http_log_binary_request_time(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
     ngx_time_t      *tp;
@@ -903,68 +1559,56 @@ ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
              ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
     ms = ngx_max(ms, 0);
 
-    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+    return ngx_http_log_binary_uint(buf, ms, 4);
 }
 
 
 static u_char *
-ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    ngx_uint_t  status;
+    ngx_time_t  *tp;
 
-    if (r->err_status) {
-        status = r->err_status;
+    tp = ngx_timeofday();
 
-    } else if (r->headers_out.status) {
-        status = r->headers_out.status;
+    return ngx_http_log_binary_uint(buf, (uint64_t) tp->sec * 1000 + tp->msec,
+                                    8);
+}
 
-    } else if (r->http_version == NGX_HTTP_VERSION_9) {
-        status = 9;
 
-    } else {
-        status = 0;
-    }
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
 
-    return ngx_sprintf(buf, "%03ui", status);
-}
+    value = ngx_http_get_indexed_variable(r, data);
 
+    if (value == NULL || value->not_found) {
+        return 2;
+    }
 
-static u_char *
-ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_sprintf(buf, "%O", r->connection->sent);
+    return 2 + ngx_min(value->len, NGX_HTTP_LOG_BINARY_NULL - 1);
 }
 
 
-/*
- * although there is a real $body_bytes_sent variable,
- * this log operation code function is more optimized for logging
- */
-
 static u_char *
-ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    off_t  length;
+    size_t                      len;
+    ngx_http_variable_value_t  *value;
 
-    length = r->connection->sent - r->header_size;
+    value = ngx_http_get_indexed_variable(r, op->data);
 
-    if (length > 0) {
-        return ngx_sprintf(buf, "%O", length);
+    if (value == NULL || value->not_found) {
+        return ngx_http_log_binary_uint(buf, NGX_HTTP_LOG_BINARY_NULL, 2);
     }
 
-    *buf = '0';
-
-    return buf + 1;
-}
+    len = ngx_min(value->len, NGX_HTTP_LOG_BINARY_NULL - 1);
 
+    buf = ngx_http_log_binary_uint(buf, len, 2);
 
-static u_char *
-ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_sprintf(buf, "%O", r->request_length);
+    return ngx_cpymem(buf, value->data, len);
 }
 
 
@@ -1215,6 +1859,9 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_str_null(&fmt->schema);
+    fmt->id = 0;
+
     return conf;
 }
 
@@ -1301,10 +1948,10 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_loc_conf_t *llcf = conf;
 
     ssize_t                            size;
-    ngx_int_t                          gzip;
-    ngx_uint_t                         i, n;
+    ngx_int_t                          gzip, drop;
+    ngx_uint_t                         i, n, async;
     ngx_msec_t                         flush;
-    ngx_str_t                         *value, name, s;
+    ngx_str_t                         *value, name, s, pool;
     ngx_http_log_t                    *log;
     ngx_syslog_peer_t                 *peer;
     ngx_http_log_buf_t                *buffer;
@@ -1422,9 +2069,19 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->schema.len && log->syslog_peer) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" cannot be used "
+                           "for logging to syslog", &name);
+        return NGX_CONF_ERROR;
+    }
+
     size = 0;
     flush = 0;
     gzip = 0;
+    async = 0;
+    drop = NGX_CONF_UNSET;
+    ngx_str_null(&pool);
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1491,6 +2148,47 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "async", 5) == 0
+            && (value[i].len == 5 || value[i].data[5] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            async = 1;
+
+            if (value[i].len > 6) {
+                pool.len = value[i].len - 6;
+                pool.data = value[i].data + 6;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"async\" is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "overflow=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "drop") == 0) {
+                drop = 1;
+                continue;
+            }
+
+            if (ngx_strcmp(&value[i].data[9], "block") == 0) {
+                drop = 0;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid overflow policy \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1526,6 +2224,26 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    /*
+     * binary logs to files are buffered to write the schema once per
+     * buffer; logs with variables in name carry it in each record
+     */
+
+    if (log->format->schema.len && size == 0 && log->script == NULL) {
+        size = 64 * 1024;
+    }
+
+    if (drop != NGX_CONF_UNSET && !async) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"overflow\" requires \"async\" "
+                           "for access_log \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (drop == NGX_CONF_UNSET) {
+        drop = 0;
+    }
+
     if (size) {
 
         if (log->script) {
@@ -1545,7 +2263,9 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+                || buffer->async != async
+                || buffer->drop != (ngx_uint_t) drop)
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1562,7 +2282,9 @@ process_formats:
             return NGX_CONF_ERROR;
         }
 
-        buffer->start = ngx_pnalloc(cf->pool, size);
+        buffer->start = ngx_pnalloc(cf->pool,
+                                    async ? NGX_HTTP_LOG_THREAD_BUFS * size
+                                          : size);
         if (buffer->start == NULL) {
             return NGX_CONF_ERROR;
         }
@@ -1585,15 +2307,72 @@ process_formats:
         }
 
         buffer->gzip = gzip;
+        buffer->async = async;
+        buffer->drop = drop;
 
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
+
+#if (NGX_THREADS)
+        if (async
+            && ngx_http_log_thread_init(cf, log->file, &pool) != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+#endif
     }
 
     return NGX_CONF_OK;
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_log_thread_init(ngx_conf_t *cf, ngx_open_file_t *file,
+    ngx_str_t *name)
+{
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+
+    buffer->thread_pool = ngx_thread_pool_add(cf, name->len ? name : NULL);
+    if (buffer->thread_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_mutex_create(&buffer->mutex, cf->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    task = ngx_thread_task_alloc(cf->pool, sizeof(ngx_http_log_thread_ctx_t));
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_log_thread_handler;
+    task->event.data = file;
+    task->event.handler = ngx_http_log_thread_event_handler;
+    task->event.log = &cf->cycle->new_log;
+
+    ctx = task->ctx;
+
+    ctx->name = file->name.data;
+    ctx->gzip = buffer->gzip;
+    ctx->mutex = &buffer->mutex;
+
+    buffer->task = task;
+    buffer->bufs = buffer->start;
+    buffer->size = buffer->last - buffer->start;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static char *
 ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1626,6 +2405,9 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     fmt->name = value[1];
 
+    ngx_str_null(&fmt->schema);
+    fmt->id = 0;
+
     fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
     if (fmt->flushes == NULL) {
         return NGX_CONF_ERROR;
@@ -1636,6 +2418,12 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts > 2
+        && ngx_strcmp(value[2].data, "format=binary") == 0)
+    {
+        return ngx_http_log_compile_binary_format(cf, fmt, cf->args, 3);
+    }
+
     return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
 }
 
@@ -1822,6 +2610,160 @@ invalid:
 }
 
 
+static char *
+ngx_http_log_compile_binary_format(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt,
+    ngx_array_t *args, ngx_uint_t s)
+{
+    u_char                     *p, *last, ch;
+    size_t                      i, len;
+    ngx_int_t                  *flush, index;
+    ngx_str_t                  *value, var;
+    ngx_uint_t                  n;
+    ngx_http_log_op_t          *op;
+    ngx_http_log_binary_var_t  *v;
+
+    value = args->elts;
+
+    n = args->nelts - s;
+
+    if (n == 0 || n > 255 || fmt->name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid binary log format \"%V\"", &fmt->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * the schema record: the header, the format name, and the type
+     * and the name of each field, the names prefixed by their lengths
+     */
+
+    len = NGX_HTTP_LOG_BINARY_HEADER + 1 + fmt->name.len + 1;
+
+    for (i = s; i < args->nelts; i++) {
+        len += 2 + value[i].len;
+    }
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->schema.data = p;
+
+    p += NGX_HTTP_LOG_BINARY_HEADER;
+
+    *p++ = (u_char) fmt->name.len;
+    p = ngx_cpymem(p, fmt->name.data, fmt->name.len);
+
+    *p++ = (u_char) n;
+
+    for ( /* void */ ; s < args->nelts; s++) {
+
+        var = value[s];
+
+        if (var.len < 2 || var.data[0] != '$') {
+            goto invalid;
+        }
+
+        var.data++;
+        var.len--;
+
+        if (var.data[0] == '{') {
+            if (var.len < 3 || var.data[var.len - 1] != '}') {
+                goto invalid;
+            }
+
+            var.data++;
+            var.len -= 2;
+        }
+
+        if (var.len > 255) {
+            goto invalid;
+        }
+
+        for (i = 0; i < var.len; i++) {
+            ch = var.data[i];
+
+            if ((ch >= 'A' && ch <= 'Z')
+                || (ch >= 'a' && ch <= 'z')
+                || (ch >= '0' && ch <= '9')
+                || ch == '_')
+            {
+                continue;
+            }
+
+            goto invalid;
+        }
+
+        op = ngx_array_push(fmt->ops);
+        if (op == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (v = ngx_http_log_binary_vars; v->name.len; v++) {
+
+            if (v->name.len == var.len
+                && ngx_strncmp(v->name.data, var.data, var.len) == 0)
+            {
+                op->len = v->len;
+                op->getlen = NULL;
+                op->run = v->run;
+                op->data = 0;
+
+                *p++ = v->type;
+
+                goto found;
+            }
+        }
+
+        index = ngx_http_get_variable_index(cf, &var);
+        if (index == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        op->len = 0;
+        op->getlen = ngx_http_log_binary_variable_getlen;
+        op->run = ngx_http_log_binary_variable;
+        op->data = index;
+
+        flush = ngx_array_push(fmt->flushes);
+        if (flush == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *flush = index;
+
+        *p++ = 'S';
+
+    found:
+
+        *p++ = (u_char) var.len;
+        p = ngx_cpymem(p, var.data, var.len);
+    }
+
+    last = p;
+    p = fmt->schema.data;
+
+    fmt->schema.len = last - p;
+    fmt->id = ngx_crc32_short(p + NGX_HTTP_LOG_BINARY_HEADER,
+                              fmt->schema.len - NGX_HTTP_LOG_BINARY_HEADER);
+
+    p = ngx_http_log_binary_uint(p, fmt->schema.len - 4, 4);
+    *p++ = NGX_HTTP_LOG_BINARY_SCHEMA;
+    (void) ngx_http_log_binary_uint(p, fmt->id, 4);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid binary log format field \"%V\", "
+                       "only variables are allowed", &value[s]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 static char *
 ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
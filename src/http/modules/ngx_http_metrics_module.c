@@ -0,0 +1,1399 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_METRICS_SERVER      0
+#define NGX_HTTP_METRICS_LOCATION    1
+#define NGX_HTTP_METRICS_PEER        2
+
+#define NGX_HTTP_METRICS_PROMETHEUS  0
+#define NGX_HTTP_METRICS_JSON        1
+
+#define NGX_HTTP_METRICS_BUCKETS     12
+
+
+typedef struct {
+    uint64_t                     requests;
+    uint64_t                     responses[5];
+    uint64_t                     received;
+    uint64_t                     sent;
+    uint64_t                     time;
+    uint64_t                     buckets[NGX_HTTP_METRICS_BUCKETS];
+} ngx_http_metrics_counters_t;
+
+
+typedef struct {
+    ngx_uint_t                   kind;
+    ngx_str_t                    name;
+    ngx_str_t                    item;
+} ngx_http_metrics_entry_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t            node;
+    ngx_str_t                    name;
+    ngx_str_t                    item;
+    ngx_uint_t                   index;
+} ngx_http_metrics_node_t;
+
+
+typedef struct {
+    ngx_uint_t                   generation;
+    u_char                      *slots;
+    u_char                      *prev;
+
+    /* the slots of a configuration which is not committed yet */
+    u_char                      *next;
+} ngx_http_metrics_shctx_t;
+
+
+typedef struct {
+    ngx_http_metrics_shctx_t    *sh;
+    ngx_slab_pool_t             *shpool;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_cycle_t                 *cycle;
+
+    /* the previous configuration's zone context, used on reload */
+    void                        *old;
+
+    ngx_array_t                  entries;     /* ngx_http_metrics_entry_t */
+
+    /* the upstream peer entries indexed by upstream and peer names */
+    ngx_rbtree_t                 peers;
+    ngx_rbtree_node_t            sentinel;
+
+    /* a copy of the shared state as seen by this configuration */
+    u_char                      *slots;
+    ngx_uint_t                   generation;
+    ngx_uint_t                   workers;
+    size_t                       stride;
+} ngx_http_metrics_ctx_t;
+
+
+typedef struct {
+    ngx_array_t                  zones;       /* ngx_http_metrics_ctx_t * */
+} ngx_http_metrics_main_conf_t;
+
+
+typedef struct {
+    ngx_shm_zone_t              *zone;
+    ngx_uint_t                   server;
+    ngx_uint_t                   location;
+
+    ngx_shm_zone_t              *export;
+    ngx_uint_t                   format;
+} ngx_http_metrics_loc_conf_t;
+
+
+static ngx_int_t ngx_http_metrics_log_handler(ngx_http_request_t *r);
+static void ngx_http_metrics_account(ngx_http_metrics_ctx_t *ctx,
+    ngx_uint_t index, ngx_uint_t status, off_t received, off_t sent,
+    ngx_msec_t ms);
+static ngx_int_t ngx_http_metrics_export_handler(ngx_http_request_t *r);
+static void ngx_http_metrics_aggregate(ngx_http_metrics_ctx_t *ctx,
+    u_char *slots, ngx_uint_t index, ngx_http_metrics_counters_t *sum);
+static u_char *ngx_http_metrics_prometheus(u_char *p,
+    ngx_http_metrics_ctx_t *ctx, ngx_http_metrics_counters_t *counters);
+static u_char *ngx_http_metrics_prometheus_labels(u_char *p,
+    ngx_http_metrics_entry_t *entry);
+static u_char *ngx_http_metrics_prometheus_escape(u_char *p, ngx_str_t *value);
+static u_char *ngx_http_metrics_json(u_char *p, ngx_http_metrics_ctx_t *ctx,
+    ngx_http_metrics_counters_t *counters);
+static ngx_int_t ngx_http_metrics_register(ngx_http_metrics_ctx_t *ctx,
+    ngx_uint_t kind, ngx_str_t *name, ngx_str_t *item);
+static ngx_int_t ngx_http_metrics_lookup(ngx_http_metrics_ctx_t *ctx,
+    ngx_str_t *name, ngx_str_t *item);
+static uint32_t ngx_http_metrics_hash(ngx_str_t *name, ngx_str_t *item);
+static ngx_int_t ngx_http_metrics_node_cmp(ngx_http_metrics_node_t *mn,
+    ngx_str_t *name, ngx_str_t *item);
+static void ngx_http_metrics_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_metrics_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_metrics_init_slots(ngx_http_metrics_ctx_t *ctx);
+static void ngx_http_metrics_switch_slots(ngx_http_metrics_ctx_t *ctx);
+static void *ngx_http_metrics_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_metrics_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_metrics_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_metrics(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_metrics_export(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_metrics_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_metrics_init_module(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_metrics_commands[] = {
+
+    { ngx_string("metrics_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_metrics_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("metrics"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_metrics,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("metrics_export"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_metrics_export,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_metrics_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_metrics_init,                 /* postconfiguration */
+
+    ngx_http_metrics_create_main_conf,     /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_metrics_create_loc_conf,      /* create location configuration */
+    ngx_http_metrics_merge_loc_conf        /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_metrics_module = {
+    NGX_MODULE_V1,
+    &ngx_http_metrics_module_ctx,          /* module context */
+    ngx_http_metrics_commands,             /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_metrics_init_module,          /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/* upper bounds of the latency histogram buckets, in milliseconds */
+
+static ngx_msec_t  ngx_http_metrics_bounds[NGX_HTTP_METRICS_BUCKETS - 1] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static ngx_str_t  ngx_http_metrics_le[NGX_HTTP_METRICS_BUCKETS] = {
+    ngx_string("0.005"), ngx_string("0.01"), ngx_string("0.025"),
+    ngx_string("0.05"), ngx_string("0.1"), ngx_string("0.25"),
+    ngx_string("0.5"), ngx_string("1"), ngx_string("2.5"), ngx_string("5"),
+    ngx_string("10"), ngx_string("+Inf")
+};
+
+static ngx_str_t  ngx_http_metrics_prefix[] = {
+    ngx_string("nginx_http_server_"),
+    ngx_string("nginx_http_location_"),
+    ngx_string("nginx_http_upstream_peer_")
+};
+
+static ngx_str_t  ngx_http_metrics_json_names[] = {
+    ngx_string("servers"),
+    ngx_string("locations"),
+    ngx_string("upstreams")
+};
+
+
+static ngx_int_t
+ngx_http_metrics_log_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                     n;
+    ngx_uint_t                    i, status;
+    ngx_msec_int_t                ms;
+    ngx_time_t                   *tp;
+    ngx_http_upstream_t          *u;
+    ngx_http_metrics_ctx_t       *ctx;
+    ngx_http_upstream_state_t    *state;
+    ngx_http_metrics_loc_conf_t  *mlcf;
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_metrics_module);
+
+    if (mlcf->zone == NULL) {
+        return NGX_OK;
+    }
+
+    ctx = mlcf->zone->data;
+
+    if (ctx->sh->generation != ctx->generation) {
+        /* the configuration was reloaded, this worker is shutting down */
+        return NGX_OK;
+    }
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else if (r->headers_out.status) {
+        status = r->headers_out.status;
+
+    } else {
+        status = 0;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    ngx_http_metrics_account(ctx, mlcf->server, status, r->request_length,
+                             r->connection->sent, (ngx_msec_t) ms);
+
+    if (mlcf->location != NGX_CONF_UNSET_UINT) {
+        ngx_http_metrics_account(ctx, mlcf->location, status,
+                                 r->request_length, r->connection->sent,
+                                 (ngx_msec_t) ms);
+    }
+
+    u = r->upstream;
+
+    if (u == NULL || u->upstream == NULL || r->upstream_states == NULL) {
+        return NGX_OK;
+    }
+
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        if (state[i].peer == NULL) {
+            continue;
+        }
+
+        n = ngx_http_metrics_lookup(ctx, &u->upstream->host, state[i].peer);
+
+        if (n == NGX_DECLINED) {
+            continue;
+        }
+
+        ngx_http_metrics_account(ctx, n, state[i].status,
+                                 state[i].bytes_received,
+                                 state[i].bytes_sent,
+                                 state[i].response_time);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_metrics_account(ngx_http_metrics_ctx_t *ctx, ngx_uint_t index,
+    ngx_uint_t status, off_t received, off_t sent, ngx_msec_t ms)
+{
+    ngx_uint_t                    b, worker;
+    ngx_http_metrics_counters_t  *c;
+
+    /*
+     * every worker owns its own cache line aligned slot,
+     * so the counters are updated without atomic operations
+     */
+
+    worker = (ngx_worker < ctx->workers) ? ngx_worker : 0;
+
+    c = (ngx_http_metrics_counters_t *)
+            (ctx->slots + (index * ctx->workers + worker) * ctx->stride);
+
+    c->requests++;
+
+    if (status >= 100 && status < 600) {
+        c->responses[status / 100 - 1]++;
+    }
+
+    c->received += received;
+    c->sent += sent;
+
+    if (ms == (ngx_msec_t) -1) {
+        return;
+    }
+
+    c->time += ms;
+
+    for (b = 0; b < NGX_HTTP_METRICS_BUCKETS - 1; b++) {
+        if (ms <= ngx_http_metrics_bounds[b]) {
+            break;
+        }
+    }
+
+    c->buckets[b]++;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_export_handler(ngx_http_request_t *r)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    i;
+    ngx_chain_t                   out;
+    ngx_http_metrics_ctx_t       *ctx;
+    ngx_http_metrics_entry_t     *entry;
+    ngx_http_metrics_loc_conf_t  *mlcf;
+    ngx_http_metrics_counters_t  *counters;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_metrics_module);
+
+    ctx = mlcf->export->data;
+
+    if (mlcf->format == NGX_HTTP_METRICS_JSON) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len =
+                                   sizeof("text/plain; version=0.0.4") - 1;
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    counters = ngx_palloc(r->pool, (ctx->entries.nelts + 1)
+                                   * sizeof(ngx_http_metrics_counters_t));
+    if (counters == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /*
+     * the slots are read without a lock: a counter may be a few requests
+     * behind, but it never goes backwards
+     */
+
+    size = 4096;
+    entry = ctx->entries.elts;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        ngx_http_metrics_aggregate(ctx, ctx->slots, i, &counters[i]);
+
+        size += (NGX_HTTP_METRICS_BUCKETS + 12)
+                * (128 + 2 * (entry[i].name.len + entry[i].item.len)
+                   + ngx_escape_json(NULL, entry[i].name.data,
+                                     entry[i].name.len)
+                   + ngx_escape_json(NULL, entry[i].item.data,
+                                     entry[i].item.len));
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (mlcf->format == NGX_HTTP_METRICS_JSON) {
+        b->last = ngx_http_metrics_json(b->last, ctx, counters);
+
+    } else {
+        b->last = ngx_http_metrics_prometheus(b->last, ctx, counters);
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void
+ngx_http_metrics_aggregate(ngx_http_metrics_ctx_t *ctx, u_char *slots,
+    ngx_uint_t index, ngx_http_metrics_counters_t *sum)
+{
+    ngx_uint_t                    w, k;
+    ngx_http_metrics_counters_t  *c;
+
+    ngx_memzero(sum, sizeof(ngx_http_metrics_counters_t));
+
+    for (w = 0; w < ctx->workers; w++) {
+        c = (ngx_http_metrics_counters_t *)
+                (slots + (index * ctx->workers + w) * ctx->stride);
+
+        sum->requests += c->requests;
+
+        for (k = 0; k < 5; k++) {
+            sum->responses[k] += c->responses[k];
+        }
+
+        sum->received += c->received;
+        sum->sent += c->sent;
+        sum->time += c->time;
+
+        for (k = 0; k < NGX_HTTP_METRICS_BUCKETS; k++) {
+            sum->buckets[k] += c->buckets[k];
+        }
+    }
+}
+
+
+static u_char *
+ngx_http_metrics_prometheus(u_char *p, ngx_http_metrics_ctx_t *ctx,
+    ngx_http_metrics_counters_t *counters)
+{
+    uint64_t                   n;
+    ngx_str_t                 *pfx;
+    ngx_uint_t                 i, k, kind;
+    ngx_http_metrics_entry_t  *entry;
+
+    entry = ctx->entries.elts;
+
+    for (kind = NGX_HTTP_METRICS_SERVER; kind <= NGX_HTTP_METRICS_PEER; kind++) {
+
+        pfx = &ngx_http_metrics_prefix[kind];
+
+        p = ngx_sprintf(p, "# HELP %Vrequests_total Total number of "
+                           "requests.\n"
+                           "# TYPE %Vrequests_total counter\n", pfx, pfx);
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            p = ngx_sprintf(p, "%Vrequests_total{", pfx);
+            p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+            p = ngx_sprintf(p, "} %uL\n", counters[i].requests);
+        }
+
+        p = ngx_sprintf(p, "# HELP %Vresponses_total Total number of "
+                           "responses by status class.\n"
+                           "# TYPE %Vresponses_total counter\n", pfx, pfx);
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            for (k = 0; k < 5; k++) {
+                p = ngx_sprintf(p, "%Vresponses_total{", pfx);
+                p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+                p = ngx_sprintf(p, ",code=\"%uixx\"} %uL\n",
+                                k + 1, counters[i].responses[k]);
+            }
+        }
+
+        p = ngx_sprintf(p, "# HELP %Vreceived_bytes_total Total number of "
+                           "bytes received.\n"
+                           "# TYPE %Vreceived_bytes_total counter\n",
+                        pfx, pfx);
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            p = ngx_sprintf(p, "%Vreceived_bytes_total{", pfx);
+            p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+            p = ngx_sprintf(p, "} %uL\n", counters[i].received);
+        }
+
+        p = ngx_sprintf(p, "# HELP %Vsent_bytes_total Total number of "
+                           "bytes sent.\n"
+                           "# TYPE %Vsent_bytes_total counter\n", pfx, pfx);
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            p = ngx_sprintf(p, "%Vsent_bytes_total{", pfx);
+            p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+            p = ngx_sprintf(p, "} %uL\n", counters[i].sent);
+        }
+
+        p = ngx_sprintf(p, "# HELP %Vduration_seconds Request processing "
+                           "time.\n"
+                           "# TYPE %Vduration_seconds histogram\n", pfx, pfx);
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            n = 0;
+
+            for (k = 0; k < NGX_HTTP_METRICS_BUCKETS; k++) {
+                n += counters[i].buckets[k];
+
+                p = ngx_sprintf(p, "%Vduration_seconds_bucket{", pfx);
+                p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+                p = ngx_sprintf(p, ",le=\"%V\"} %uL\n",
+                                &ngx_http_metrics_le[k], n);
+            }
+
+            p = ngx_sprintf(p, "%Vduration_seconds_sum{", pfx);
+            p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+            p = ngx_sprintf(p, "} %uL.%03uL\n",
+                            counters[i].time / 1000, counters[i].time % 1000);
+
+            p = ngx_sprintf(p, "%Vduration_seconds_count{", pfx);
+            p = ngx_http_metrics_prometheus_labels(p, &entry[i]);
+            p = ngx_sprintf(p, "} %uL\n", n);
+        }
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_prometheus_labels(u_char *p, ngx_http_metrics_entry_t *entry)
+{
+    switch (entry->kind) {
+
+    case NGX_HTTP_METRICS_SERVER:
+        p = ngx_cpymem(p, "server=\"", sizeof("server=\"") - 1);
+        p = ngx_http_metrics_prometheus_escape(p, &entry->name);
+        *p++ = '"';
+        break;
+
+    case NGX_HTTP_METRICS_LOCATION:
+        p = ngx_cpymem(p, "server=\"", sizeof("server=\"") - 1);
+        p = ngx_http_metrics_prometheus_escape(p, &entry->name);
+        p = ngx_cpymem(p, "\",location=\"", sizeof("\",location=\"") - 1);
+        p = ngx_http_metrics_prometheus_escape(p, &entry->item);
+        *p++ = '"';
+        break;
+
+    default: /* NGX_HTTP_METRICS_PEER */
+        p = ngx_cpymem(p, "upstream=\"", sizeof("upstream=\"") - 1);
+        p = ngx_http_metrics_prometheus_escape(p, &entry->name);
+        p = ngx_cpymem(p, "\",peer=\"", sizeof("\",peer=\"") - 1);
+        p = ngx_http_metrics_prometheus_escape(p, &entry->item);
+        *p++ = '"';
+        break;
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_prometheus_escape(u_char *p, ngx_str_t *value)
+{
+    u_char  *s, *last;
+
+    /* the exposition format escapes only backslash, quote and newline */
+
+    last = value->data + value->len;
+
+    for (s = value->data; s < last; s++) {
+
+        switch (*s) {
+
+        case '\\':
+        case '"':
+            *p++ = '\\';
+            *p++ = *s;
+            break;
+
+        case LF:
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+
+        default:
+            *p++ = *s;
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_json(u_char *p, ngx_http_metrics_ctx_t *ctx,
+    ngx_http_metrics_counters_t *counters)
+{
+    ngx_uint_t                    i, k, kind, first;
+    ngx_http_metrics_entry_t     *entry;
+    ngx_http_metrics_counters_t  *c;
+
+    entry = ctx->entries.elts;
+
+    *p++ = '{';
+
+    for (kind = NGX_HTTP_METRICS_SERVER; kind <= NGX_HTTP_METRICS_PEER; kind++) {
+
+        p = ngx_sprintf(p, "%s\"%V\":[", kind ? "," : "",
+                        &ngx_http_metrics_json_names[kind]);
+
+        first = 1;
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            if (entry[i].kind != kind) {
+                continue;
+            }
+
+            if (!first) {
+                *p++ = ',';
+            }
+
+            first = 0;
+
+            p = ngx_cpymem(p, (kind == NGX_HTTP_METRICS_PEER)
+                              ? "{\"upstream\":\"" : "{\"server\":\"",
+                           (kind == NGX_HTTP_METRICS_PEER)
+                              ? sizeof("{\"upstream\":\"") - 1
+                              : sizeof("{\"server\":\"") - 1);
+            p = (u_char *) ngx_escape_json(p, entry[i].name.data,
+                                           entry[i].name.len);
+            *p++ = '"';
+
+            if (kind != NGX_HTTP_METRICS_SERVER) {
+                p = ngx_cpymem(p, (kind == NGX_HTTP_METRICS_PEER)
+                                  ? ",\"peer\":\"" : ",\"location\":\"",
+                               (kind == NGX_HTTP_METRICS_PEER)
+                                  ? sizeof(",\"peer\":\"") - 1
+                                  : sizeof(",\"location\":\"") - 1);
+                p = (u_char *) ngx_escape_json(p, entry[i].item.data,
+                                               entry[i].item.len);
+                *p++ = '"';
+            }
+
+            c = &counters[i];
+
+            p = ngx_sprintf(p, ",\"requests\":%uL,\"responses\":{"
+                               "\"1xx\":%uL,\"2xx\":%uL,\"3xx\":%uL,"
+                               "\"4xx\":%uL,\"5xx\":%uL},"
+                               "\"received\":%uL,\"sent\":%uL,"
+                               "\"time\":%uL,\"latency\":{",
+                            c->requests, c->responses[0], c->responses[1],
+                            c->responses[2], c->responses[3],
+                            c->responses[4], c->received, c->sent, c->time);
+
+            for (k = 0; k < NGX_HTTP_METRICS_BUCKETS - 1; k++) {
+                p = ngx_sprintf(p, "\"%M\":%uL,",
+                                ngx_http_metrics_bounds[k], c->buckets[k]);
+            }
+
+            p = ngx_sprintf(p, "\"inf\":%uL}}", c->buckets[k]);
+        }
+
+        *p++ = ']';
+    }
+
+    *p++ = '}';
+    *p++ = LF;
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_register(ngx_http_metrics_ctx_t *ctx, ngx_uint_t kind,
+    ngx_str_t *name, ngx_str_t *item)
+{
+    ngx_uint_t                 i;
+    ngx_http_metrics_node_t   *mn;
+    ngx_http_metrics_entry_t  *entry;
+
+    entry = ctx->entries.elts;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if (entry[i].kind == kind
+            && entry[i].name.len == name->len
+            && entry[i].item.len == item->len
+            && ngx_strncmp(entry[i].name.data, name->data, name->len) == 0
+            && ngx_strncmp(entry[i].item.data, item->data, item->len) == 0)
+        {
+            return i;
+        }
+    }
+
+    entry = ngx_array_push(&ctx->entries);
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    entry->kind = kind;
+    entry->name = *name;
+    entry->item = *item;
+
+    if (kind != NGX_HTTP_METRICS_PEER) {
+        return i;
+    }
+
+    /* upstream peers are looked up on every request */
+
+    mn = ngx_palloc(ctx->entries.pool, sizeof(ngx_http_metrics_node_t));
+    if (mn == NULL) {
+        return NGX_ERROR;
+    }
+
+    mn->node.key = ngx_http_metrics_hash(name, item);
+    mn->name = *name;
+    mn->item = *item;
+    mn->index = i;
+
+    ngx_rbtree_insert(&ctx->peers, &mn->node);
+
+    return i;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_lookup(ngx_http_metrics_ctx_t *ctx, ngx_str_t *name,
+    ngx_str_t *item)
+{
+    uint32_t                  hash;
+    ngx_int_t                 rc;
+    ngx_rbtree_node_t        *node, *sentinel;
+    ngx_http_metrics_node_t  *mn;
+
+    hash = ngx_http_metrics_hash(name, item);
+
+    node = ctx->peers.root;
+    sentinel = ctx->peers.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        mn = (ngx_http_metrics_node_t *) node;
+
+        rc = ngx_http_metrics_node_cmp(mn, name, item);
+
+        if (rc == 0) {
+            return mn->index;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static uint32_t
+ngx_http_metrics_hash(ngx_str_t *name, ngx_str_t *item)
+{
+    uint32_t  hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, name->data, name->len);
+    ngx_crc32_update(&hash, item->data, item->len);
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_node_cmp(ngx_http_metrics_node_t *mn, ngx_str_t *name,
+    ngx_str_t *item)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_memn2cmp(name->data, mn->name.data, name->len, mn->name.len);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    return ngx_memn2cmp(item->data, mn->item.data, item->len, mn->item.len);
+}
+
+
+static void
+ngx_http_metrics_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t        **p;
+    ngx_http_metrics_node_t   *mn;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            mn = (ngx_http_metrics_node_t *) node;
+
+            p = (ngx_http_metrics_node_cmp((ngx_http_metrics_node_t *) temp,
+                                           &mn->name, &mn->item)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_metrics_ctx_t  *octx = data;
+
+    size_t                   len;
+    ngx_core_conf_t         *ccf;
+    ngx_http_metrics_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ctx->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    ctx->workers = ngx_max(ccf->worker_processes, 1);
+    ctx->stride = ngx_align(sizeof(ngx_http_metrics_counters_t),
+                            NGX_CPU_CACHE_LINE);
+
+    ctx->old = octx;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return ngx_http_metrics_init_slots(ctx);
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+        ctx->slots = ctx->sh->slots;
+        ctx->generation = ctx->sh->generation;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_http_metrics_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    len = sizeof(" in metrics zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in metrics zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return ngx_http_metrics_init_slots(ctx);
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init_slots(ngx_http_metrics_ctx_t *ctx)
+{
+    size_t   size;
+    u_char  *slots;
+
+    /*
+     * the slots are allocated before the new configuration is committed,
+     * so the lack of memory rolls the configuration back; the running
+     * workers keep counting until ngx_http_metrics_switch_slots()
+     */
+
+    size = ngx_max(ctx->entries.nelts, 1) * ctx->workers * ctx->stride;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    /* the slots of a configuration that was rolled back */
+
+    if (ctx->sh->next) {
+        ngx_slab_free_locked(ctx->shpool, ctx->sh->next);
+        ctx->sh->next = NULL;
+    }
+
+    slots = ngx_slab_calloc_locked(ctx->shpool, size);
+
+    ctx->sh->next = slots;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (slots == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, ctx->shm_zone->shm.log, 0,
+                      "metrics zone \"%V\" is too small for %ui entries",
+                      &ctx->shm_zone->shm.name, ctx->entries.nelts);
+        return NGX_ERROR;
+    }
+
+    ctx->slots = slots;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_metrics_switch_slots(ngx_http_metrics_ctx_t *ctx)
+{
+    u_char                       *slots;
+    ngx_uint_t                    i, n;
+    ngx_http_metrics_ctx_t       *octx;
+    ngx_http_metrics_entry_t     *entry, *oentry;
+    ngx_http_metrics_counters_t  *c;
+
+    slots = ctx->slots;
+    octx = ctx->old;
+
+    if (octx && octx->slots) {
+
+        /* keep the counters of the entries present in both configurations */
+
+        entry = ctx->entries.elts;
+        oentry = octx->entries.elts;
+
+        for (i = 0; i < ctx->entries.nelts; i++) {
+            for (n = 0; n < octx->entries.nelts; n++) {
+                if (entry[i].kind == oentry[n].kind
+                    && entry[i].name.len == oentry[n].name.len
+                    && entry[i].item.len == oentry[n].item.len
+                    && ngx_strncmp(entry[i].name.data, oentry[n].name.data,
+                                   entry[i].name.len)
+                       == 0
+                    && ngx_strncmp(entry[i].item.data, oentry[n].item.data,
+                                   entry[i].item.len)
+                       == 0)
+                {
+                    c = (ngx_http_metrics_counters_t *)
+                            (slots + i * ctx->workers * ctx->stride);
+
+                    ngx_http_metrics_aggregate(octx, octx->slots, n, c);
+                    break;
+                }
+            }
+        }
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    /*
+     * the slots of the configuration before the previous one are freed:
+     * the workers of that configuration stopped updating them once
+     * the generation was changed on the previous reload
+     */
+
+    if (ctx->sh->prev) {
+        ngx_slab_free_locked(ctx->shpool, ctx->sh->prev);
+    }
+
+    ctx->sh->prev = ctx->sh->slots;
+    ctx->sh->slots = slots;
+    ctx->sh->next = NULL;
+    ctx->sh->generation++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ctx->generation = ctx->sh->generation;
+}
+
+
+static void *
+ngx_http_metrics_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_main_conf_t));
+    if (mmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&mmcf->zones, cf->pool, 1,
+                       sizeof(ngx_http_metrics_ctx_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return mmcf;
+}
+
+
+static void *
+ngx_http_metrics_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_metrics_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->export = NULL;
+     *     conf->format = NGX_HTTP_METRICS_PROMETHEUS;
+     */
+
+    conf->zone = NGX_CONF_UNSET_PTR;
+    conf->server = NGX_CONF_UNSET_UINT;
+    conf->location = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_metrics_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_metrics_loc_conf_t *prev = parent;
+    ngx_http_metrics_loc_conf_t *conf = child;
+
+    ngx_int_t                  index;
+    ngx_str_t                  none = ngx_null_string;
+    ngx_http_metrics_ctx_t    *ctx;
+    ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    ngx_conf_merge_ptr_value(conf->zone, prev->zone, NULL);
+
+    if (conf->zone == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    ctx = conf->zone->data;
+
+    if (ctx == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown metrics zone \"%V\"",
+                           &conf->zone->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    index = ngx_http_metrics_register(ctx, NGX_HTTP_METRICS_SERVER,
+                                      &cscf->server_name, &none);
+    if (index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->server = index;
+
+    if (clcf == cscf->ctx->loc_conf[ngx_http_core_module.ctx_index]) {
+        /* the server level configuration */
+        return NGX_CONF_OK;
+    }
+
+    if (clcf->noname && prev->zone == conf->zone) {
+        /* "if" and "limit_except" blocks are accounted to their location */
+        conf->location = prev->location;
+        return NGX_CONF_OK;
+    }
+
+    index = ngx_http_metrics_register(ctx, NGX_HTTP_METRICS_LOCATION,
+                                      &cscf->server_name, &clcf->name);
+    if (index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->location = index;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_metrics_main_conf_t *mmcf = conf;
+
+    ssize_t                   size;
+    ngx_str_t                *value;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_http_metrics_ctx_t   *ctx, **ctxp;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&ctx->entries, cf->pool, 16,
+                       sizeof(ngx_http_metrics_entry_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                     &ngx_http_metrics_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is already defined",
+                           &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_rbtree_init(&ctx->peers, &ctx->sentinel,
+                    ngx_http_metrics_rbtree_insert_value);
+
+    ctx->shm_zone = shm_zone;
+    ctx->cycle = cf->cycle;
+
+    shm_zone->init = ngx_http_metrics_init_zone;
+    shm_zone->data = ctx;
+
+    ctxp = ngx_array_push(&mmcf->zones);
+    if (ctxp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *ctxp = ctx;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_metrics_loc_conf_t *mlcf = conf;
+
+    ngx_str_t  *value;
+
+    if (mlcf->zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mlcf->zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    mlcf->zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                       &ngx_http_metrics_module);
+    if (mlcf->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics_export(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_metrics_loc_conf_t *mlcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (mlcf->export) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mlcf->export = ngx_shared_memory_add(cf, &value[1], 0,
+                                         &ngx_http_metrics_module);
+    if (mlcf->export == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "format=json") == 0) {
+            mlcf->format = NGX_HTTP_METRICS_JSON;
+
+        } else if (ngx_strcmp(value[2].data, "format=prometheus") == 0) {
+            mlcf->format = NGX_HTTP_METRICS_PROMETHEUS;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_metrics_export_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                      i, j, k, n;
+    ngx_http_handler_pt            *h;
+    ngx_http_metrics_ctx_t        **ctxp;
+    ngx_http_core_main_conf_t      *cmcf;
+    ngx_http_upstream_server_t     *us;
+    ngx_http_metrics_main_conf_t   *mmcf;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_metrics_module);
+
+    if (mmcf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    /* every zone accounts all the upstream servers known at this point */
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    ctxp = mmcf->zones.elts;
+    uscfp = umcf->upstreams.elts;
+
+    for (n = 0; n < mmcf->zones.nelts; n++) {
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+            if (uscfp[i]->servers == NULL) {
+                continue;
+            }
+
+            us = uscfp[i]->servers->elts;
+
+            for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+                for (k = 0; k < us[j].naddrs; k++) {
+                    if (ngx_http_metrics_register(ctxp[n],
+                                                  NGX_HTTP_METRICS_PEER,
+                                                  &uscfp[i]->host,
+                                                  &us[j].addrs[k].name)
+                        == NGX_ERROR)
+                    {
+                        return NGX_ERROR;
+                    }
+                }
+            }
+        }
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_metrics_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_metrics_ctx_t        **ctxp;
+    ngx_http_metrics_main_conf_t   *mmcf;
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_metrics_module);
+
+    if (mmcf == NULL) {
+        return NGX_OK;
+    }
+
+    /* the new configuration is committed, switch the workers to its slots */
+
+    ctxp = mmcf->zones.elts;
+
+    for (i = 0; i < mmcf->zones.nelts; i++) {
+        if (ctxp[i]->shm_zone->shm.exists) {
+            continue;
+        }
+
+        ngx_http_metrics_switch_slots(ctxp[i]);
+    }
+
+    return NGX_OK;
+}
@@ -11,6 +11,9 @@
 
 
 static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r);
+#if (NGX_THREADS)
+static void ngx_http_static_thread_event_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_static_init(ngx_conf_t *cf);
 
 
@@ -58,6 +61,9 @@ ngx_http_static_handler(ngx_http_request_t *r)
     ngx_chain_t                out;
     ngx_open_file_info_t       of;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_THREADS)
+    ngx_event_t               *ev;
+#endif
 
     // ̃NGXg GET, HEAD, POST ̂ǂ̃\bhłȂ
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
@@ -101,9 +107,50 @@ ngx_http_static_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-        != NGX_OK)
-    {
+#if (NGX_THREADS)
+
+    if (clcf->open_file_cache && clcf->open_file_cache->thread_pool) {
+
+        ev = ngx_http_get_module_ctx(r, ngx_http_static_module);
+
+        if (ev == NULL) {
+            ev = ngx_pcalloc(r->pool, sizeof(ngx_event_t));
+            if (ev == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ev->handler = ngx_http_static_thread_event_handler;
+            ev->data = r;
+            ev->log = log;
+
+            ngx_http_set_ctx(r, ev, ngx_http_static_module);
+        }
+
+        of.thread_event = ev;
+    }
+
+#endif
+
+    rc = ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool);
+
+#if (NGX_THREADS)
+
+    if (rc == NGX_AGAIN) {
+
+        /* the handler is called again when the file is opened */
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        r->main->count++;
+        r->write_event_handler = ngx_http_core_run_phases;
+
+        return NGX_DONE;
+    }
+
+#endif
+
+    if (rc != NGX_OK) {
         switch (of.err) {
 
         case 0:
@@ -271,6 +318,33 @@ ngx_http_static_handler(ngx_http_request_t *r)
 }
 
 
+#if (NGX_THREADS)
+
+static void
+ngx_http_static_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http static thread: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
 /**
  * @brief
  *     {W[ postconfigure()
@@ -0,0 +1,1086 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_HTTP         0
+#define NGX_HTTP_UPSTREAM_HC_TCP          1
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE  4096
+
+
+typedef struct {
+    ngx_uint_t                         low;
+    ngx_uint_t                         high;
+} ngx_http_upstream_hc_status_t;
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    ngx_uint_t                         type;
+    in_port_t                          port;
+    ngx_str_t                          uri;
+    ngx_str_t                          body;
+    ngx_array_t                       *status;
+    ngx_str_t                          request;
+    ngx_http_upstream_srv_conf_t      *upstream;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_event_t                        event;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+} ngx_http_upstream_hc_t;
+
+
+typedef struct ngx_http_upstream_hc_probe_s  ngx_http_upstream_hc_probe_t;
+
+struct ngx_http_upstream_hc_probe_s {
+    ngx_pool_t                        *pool;
+    ngx_log_t                         *log;
+    ngx_peer_connection_t              pc;
+    ngx_buf_t                         *buffer;
+    size_t                             sent;
+    ngx_str_t                          name;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_uint_t                         config;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+    ngx_http_upstream_hc_probe_t      *next;
+};
+
+
+static void ngx_http_upstream_hc_handler(ngx_event_t *ev);
+static ngx_http_upstream_hc_probe_t *ngx_http_upstream_hc_create_probe(
+    ngx_http_upstream_hc_t *hc);
+static void ngx_http_upstream_hc_init_probe(ngx_http_upstream_hc_probe_t *pr,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_hc_connect(ngx_http_upstream_hc_probe_t *pr);
+static void ngx_http_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_hc_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_hc_test_response(
+    ngx_http_upstream_hc_probe_t *pr, ngx_uint_t eof);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_probe_t *pr,
+    ngx_uint_t healthy);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_hc_parse_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_str_t *value);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                     i, n;
+    ngx_msec_int_t                 left;
+    ngx_http_upstream_hc_t        *hc;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers, *backup;
+    ngx_http_upstream_hc_probe_t  *pr, *probes, *ready;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    hc = ev->data;
+    peers = hc->peers;
+
+    /*
+     * all workers wake up when the next round is due,
+     * the first one to take the write lock runs it
+     */
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    left = (ngx_msec_int_t) (peers->next_check - ngx_current_msec);
+
+    if (left > 0) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_add_timer(ev, (ngx_msec_t) left);
+        return;
+    }
+
+    peers->next_check = ngx_current_msec + hc->conf->interval;
+
+    n = peers->number + (peers->next ? peers->next->number : 0);
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check of upstream \"%V\"", peers->name);
+
+    /*
+     * probes are allocated without the lock, which blocks all workers;
+     * servers added meanwhile are checked in the next round
+     */
+
+    probes = NULL;
+
+    for (i = 0; i < n; i++) {
+        pr = ngx_http_upstream_hc_create_probe(hc);
+        if (pr == NULL) {
+            break;
+        }
+
+        pr->next = probes;
+        probes = pr;
+    }
+
+    ready = NULL;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (backup = peers; backup; backup = backup->next) {
+
+        if (backup != peers) {
+            ngx_http_upstream_rr_peers_rlock(backup);
+        }
+
+        for (peer = backup->peer; peer && probes; peer = peer->next) {
+
+            if (peer->down & NGX_HTTP_UPSTREAM_PEER_DOWN) {
+                continue;
+            }
+
+            pr = probes;
+            probes = pr->next;
+
+            ngx_http_upstream_hc_init_probe(pr, backup, peer);
+
+            pr->next = ready;
+            ready = pr;
+        }
+
+        if (backup != peers) {
+            ngx_http_upstream_rr_peers_unlock(backup);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    while (probes) {
+        pr = probes;
+        probes = pr->next;
+
+        ngx_destroy_pool(pr->pool);
+    }
+
+    while (ready) {
+        pr = ready;
+        ready = pr->next;
+
+        ngx_http_upstream_hc_connect(pr);
+    }
+
+    ngx_add_timer(ev, hc->conf->interval);
+}
+
+
+static ngx_http_upstream_hc_probe_t *
+ngx_http_upstream_hc_create_probe(ngx_http_upstream_hc_t *hc)
+{
+    ngx_pool_t                    *pool;
+    ngx_http_upstream_hc_probe_t  *pr;
+
+    pool = ngx_create_pool(512, hc->event.log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pr = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_probe_t));
+    if (pr == NULL) {
+        goto failed;
+    }
+
+    pr->pool = pool;
+    pr->log = hc->event.log;
+    pr->conf = hc->conf;
+
+    /* the peer may change while the probe is in progress */
+
+    pr->pc.sockaddr = ngx_palloc(pool, sizeof(ngx_sockaddr_t));
+    if (pr->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    pr->name.data = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+    if (pr->name.data == NULL) {
+        goto failed;
+    }
+
+    pr->pc.name = &pr->name;
+    pr->pc.get = ngx_event_get_peer;
+    pr->pc.log = pr->log;
+    pr->pc.log_error = NGX_ERROR_INFO;
+
+    if (hc->conf->type == NGX_HTTP_UPSTREAM_HC_HTTP) {
+        pr->buffer = ngx_create_temp_buf(pool,
+                                         NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE);
+        if (pr->buffer == NULL) {
+            goto failed;
+        }
+    }
+
+    return pr;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_hc_init_probe(ngx_http_upstream_hc_probe_t *pr,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    pr->peers = peers;
+    pr->peer = peer;
+    pr->config = peers->config ? *peers->config : 0;
+
+    ngx_memcpy(pr->pc.sockaddr, peer->sockaddr, peer->socklen);
+    pr->pc.socklen = peer->socklen;
+
+    if (pr->conf->port) {
+        ngx_inet_set_port(pr->pc.sockaddr, pr->conf->port);
+    }
+
+    pr->name.len = ngx_sock_ntop(pr->pc.sockaddr, pr->pc.socklen,
+                                 pr->name.data, NGX_SOCKADDR_STRLEN, 1);
+}
+
+
+static void
+ngx_http_upstream_hc_connect(ngx_http_upstream_hc_probe_t *pr)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pr->log, 0,
+                   "health check connect to %V", &pr->name);
+
+    rc = ngx_event_connect_peer(&pr->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finalize(pr, 0);
+        return;
+    }
+
+    c = pr->pc.connection;
+
+    c->data = pr;
+    c->pool = pr->pool;
+    c->log_error = NGX_ERROR_INFO;
+
+    c->write->handler = ngx_http_upstream_hc_send_handler;
+    c->read->handler = ngx_http_upstream_hc_recv_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, pr->conf->timeout);
+        return;
+    }
+
+    ngx_http_upstream_hc_send_handler(c->write);
+}
+
+
+static void
+ngx_http_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    ssize_t                        n;
+    ngx_str_t                     *request;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *pr;
+
+    c = wev->data;
+    pr = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, pr->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &pr->name);
+        ngx_http_upstream_hc_finalize(pr, 0);
+        return;
+    }
+
+    if (pr->sent == 0 && ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(pr, 0);
+        return;
+    }
+
+    if (pr->conf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+        ngx_http_upstream_hc_finalize(pr, 1);
+        return;
+    }
+
+    request = &pr->conf->request;
+
+    while (pr->sent < request->len) {
+        n = c->send(c, request->data + pr->sent, request->len - pr->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(pr, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (!wev->timer_set) {
+                ngx_add_timer(wev, pr->conf->timeout);
+            }
+
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(pr, 0);
+            }
+
+            return;
+        }
+
+        pr->sent += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_add_timer(c->read, pr->conf->timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_recv_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(pr, 0);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_recv_handler(ngx_event_t *rev)
+{
+    ssize_t                        n;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *pr;
+
+    c = rev->data;
+    pr = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, pr->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &pr->name);
+        ngx_http_upstream_hc_finalize(pr, 0);
+        return;
+    }
+
+    if (pr->buffer == NULL) {
+
+        /* "type=tcp", nothing to read */
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(pr, 0);
+        }
+
+        return;
+    }
+
+    b = pr->buffer;
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(pr, 0);
+            return;
+        }
+
+        if (n > 0) {
+            b->last += n;
+        }
+
+        rc = ngx_http_upstream_hc_test_response(pr,
+                                                n == 0 || b->last == b->end);
+
+        if (rc != NGX_AGAIN) {
+            ngx_http_upstream_hc_finalize(pr, rc == NGX_OK);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(pr, 0);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_response(ngx_http_upstream_hc_probe_t *pr,
+    ngx_uint_t eof)
+{
+    u_char                           *p, *last;
+    ngx_uint_t                        i, code;
+    ngx_http_upstream_hc_status_t    *status;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = pr->conf;
+
+    p = pr->buffer->pos;
+    last = pr->buffer->last;
+
+    /* "HTTP/1.x 200" */
+
+    if (last - p < 12 || ngx_strlchr(p, last, LF) == NULL) {
+        if (!eof) {
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, pr->log, 0,
+                      "health check of %V: no status line", &pr->name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_strncmp(p, "HTTP/", 5) != 0 || p[8] != ' '
+        || p[9] < '0' || p[9] > '9'
+        || p[10] < '0' || p[10] > '9'
+        || p[11] < '0' || p[11] > '9')
+    {
+        ngx_log_error(NGX_LOG_INFO, pr->log, 0,
+                      "health check of %V: invalid status line", &pr->name);
+        return NGX_ERROR;
+    }
+
+    code = (p[9] - '0') * 100 + (p[10] - '0') * 10 + p[11] - '0';
+
+    status = hcf->status->elts;
+
+    for (i = 0; i < hcf->status->nelts; i++) {
+        if (code >= status[i].low && code <= status[i].high) {
+            break;
+        }
+    }
+
+    if (i == hcf->status->nelts) {
+        ngx_log_error(NGX_LOG_INFO, pr->log, 0,
+                      "health check of %V: unexpected status %ui",
+                      &pr->name, code);
+        return NGX_ERROR;
+    }
+
+    if (hcf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_strlcasestrn(p, last, (u_char *) CRLF CRLF, 4 - 1);
+
+    if (p != NULL) {
+        p += 4;
+
+        /* the body may contain zero bytes */
+
+        for ( /* void */ ; p + hcf->body.len <= last; p++) {
+            if (ngx_memcmp(p, hcf->body.data, hcf->body.len) == 0) {
+                return NGX_OK;
+            }
+        }
+    }
+
+    if (!eof) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, pr->log, 0,
+                  "health check of %V: body does not match", &pr->name);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_probe_t *pr,
+    ngx_uint_t healthy)
+{
+    ngx_http_upstream_rr_peer_t      *peer, *p;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pr->log, 0,
+                   "health check of %V: %s",
+                   &pr->name, healthy ? "passed" : "failed");
+
+    if (pr->pc.connection) {
+        ngx_close_connection(pr->pc.connection);
+        pr->pc.connection = NULL;
+    }
+
+    hcf = pr->conf;
+    peers = pr->peers;
+    peer = pr->peer;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    /*
+     * the peer may have been removed after its name was resolved again,
+     * and its memory reused for another one
+     */
+
+    for (p = peers->peer; p; p = p->next) {
+        if (p == peer) {
+            break;
+        }
+    }
+
+    if (p == NULL || (peers->config && *peers->config != pr->config)) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        ngx_destroy_pool(pr->pool);
+        return;
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    if (healthy) {
+        peer->check_fails = 0;
+        peer->check_passes++;
+
+        if ((peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+            && peer->check_passes >= hcf->passes)
+        {
+            peer->down &= ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+            /* forget passive failures as well */
+
+            peer->fails = 0;
+            peer->effective_weight = peer->weight;
+
+            ngx_log_error(NGX_LOG_NOTICE, pr->log, 0,
+                          "upstream server %V in upstream \"%V\" is up",
+                          &peer->name, peers->name);
+        }
+
+    } else {
+        peer->check_passes = 0;
+        peer->check_fails++;
+
+        if (!(peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+            && peer->check_fails >= hcf->fails)
+        {
+            peer->down |= NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_WARN, pr->log, 0,
+                          "upstream server %V in upstream \"%V\" is down "
+                          "after failed health checks",
+                          &peer->name, peers->name);
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(pr->pool);
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->port = 0;
+     *     conf->uri = { 0, NULL };
+     *     conf->body = { 0, NULL };
+     *     conf->status = NULL;
+     *     conf->request = { 0, NULL };
+     *     conf->upstream = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                         *p;
+    ngx_int_t                       n;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_hc_status_t  *status;
+
+    if (hcf->interval) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->upstream = uscf;
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    hcf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+    ngx_str_set(&hcf->uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n == NGX_ERROR || n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "type=", 5) == 0) {
+
+            if (ngx_strcmp(&value[i].data[5], "http") == 0) {
+                hcf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+
+            } else if (ngx_strcmp(&value[i].data[5], "tcp") == 0) {
+                hcf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+
+            } else {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            hcf->uri.len = value[i].len - 4;
+            hcf->uri.data = &value[i].data[4];
+
+            if (hcf->uri.len == 0 || hcf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            if (ngx_http_upstream_hc_parse_status(cf, hcf, &s) != NGX_CONF_OK)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hcf->body.len = value[i].len - 5;
+            hcf->body.data = &value[i].data[5];
+
+            if (hcf->body.len == 0
+                || hcf->body.len > NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE / 2)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+
+        if (hcf->status || hcf->body.len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"status\" and \"body\" require "
+                               "\"type=http\"");
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (hcf->status == NULL) {
+        hcf->status = ngx_array_create(cf->pool, 1,
+                                      sizeof(ngx_http_upstream_hc_status_t));
+        if (hcf->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        status = ngx_array_push(hcf->status);
+        if (status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        status->low = 200;
+        status->high = 399;
+    }
+
+    hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + hcf->uri.len
+                       + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                       + sizeof("User-Agent: nginx" CRLF) - 1
+                       + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    hcf->request.data = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (hcf->request.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = ngx_sprintf(hcf->request.data,
+                    "GET %V HTTP/1.0" CRLF
+                    "Host: %V" CRLF
+                    "User-Agent: nginx" CRLF
+                    "Connection: close" CRLF CRLF,
+                    &hcf->uri, &uscf->host);
+
+    hcf->request.len = p - hcf->request.data;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_parse_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_str_t *value)
+{
+    u_char                         *p, *last, *comma, *dash;
+    ngx_int_t                       low, high;
+    ngx_http_upstream_hc_status_t  *status;
+
+    if (hcf->status == NULL) {
+        hcf->status = ngx_array_create(cf->pool, 2,
+                                      sizeof(ngx_http_upstream_hc_status_t));
+        if (hcf->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* "200", "200-299", "200,204,300-399" */
+
+    p = value->data;
+    last = p + value->len;
+
+    while (p < last) {
+        comma = ngx_strlchr(p, last, ',');
+
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        dash = ngx_strlchr(p, comma, '-');
+
+        if (dash) {
+            low = ngx_atoi(p, dash - p);
+            high = ngx_atoi(dash + 1, comma - dash - 1);
+
+        } else {
+            low = ngx_atoi(p, comma - p);
+            high = low;
+        }
+
+        if (low < 100 || high > 599 || low > high) {
+            return NGX_CONF_ERROR;
+        }
+
+        status = ngx_array_push(hcf->status);
+        if (status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        status->low = low;
+        status->high = high;
+
+        p = comma + 1;
+    }
+
+    if (hcf->status->nelts == 0) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_hc_t           *hc;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        hc = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_t));
+        if (hc == NULL) {
+            return NGX_ERROR;
+        }
+
+        hc->conf = hcf;
+        hc->peers = uscfp[i]->peer.data;
+
+        hc->event.handler = ngx_http_upstream_hc_handler;
+        hc->event.data = hc;
+        hc->event.log = cycle->log;
+        hc->event.cancelable = 1;
+
+        ngx_add_timer(&hc->event, ngx_random() % 1000 + 1);
+    }
+
+    return NGX_OK;
+}
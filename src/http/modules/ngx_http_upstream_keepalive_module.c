@@ -9,21 +9,91 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if !(NGX_WIN32)
+#include <ngx_channel.h>
+#endif
+
 
 typedef struct {
     ngx_uint_t                         max_cached;
     ngx_uint_t                         requests;
     ngx_msec_t                         timeout;
 
+    ngx_uint_t                         max_idle;
+    ngx_uint_t                         max_per_peer;
+    ngx_shm_zone_t                    *shm_zone;
+
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_rbtree_t                       peers;
+    ngx_rbtree_node_t                  sentinel;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t                  node;
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+} ngx_http_upstream_keepalive_addr_t;
+
+
+typedef struct {
+    ngx_http_upstream_keepalive_addr_t  addr;
+    ngx_queue_t                        queue;
+
+    /*
+     * idle connections are counted per keepalive_timeout period:
+     * a connection saved in a period is gone by the end of the next one,
+     * so counts left by a crashed worker expire
+     */
+
+    ngx_atomic_t                       idle[2];
+    ngx_atomic_t                       period[2];
+
+    /* the slot of a worker which missed the peer in its cache, plus 1 */
+
+    ngx_atomic_t                       want;
+
+    ngx_atomic_t                       reused;
+    ngx_atomic_t                       missed;
+    ngx_atomic_t                       saved;
+    ngx_atomic_t                       dropped;
+    ngx_atomic_t                       passed;
+} ngx_http_upstream_keepalive_node_t;
+
+
+typedef struct {
+    ngx_http_upstream_keepalive_addr_t  addr;
+
+    /* connections to the peer cached by this worker */
+
+    ngx_queue_t                        cache;
+    ngx_uint_t                         cached;
+
+    ngx_http_upstream_keepalive_node_t  *node;
+} ngx_http_upstream_keepalive_peer_t;
+
+
+typedef struct {
+    ngx_rbtree_t                       rbtree;
+    ngx_rbtree_node_t                  sentinel;
+    ngx_queue_t                        queue;
+} ngx_http_upstream_keepalive_shctx_t;
+
+
+typedef struct {
+    ngx_http_upstream_keepalive_shctx_t     *sh;
+    ngx_slab_pool_t                         *shpool;
+    ngx_str_t                                upstream;
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+} ngx_http_upstream_keepalive_zone_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
@@ -33,6 +103,10 @@ typedef struct {
     socklen_t                          socklen;
     ngx_sockaddr_t                     sockaddr;
 
+    ngx_queue_t                        peer_queue;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+    ngx_msec_t                         period;
+
 } ngx_http_upstream_keepalive_cache_t;
 
 
@@ -60,11 +134,43 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
     void *data);
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc,
+    ngx_uint_t pass);
 
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
 
+static ngx_http_upstream_keepalive_peer_t *ngx_http_upstream_keepalive_add_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc);
+static void ngx_http_upstream_keepalive_remove_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_peer_t *peer);
+static ngx_http_upstream_keepalive_node_t *ngx_http_upstream_keepalive_add_node(
+    ngx_http_upstream_keepalive_zone_t *zone, ngx_peer_connection_t *pc,
+    uint32_t hash);
+static ngx_http_upstream_keepalive_addr_t *ngx_http_upstream_keepalive_lookup(
+    ngx_rbtree_t *rbtree, ngx_peer_connection_t *pc, uint32_t hash);
+static ngx_uint_t ngx_http_upstream_keepalive_idle(
+    ngx_http_upstream_keepalive_node_t *node, ngx_msec_t period);
+static void ngx_http_upstream_keepalive_release(
+    ngx_http_upstream_keepalive_cache_t *item, ngx_uint_t reused);
+static void ngx_http_upstream_keepalive_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_upstream_keepalive_status_handler(
+    ngx_http_request_t *r);
+
+#if !(NGX_WIN32)
+static ngx_int_t ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_node_t *node, ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_channel_handler(ngx_channel_t *ch);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+#endif
+
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
     ngx_peer_connection_t *pc, void *data);
@@ -75,12 +181,14 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_keepalive_status(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -100,6 +208,13 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("upstream_keepalive_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_keepalive_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -126,7 +241,11 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
+#if !(NGX_WIN32)
+    ngx_http_upstream_keepalive_init_process, /* init process */
+#else
     NULL,                                  /* init process */
+#endif
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -171,6 +290,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
 
+    ngx_rbtree_init(&kcf->peers, &kcf->sentinel,
+                    ngx_http_upstream_keepalive_rbtree_insert_value);
+
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
         cached[i].conf = kcf;
@@ -228,6 +350,7 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_peer_t       *peer;
 
     ngx_int_t          rc;
     ngx_queue_t       *q, *cache;
@@ -262,10 +385,33 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
             ngx_queue_remove(q);
             ngx_queue_insert_head(&kp->conf->free, q);
 
+            ngx_http_upstream_keepalive_release(item, 1);
+
             goto found;
         }
     }
 
+    if (kp->conf->shm_zone) {
+        peer = ngx_http_upstream_keepalive_add_peer(kp->conf, pc);
+
+        if (peer && peer->node) {
+            (void) ngx_atomic_fetch_add(&peer->node->missed, 1);
+
+#if !(NGX_WIN32)
+            if (ngx_process == NGX_PROCESS_WORKER && !ngx_exiting) {
+
+                /* ask other workers to pass an idle connection */
+
+                peer->node->want = ngx_process_slot + 1;
+            }
+#endif
+        }
+
+        if (peer && peer->cached == 0) {
+            ngx_http_upstream_keepalive_remove_peer(kp->conf, peer);
+        }
+    }
+
     return NGX_OK;
 
 found:
@@ -297,9 +443,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
@@ -338,37 +482,147 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    ngx_http_upstream_keepalive_save(kp->conf, pc, 1);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc, ngx_uint_t pass)
+{
+    ngx_http_upstream_keepalive_cache_t  *item;
+    ngx_http_upstream_keepalive_node_t   *node;
+    ngx_http_upstream_keepalive_peer_t   *peer;
+
+    ngx_uint_t          n;
+    ngx_msec_t          period;
+    ngx_queue_t        *q;
+    ngx_connection_t   *c;
+    ngx_atomic_uint_t   old;
+
+    c = pc->connection;
+
     if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-        goto invalid;
+        return;
+    }
+
+    peer = NULL;
+    period = 0;
+
+    if (kcf->shm_zone || kcf->max_per_peer) {
+        peer = ngx_http_upstream_keepalive_add_peer(kcf, pc);
+    }
+
+    if (peer && peer->node) {
+        node = peer->node;
+
+#if !(NGX_WIN32)
+
+        /* a worker keeps one idle connection to the peer for itself */
+
+        if (pass
+            && peer->cached
+            && ngx_http_upstream_keepalive_pass(node, c) == NGX_OK)
+        {
+            pc->connection = NULL;
+            return;
+        }
+
+#endif
+
+        period = ngx_current_msec / ngx_max(kcf->timeout, 1);
+        n = period % 2;
+
+        old = node->period[n];
+
+        if (old != period
+            && ngx_atomic_cmp_set(&node->period[n], old, period))
+        {
+            /* connections counted two periods ago are gone */
+            node->idle[n] = 0;
+        }
+
+        if (kcf->max_idle
+            && ngx_http_upstream_keepalive_idle(node, period)
+               >= kcf->max_idle)
+        {
+            (void) ngx_atomic_fetch_add(&node->dropped, 1);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "free keepalive peer: %ui idle connections",
+                           kcf->max_idle);
+
+            if (peer->cached == 0) {
+                ngx_http_upstream_keepalive_remove_peer(kcf, peer);
+            }
+
+            return;
+        }
+
+        (void) ngx_atomic_fetch_add(&node->idle[n], 1);
+        (void) ngx_atomic_fetch_add(&node->saved, 1);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    /* the peer is not removed while its connections are evicted */
+
+    if (peer) {
+        peer->cached++;
+    }
+
+    q = NULL;
+
+    if (peer
+        && kcf->max_per_peer
+        && peer->cached > kcf->max_per_peer)
+    {
+        /* the least recently used connection to the peer */
 
-        q = ngx_queue_last(&kp->conf->cache);
+        q = ngx_queue_last(&peer->cache);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              peer_queue);
+        q = &item->queue;
+    }
+
+    if (q == NULL && ngx_queue_empty(&kcf->free)) {
+        q = ngx_queue_last(&kcf->cache);
+    }
+
+    if (q) {
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
+        ngx_http_upstream_keepalive_release(item, 0);
         ngx_http_upstream_keepalive_close(item->connection);
 
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+        q = ngx_queue_head(&kcf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kcf->cache, q);
 
     item->connection = c;
+    item->peer = peer;
+    item->period = period;
+
+    if (peer) {
+        ngx_queue_insert_head(&peer->cache, &item->peer_queue);
+    }
 
     pc->connection = NULL;
 
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -390,10 +644,6 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
@@ -441,6 +691,7 @@ close:
     item = c->data;
     conf = item->conf;
 
+    ngx_http_upstream_keepalive_release(item, 0);
     ngx_http_upstream_keepalive_close(c);
 
     ngx_queue_remove(&item->queue);
@@ -471,6 +722,675 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static ngx_http_upstream_keepalive_peer_t *
+ngx_http_upstream_keepalive_add_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc)
+{
+    uint32_t                             hash;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+    ngx_http_upstream_keepalive_zone_t  *zone;
+
+    /*
+     * peers are indexed per worker, so the zone is only locked
+     * when a worker sees a peer for the first time
+     */
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+
+    peer = (ngx_http_upstream_keepalive_peer_t *)
+               ngx_http_upstream_keepalive_lookup(&kcf->peers, pc, hash);
+
+    if (peer == NULL) {
+        peer = ngx_calloc(sizeof(ngx_http_upstream_keepalive_peer_t),
+                          ngx_cycle->log);
+        if (peer == NULL) {
+            return NULL;
+        }
+
+        peer->addr.node.key = hash;
+        peer->addr.socklen = pc->socklen;
+        ngx_memcpy(&peer->addr.sockaddr, pc->sockaddr, pc->socklen);
+
+        ngx_queue_init(&peer->cache);
+
+        ngx_rbtree_insert(&kcf->peers, &peer->addr.node);
+    }
+
+    if (peer->node == NULL && kcf->shm_zone) {
+        zone = kcf->shm_zone->data;
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        peer->node = ngx_http_upstream_keepalive_add_node(zone, pc, hash);
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+    }
+
+    return peer;
+}
+
+
+static void
+ngx_http_upstream_keepalive_remove_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_keepalive_peer_t *peer)
+{
+    /* a peer is indexed while the worker has idle connections to it */
+
+    ngx_rbtree_delete(&kcf->peers, &peer->addr.node);
+
+    ngx_free(peer);
+}
+
+
+static ngx_http_upstream_keepalive_node_t *
+ngx_http_upstream_keepalive_add_node(ngx_http_upstream_keepalive_zone_t *zone,
+    ngx_peer_connection_t *pc, uint32_t hash)
+{
+    ngx_http_upstream_keepalive_node_t  *kn;
+
+    /* the zone mutex must be held */
+
+    kn = (ngx_http_upstream_keepalive_node_t *)
+             ngx_http_upstream_keepalive_lookup(&zone->sh->rbtree, pc, hash);
+
+    if (kn) {
+        return kn;
+    }
+
+    kn = ngx_slab_calloc_locked(zone->shpool,
+                                sizeof(ngx_http_upstream_keepalive_node_t));
+    if (kn == NULL) {
+        return NULL;
+    }
+
+    kn->addr.node.key = hash;
+    kn->addr.socklen = pc->socklen;
+    ngx_memcpy(&kn->addr.sockaddr, pc->sockaddr, pc->socklen);
+
+    ngx_rbtree_insert(&zone->sh->rbtree, &kn->addr.node);
+    ngx_queue_insert_tail(&zone->sh->queue, &kn->queue);
+
+    return kn;
+}
+
+
+static ngx_http_upstream_keepalive_addr_t *
+ngx_http_upstream_keepalive_lookup(ngx_rbtree_t *rbtree,
+    ngx_peer_connection_t *pc, uint32_t hash)
+{
+    ngx_int_t                            rc;
+    ngx_rbtree_node_t                   *node, *sentinel;
+    ngx_http_upstream_keepalive_addr_t  *addr;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        addr = (ngx_http_upstream_keepalive_addr_t *) node;
+
+        rc = ngx_memn2cmp((u_char *) pc->sockaddr, (u_char *) &addr->sockaddr,
+                          pc->socklen, addr->socklen);
+
+        if (rc == 0) {
+            return addr;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_idle(ngx_http_upstream_keepalive_node_t *node,
+    ngx_msec_t period)
+{
+    ngx_uint_t        i, n;
+    ngx_atomic_int_t  idle;
+
+    n = 0;
+
+    for (i = 0; i < 2; i++) {
+
+        if (node->period[i] != period && node->period[i] + 1 != period) {
+            continue;
+        }
+
+        /* a decrement may race with the reset of an expired count */
+
+        idle = (ngx_atomic_int_t) node->idle[i];
+
+        if (idle > 0) {
+            n += idle;
+        }
+    }
+
+    return n;
+}
+
+
+static void
+ngx_http_upstream_keepalive_release(ngx_http_upstream_keepalive_cache_t *item,
+    ngx_uint_t reused)
+{
+    ngx_uint_t                           n;
+    ngx_http_upstream_keepalive_node_t  *node;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+
+    peer = item->peer;
+
+    if (peer == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&item->peer_queue);
+    peer->cached--;
+
+    node = peer->node;
+
+    if (node) {
+        n = item->period % 2;
+
+        if (node->period[n] == item->period) {
+            (void) ngx_atomic_fetch_add(&node->idle[n], -1);
+        }
+
+        if (reused) {
+            (void) ngx_atomic_fetch_add(&node->reused, 1);
+        }
+    }
+
+    item->peer = NULL;
+
+    if (peer->cached == 0) {
+        ngx_http_upstream_keepalive_remove_peer(item->conf, peer);
+    }
+}
+
+
+static void
+ngx_http_upstream_keepalive_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                   **p;
+    ngx_http_upstream_keepalive_addr_t   *addr, *addrt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            addr = (ngx_http_upstream_keepalive_addr_t *) node;
+            addrt = (ngx_http_upstream_keepalive_addr_t *) temp;
+
+            p = (ngx_memn2cmp((u_char *) &addr->sockaddr,
+                              (u_char *) &addrt->sockaddr,
+                              addr->socklen, addrt->socklen)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_keepalive_zone_t  *ozone = data;
+
+    size_t                               len;
+    ngx_http_upstream_keepalive_zone_t  *zone;
+
+    zone = shm_zone->data;
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_alloc(zone->shpool,
+                              sizeof(ngx_http_upstream_keepalive_shctx_t));
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    ngx_http_upstream_keepalive_rbtree_insert_value);
+
+    ngx_queue_init(&zone->sh->queue);
+
+    len = sizeof(" in keepalive zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in keepalive zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_status_handler(ngx_http_request_t *r)
+{
+    size_t                               size;
+    ngx_int_t                            rc;
+    ngx_buf_t                           *b;
+    ngx_uint_t                           i, n;
+    ngx_msec_t                           period;
+    ngx_queue_t                         *q;
+    ngx_chain_t                          out;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_list_part_t                     *part;
+    ngx_http_upstream_keepalive_node_t  *kn;
+    ngx_http_upstream_keepalive_zone_t  *zone;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    /*
+     * peers are never removed from a zone, so the number counted here
+     * can only grow while the lock is released; output is truncated then
+     */
+
+    size = 0;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_upstream_keepalive_module) {
+            continue;
+        }
+
+        zone = shm_zone[i].data;
+
+        n = 0;
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        for (q = ngx_queue_head(&zone->sh->queue);
+             q != ngx_queue_sentinel(&zone->sh->queue);
+             q = ngx_queue_next(q))
+        {
+            n++;
+        }
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+        size += n * (zone->upstream.len + NGX_SOCKADDR_STRLEN
+                     + sizeof("  idle= reused= missed= saved= dropped="
+                              " passed=\n")
+                     + 6 * NGX_ATOMIC_T_LEN);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size ? size : 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_upstream_keepalive_module) {
+            continue;
+        }
+
+        zone = shm_zone[i].data;
+
+        period = ngx_current_msec / ngx_max(zone->conf->timeout, 1);
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        for (q = ngx_queue_head(&zone->sh->queue);
+             q != ngx_queue_sentinel(&zone->sh->queue);
+             q = ngx_queue_next(q))
+        {
+            kn = ngx_queue_data(q, ngx_http_upstream_keepalive_node_t, queue);
+
+            if ((size_t) (b->end - b->last)
+                < zone->upstream.len + NGX_SOCKADDR_STRLEN
+                  + sizeof("  idle= reused= missed= saved= dropped="
+                           " passed=\n")
+                  + 6 * NGX_ATOMIC_T_LEN)
+            {
+                break;
+            }
+
+            b->last = ngx_cpymem(b->last, zone->upstream.data,
+                                 zone->upstream.len);
+            *b->last++ = ' ';
+
+            b->last += ngx_sock_ntop(&kn->addr.sockaddr.sockaddr,
+                                     kn->addr.socklen, b->last,
+                                     NGX_SOCKADDR_STRLEN, 1);
+
+            b->last = ngx_sprintf(b->last,
+                                  " idle=%ui reused=%uA missed=%uA"
+                                  " saved=%uA dropped=%uA passed=%uA\n",
+                                  ngx_http_upstream_keepalive_idle(kn, period),
+                                  kn->reused, kn->missed,
+                                  kn->saved, kn->dropped, kn->passed);
+        }
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+#if !(NGX_WIN32)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_node_t *node,
+    ngx_connection_t *c)
+{
+    ngx_int_t          slot;
+    ngx_channel_t      ch;
+    ngx_atomic_uint_t  want;
+
+    want = node->want;
+
+    if (want == 0) {
+        return NGX_DECLINED;
+    }
+
+    /* only a plain connection without pending data can be passed */
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if (c->buffered || c->read->ready) {
+        return NGX_DECLINED;
+    }
+
+    slot = want - 1;
+
+    if (slot == ngx_process_slot
+        || slot >= NGX_MAX_PROCESSES
+        || ngx_processes[slot].pid == -1
+        || ngx_processes[slot].channel[0] == -1)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!ngx_atomic_cmp_set(&node->want, want, 0)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_PASS_CONNECTION;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = c->fd;
+    ch.data = node;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive pass connection %p fd:%d to s:%i",
+                   c, c->fd, slot);
+
+    if (ngx_write_channel(ngx_processes[slot].channel[0], &ch,
+                          sizeof(ngx_channel_t), c->log)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    (void) ngx_atomic_fetch_add(&node->passed, 1);
+
+    ngx_http_upstream_keepalive_close(c);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_channel_handler(ngx_channel_t *ch)
+{
+    u_char                              *p;
+    ngx_uint_t                           i;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_list_part_t                     *part;
+    ngx_connection_t                    *c;
+    ngx_peer_connection_t                pc;
+    ngx_http_upstream_keepalive_node_t  *node;
+    ngx_http_upstream_keepalive_zone_t  *zone;
+
+    node = ch->data;
+    p = ch->data;
+
+    if (ngx_process != NGX_PROCESS_WORKER || ngx_exiting || ngx_terminate) {
+        goto failed;
+    }
+
+    /*
+     * the node is in a zone mapped at the same address in all workers,
+     * the zone tells which upstream of this cycle the connection is for
+     */
+
+    zone = NULL;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_upstream_keepalive_module) {
+            continue;
+        }
+
+        if (p >= shm_zone[i].shm.addr
+            && p < shm_zone[i].shm.addr + shm_zone[i].shm.size)
+        {
+            zone = shm_zone[i].data;
+            break;
+        }
+    }
+
+    if (zone == NULL) {
+        goto failed;
+    }
+
+    c = ngx_get_connection(ch->fd, ngx_cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->sendfile = 1;
+
+    if (node->addr.sockaddr.sockaddr.sa_family == AF_UNIX) {
+        c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+        c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+
+#if (NGX_SOLARIS)
+        c->sendfile = 0;
+#endif
+    }
+
+    c->log_error = NGX_ERROR_ERR;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    /* the connection was idle in the sending worker */
+
+    c->write->ready = 1;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.connection = c;
+    pc.sockaddr = &node->addr.sockaddr.sockaddr;
+    pc.socklen = node->addr.socklen;
+    pc.log = ngx_cycle->log;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "keepalive got connection %p fd:%d", c, c->fd);
+
+    ngx_http_upstream_keepalive_save(zone->conf, &pc, 0);
+
+    if (pc.connection) {
+        ngx_http_upstream_keepalive_close(c);
+    }
+
+    return;
+
+failed:
+
+    if (ngx_close_socket(ch->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_pass_connection_handler = ngx_http_upstream_keepalive_channel_handler;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -511,6 +1431,9 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->max_idle = 0;
+     *     conf->max_per_peer = 0;
+     *     conf->shm_zone = NULL;
      */
 
     conf->timeout = NGX_CONF_UNSET_MSEC;
@@ -524,10 +1447,14 @@ static char *
 ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_keepalive_zone_t      *zone;
     ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
 
+    u_char      *p;
+    ssize_t      size;
     ngx_int_t    n;
-    ngx_str_t   *value;
+    ngx_str_t   *value, name, s;
+    ngx_uint_t   i;
 
     if (kcf->max_cached) {
         return "is duplicate";
@@ -548,15 +1475,139 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     kcf->max_cached = n;
 
-    /* init upstream handler */
-
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
+    size = 0;
+    ngx_str_null(&name);
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_idle=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->max_idle = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_per_peer=", 13) == 0) {
+
+            n = ngx_atoi(value[i].data + 13, value[i].len - 13);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->max_per_peer = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (kcf->max_idle && name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"max_idle\" requires \"zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len) {
+        kcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_upstream_keepalive_module);
+        if (kcf->shm_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (kcf->shm_zone->data) {
+            zone = kcf->shm_zone->data;
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "keepalive zone \"%V\" is already used "
+                               "in upstream \"%V\"",
+                               &name, &zone->upstream);
+            return NGX_CONF_ERROR;
+        }
+
+        zone = ngx_pcalloc(cf->pool,
+                           sizeof(ngx_http_upstream_keepalive_zone_t));
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        zone->upstream = uscf->host;
+        zone->conf = kcf;
+
+        kcf->shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+        kcf->shm_zone->data = zone;
+    }
+
+    /* init upstream handler */
+
     kcf->original_init_upstream = uscf->peer.init_upstream
                                   ? uscf->peer.init_upstream
                                   : ngx_http_upstream_init_round_robin;
 
     uscf->peer.init_upstream = ngx_http_upstream_init_keepalive;
 
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_keepalive_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_keepalive_status_handler;
+
     return NGX_CONF_OK;
 }
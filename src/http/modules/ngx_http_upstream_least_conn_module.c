@@ -124,6 +124,10 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
+    if (ngx_http_upstream_rr_peers_changed(rrp)) {
+        goto busy;
+    }
+
     best = NULL;
     total = 0;
 
@@ -280,6 +284,8 @@ failed:
         ngx_http_upstream_rr_peers_wlock(peers);
     }
 
+busy:
+
     ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
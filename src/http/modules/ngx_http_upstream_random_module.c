@@ -9,6 +9,13 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_RANDOM_HEADER      1
+#define NGX_HTTP_UPSTREAM_RANDOM_LAST_BYTE   2
+
+/* the time after which old response times lose most of their weight */
+#define NGX_HTTP_UPSTREAM_RANDOM_DECAY       10000
+
+
 typedef struct {
     ngx_http_upstream_rr_peer_t          *peer;
     ngx_uint_t                            range;
@@ -17,6 +24,9 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                            two;
+    ngx_uint_t                            least_time;
+    ngx_uint_t                            peak;
+    ngx_uint_t                            config;
     ngx_http_upstream_random_range_t     *ranges;
 } ngx_http_upstream_random_srv_conf_t;
 
@@ -26,6 +36,7 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_request_t                   *request;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
@@ -44,6 +55,12 @@ static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
+static ngx_uint_t ngx_http_upstream_random_peer_slower(
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_rr_peer_t *prev);
+static ngx_uint_t ngx_http_upstream_random_response_time(
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
 static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -52,7 +69,7 @@ static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_random_commands[] = {
 
     { ngx_string("random"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE123,
       ngx_http_upstream_random,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -119,7 +136,7 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
     ngx_http_upstream_srv_conf_t *us)
 {
     size_t                                size;
-    ngx_uint_t                            i, total_weight;
+    ngx_uint_t                            i, n, total_weight;
     ngx_http_upstream_rr_peer_t          *peer;
     ngx_http_upstream_rr_peers_t         *peers;
     ngx_http_upstream_random_range_t     *ranges;
@@ -129,13 +146,18 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
 
     peers = us->peer.data;
 
-    size = peers->number * sizeof(ngx_http_upstream_random_range_t);
+    n = ngx_max(peers->number, 1);
+    size = n * sizeof(ngx_http_upstream_random_range_t);
 
     ranges = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
     if (ranges == NULL) {
         return NGX_ERROR;
     }
 
+    if (pool == NULL && rcf->ranges) {
+        ngx_free(rcf->ranges);
+    }
+
     total_weight = 0;
 
     for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
@@ -146,6 +168,10 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
 
     rcf->ranges = ranges;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    rcf->config = peers->config ? *peers->config : 0;
+#endif
+
     return NGX_OK;
 }
 
@@ -180,13 +206,20 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
         r->upstream->peer.get = ngx_http_upstream_get_random_peer;
     }
 
+    if (rcf->least_time) {
+        r->upstream->peer.free = ngx_http_upstream_free_random_peer;
+    }
+
     rp->conf = rcf;
+    rp->request = r;
     rp->tries = 0;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
+    if (rp->rrp.peers->shpool
+        && (rcf->ranges == NULL || rcf->config != rp->rrp.config))
+    {
         if (ngx_http_upstream_update_random(NULL, us) != NGX_OK) {
             ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
@@ -220,7 +253,9 @@ ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0
+        || ngx_http_upstream_rr_peers_changed(rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -314,7 +349,9 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0
+        || ngx_http_upstream_rr_peers_changed(rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -363,7 +400,10 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->least_time
+                ? ngx_http_upstream_random_peer_slower(peer, prev)
+                : peer->conns * prev->weight > prev->conns * peer->weight)
+            {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -429,6 +469,118 @@ ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
 }
 
 
+static ngx_uint_t
+ngx_http_upstream_random_peer_slower(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_rr_peer_t *prev)
+{
+    uint64_t  cost, prev_cost;
+
+    /*
+     * the expected wait is the response time multiplied
+     * by the number of requests already sent to the peer
+     */
+
+    cost = (uint64_t) (ngx_http_upstream_random_response_time(peer) + 1)
+           * (peer->conns + 1) * prev->weight;
+
+    prev_cost = (uint64_t) (ngx_http_upstream_random_response_time(prev) + 1)
+                * (prev->conns + 1) * peer->weight;
+
+    return cost > prev_cost;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_random_response_time(ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_msec_t  elapsed;
+
+    /* a peer not chosen for a while decays towards zero and gets retried */
+
+    elapsed = ngx_current_msec - peer->response_time_updated;
+
+    return (uint64_t) peer->response_time * NGX_HTTP_UPSTREAM_RANDOM_DECAY
+           / (NGX_HTTP_UPSTREAM_RANDOM_DECAY + elapsed);
+}
+
+
+static void
+ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    ngx_msec_t                    elapsed, ms;
+    ngx_uint_t                    sample;
+    ngx_http_upstream_t          *u;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    u = rp->request->upstream;
+    peer = rp->rrp.current;
+
+    if (state & NGX_PEER_FAILED || u->state == NULL) {
+        goto done;
+    }
+
+    if (rp->conf->least_time == NGX_HTTP_UPSTREAM_RANDOM_HEADER) {
+        ms = u->state->header_time;
+
+    } else {
+        ms = u->state->response_time;
+
+        /* not yet set if the next upstream is tried */
+
+        if (ms == (ngx_msec_t) -1) {
+            ms = ngx_current_msec - u->start_time;
+        }
+    }
+
+    if (ms == (ngx_msec_t) -1) {
+        goto done;
+    }
+
+    /* microseconds keep precision of averaged fast responses */
+
+    sample = ms * 1000;
+
+    ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
+    ngx_http_upstream_rr_peer_lock(rp->rrp.peers, peer);
+
+    elapsed = ngx_current_msec - peer->response_time_updated;
+
+    if (peer->response_time_updated == 0
+        || (rp->conf->peak && sample > peer->response_time))
+    {
+        peer->response_time = sample;
+
+    } else {
+
+        /*
+         * exponentially weighted moving average over time:
+         * the longer since the last sample, the more weight the new one has
+         */
+
+        peer->response_time = ((uint64_t) peer->response_time
+                               * NGX_HTTP_UPSTREAM_RANDOM_DECAY
+                               + (uint64_t) sample * (elapsed + 1))
+                              / (NGX_HTTP_UPSTREAM_RANDOM_DECAY + elapsed + 1);
+    }
+
+    peer->response_time_updated = ngx_current_msec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random peer %p, response time %Mms, average %uius",
+                   peer, ms, peer->response_time);
+
+    ngx_http_upstream_rr_peer_unlock(rp->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, data, state);
+}
+
+
 static void *
 ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
 {
@@ -443,6 +595,8 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->least_time = 0;
+     *     conf->peak = 0;
      */
 
     return conf;
@@ -492,11 +646,32 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        rcf->least_time = 0;
+
+    } else if (ngx_strcmp(value[2].data, "least_time=header") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_HEADER;
+
+    } else if (ngx_strcmp(value[2].data, "least_time=last_byte") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LAST_BYTE;
+
+    } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 3) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[3].data, "peak") != 0 || !rcf->least_time) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    rcf->peak = 1;
+
     return NGX_CONF_OK;
 }
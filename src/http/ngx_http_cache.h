@@ -29,6 +29,11 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_OPEN_BUCKETS  6
+
+#define NGX_HTTP_CACHE_PARTIAL_MIN_BLOCK   65536
+#define NGX_HTTP_CACHE_PARTIAL_MAX_BLOCKS  1048576
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +41,10 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_memory_s  ngx_http_file_cache_memory_t;
+typedef struct ngx_http_file_cache_snapshot_s  ngx_http_file_cache_snapshot_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +60,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         protected:1;
+    unsigned                         snapshot:1;
+                                     /* 8 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +70,19 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+
+    ngx_http_file_cache_memory_t    *memory;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_memory_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           len;
+    u_char                          *data;
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -85,6 +106,11 @@ struct ngx_http_cache_s {
     off_t                            length;
     off_t                            fs_size;
 
+    size_t                           partial_block;
+    off_t                            partial_start;
+    off_t                            partial_end;
+    off_t                            partial_length;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
@@ -97,6 +123,7 @@ struct ngx_http_cache_s {
 
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
+    ngx_thread_task_t               *open_task;
 #endif
 
     ngx_msec_t                       lock_timeout;
@@ -115,11 +142,18 @@ struct ngx_http_cache_s {
     unsigned                         temp_file:1;
     unsigned                         purged:1;
     unsigned                         reading:1;
+    unsigned                         opening:1;
     unsigned                         secondary:1;
     unsigned                         background:1;
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         memory:1;
+    unsigned                         memory_promote:1;
+
+    unsigned                         partial:1;
+    unsigned                         partial_fill:1;
 };
 
 
@@ -151,9 +185,29 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+
+    ngx_atomic_t                     memory_hits;
+    ngx_atomic_t                     disk_hits;
+
+    ngx_queue_t                      protected_queue;
+    ngx_uint_t                       protected;
+
+    ngx_atomic_t                     evicted_inactive;
+    ngx_atomic_t                     evicted_max_size;
+    ngx_atomic_t                     evicted_keys_zone;
+    ngx_atomic_t                     admission_rejected;
+
+    /* cache file open and header read latency, see ngx_http_file_cache_open */
+    ngx_atomic_t                     open_blocked[NGX_HTTP_CACHE_OPEN_BUCKETS];
+    ngx_atomic_t                     open_offloaded[NGX_HTTP_CACHE_OPEN_BUCKETS];
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_queue_t                      queue;
+} ngx_http_file_cache_memory_sh_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -177,6 +231,22 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    time_t                           snapshot;
+    time_t                           snapshot_next;
+    time_t                           snapshot_time;
+    ngx_str_t                        snapshot_name;
+    ngx_http_file_cache_snapshot_t  *snapshot_ctx;
+    u_char                          *snapshot_dirs;
+
+    size_t                           memory;
+    size_t                           memory_max_object;
+    ngx_uint_t                       memory_min_uses;
+    ngx_http_file_cache_memory_sh_t *memory_sh;
+    ngx_slab_pool_t                 *memory_shpool;
+
+    ngx_uint_t                       eviction;
+    ngx_uint_t                       admission;
+
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
@@ -192,6 +262,8 @@ ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
+void ngx_http_file_cache_partial_range(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_partial_header(ngx_http_request_t *r);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
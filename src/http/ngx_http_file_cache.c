@@ -11,6 +11,110 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_CACHE_SNAPSHOT_VERSION  1
+#define NGX_HTTP_CACHE_SNAPSHOT_BLOCK    1024
+
+#define NGX_HTTP_CACHE_EVICTION_LRU      0
+#define NGX_HTTP_CACHE_EVICTION_SLRU     1
+#define NGX_HTTP_CACHE_EVICTION_GDSF     2
+
+#define NGX_HTTP_CACHE_GDSF_SAMPLE       8
+
+
+typedef struct {
+    u_char                           magic[8];
+    uint32_t                         version;
+    uint32_t                         entry_size;
+    uint64_t                         time;
+    uint64_t                         bsize;
+} ngx_http_file_cache_snapshot_header_t;
+
+
+typedef struct {
+    uint32_t                         count;
+    uint32_t                         crc32;
+} ngx_http_file_cache_snapshot_block_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    uint64_t                         uniq;
+    uint64_t                         fs_size;
+    int64_t                          valid_sec;
+    uint32_t                         body_start;
+    uint16_t                         uses;
+    uint16_t                         valid_msec;
+} ngx_http_file_cache_snapshot_entry_t;
+
+
+struct ngx_http_file_cache_snapshot_s {
+    ngx_fd_t                                fd;
+    u_char                                 *temp;
+    ngx_uint_t                              total;
+    ngx_http_file_cache_snapshot_block_t   *block;
+    u_char                                  key[NGX_HTTP_CACHE_KEY_LEN];
+};
+
+
+/*
+ * a partial cache file keeps the body at its natural offsets, so missing
+ * blocks are holes; the body is followed by a byte per block, non-zero
+ * if the block is present, and by the trailer
+ */
+
+typedef struct {
+    u_char                           magic[8];
+    uint64_t                         length;
+    uint64_t                         block;
+} ngx_http_file_cache_partial_t;
+
+
+typedef struct {
+    ngx_http_request_t              *request;
+    ngx_temp_file_t                 *temp_file;
+
+    ngx_file_t                       src;
+    ngx_file_t                       dst;
+
+    off_t                            header;
+    off_t                            src_offset;
+    off_t                            dst_offset;
+    off_t                            size;
+
+    u_char                          *map;
+    size_t                           map_len;
+    off_t                            map_offset;
+
+    u_char                          *buf;
+    size_t                           buf_size;
+
+    ngx_file_info_t                  fi;
+    ngx_int_t                        rc;
+
+    unsigned                         fill:1;
+} ngx_http_file_cache_partial_ctx_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    u_char                          *name;
+    ngx_fd_t                         fd;
+    ngx_file_info_t                  fi;
+    u_char                          *buf;
+    size_t                           size;
+    size_t                           max;
+    size_t                           read_ahead;
+    ssize_t                          nbytes;
+    ngx_err_t                        err;
+    char                            *failed;
+    uint64_t                         start;
+    uint64_t                         end;
+} ngx_http_file_cache_open_ctx_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -18,18 +122,41 @@ static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_validate(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ssize_t n);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_thread_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_open_handler(void *data, ngx_log_t *log);
+static ngx_int_t ngx_http_file_cache_opened(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+#endif
+static uint64_t ngx_http_file_cache_usec(void);
+static void ngx_http_file_cache_latency(ngx_atomic_t *buckets,
+    uint64_t start, uint64_t end);
+static ngx_int_t ngx_http_file_cache_memory_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_add(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_http_file_cache_memory_t *ngx_http_file_cache_memory_get(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
 static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #endif
 #if (NGX_THREADS)
+static ngx_thread_pool_t *ngx_http_cache_thread_pool(ngx_http_request_t *r);
 static ngx_int_t ngx_http_cache_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
 static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_update_node(ngx_http_request_t *r,
+    ngx_file_t *file, ngx_int_t rc, ngx_file_info_t *fi);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
@@ -45,6 +172,10 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static void ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_oldest(ngx_http_file_cache_t *cache);
+static ngx_queue_t *ngx_http_file_cache_victim(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
@@ -63,6 +194,40 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_write_snapshot(
+    ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_snapshot_next(
+    ngx_http_file_cache_t *cache, u_char *key);
+static time_t ngx_http_file_cache_load_snapshot(ngx_http_file_cache_t *cache);
+static ngx_uint_t ngx_http_file_cache_snapshot_levels(
+    ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_snapshot_walked(ngx_http_file_cache_t *cache,
+    ngx_str_t *path);
+static ngx_uint_t ngx_http_file_cache_snapshot_dir(
+    ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_reconcile_snapshot(
+    ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_read(ngx_fd_t fd, void *buf,
+    size_t size);
+static ngx_int_t ngx_http_file_cache_partial_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_partial_client_range(ngx_http_request_t *r,
+    off_t length, off_t *start, off_t *end);
+static ngx_int_t ngx_http_file_cache_partial_content_range(ngx_table_elt_t *h,
+    off_t *start, off_t *end, off_t *length);
+static void ngx_http_file_cache_partial_store(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+static ngx_int_t ngx_http_file_cache_partial_fill(ngx_http_request_t *r,
+    ngx_http_file_cache_partial_ctx_t *ctx);
+static void ngx_http_file_cache_partial_write(void *data, ngx_log_t *log);
+static void ngx_http_file_cache_partial_stored(
+    ngx_http_file_cache_partial_ctx_t *ctx);
+#if (NGX_THREADS)
+static void ngx_http_file_cache_partial_thread_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_file_cache_partial_copy(ngx_file_t *src,
+    off_t src_offset, ngx_file_t *dst, off_t dst_offset, off_t size,
+    u_char *buf, size_t len);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -152,6 +317,22 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
+    cache->sh->memory_hits = 0;
+    cache->sh->disk_hits = 0;
+
+    ngx_queue_init(&cache->sh->protected_queue);
+    cache->sh->protected = 0;
+
+    cache->sh->evicted_inactive = 0;
+    cache->sh->evicted_max_size = 0;
+    cache->sh->evicted_keys_zone = 0;
+    cache->sh->admission_rejected = 0;
+
+    for (n = 0; n < NGX_HTTP_CACHE_OPEN_BUCKETS; n++) {
+        cache->sh->open_blocked[n] = 0;
+        cache->sh->open_offloaded[n] = 0;
+    }
+
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
@@ -172,6 +353,64 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    /*
+     * copies may still refer to nodes of a keys zone that was not reused,
+     * see ngx_http_file_cache_memory_get() and ngx_http_file_cache_memory_add()
+     */
+
+    if (ocache) {
+        cache->memory_sh = ocache->memory_sh;
+        cache->memory_shpool = ocache->memory_shpool;
+
+        return NGX_OK;
+    }
+
+    cache->memory_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->memory_sh = cache->memory_shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->memory_sh = ngx_slab_alloc(cache->memory_shpool,
+                                      sizeof(ngx_http_file_cache_memory_sh_t));
+    if (cache->memory_sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->memory_shpool->data = cache->memory_sh;
+
+    ngx_queue_init(&cache->memory_sh->queue);
+
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->memory_shpool->log_ctx = ngx_slab_alloc(cache->memory_shpool, len);
+    if (cache->memory_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->memory_shpool->log_ctx,
+                " in cache memory zone \"%V\"%Z", &shm_zone->shm.name);
+
+    /* allocation failures are handled by demoting objects */
+
+    cache->memory_shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -254,6 +493,11 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
     c->header_start = sizeof(ngx_http_file_cache_header_t)
                       + sizeof(ngx_http_file_cache_key) + len + 1;
 
+    if (c->partial) {
+        /* partial entries have their own file format */
+        ngx_md5_update(&md5, "partial", sizeof("partial") - 1);
+    }
+
     ngx_crc32_final(c->crc32);
     ngx_md5_final(c->key, &md5);
 
@@ -264,6 +508,8 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
+    uint64_t                   start;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -282,6 +528,14 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return ngx_http_file_cache_read(r, c);
     }
 
+#if (NGX_THREADS)
+
+    if (c->opening) {
+        return ngx_http_file_cache_opened(r, c);
+    }
+
+#endif
+
     cache = c->file_cache;
 
     if (c->node == NULL) {
@@ -335,6 +589,17 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
+    if (rv == NGX_DECLINED
+        && !c->exists
+        && cache->admission < 10000
+        && (ngx_uint_t) (ngx_random() % 10000) >= cache->admission)
+    {
+        (void) ngx_atomic_fetch_add(&cache->sh->admission_rejected, 1);
+
+        c->temp_file = 0;
+        rv = NGX_HTTP_CACHE_SCARCE;
+    }
+
     if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
         return NGX_ERROR;
     }
@@ -343,8 +608,29 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (cache->memory && c->exists && !c->partial) {
+        rc = ngx_http_file_cache_memory_read(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS
+        && clcf->aio_open
+        && clcf->open_file_cache == NULL)
+    {
+        return ngx_http_file_cache_thread_open(r, c);
+    }
+
+#endif
+
+    start = ngx_http_file_cache_usec();
+
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
 
     of.uniq = c->uniq;
@@ -382,12 +668,33 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    size = c->body_start;
+
+    /* read small files used often enough at once to place them in memory */
+
+    if (cache->memory
+        && !c->partial
+        && c->length > (off_t) size
+        && c->length <= (off_t) cache->memory_max_object
+        && c->memory_promote)
+    {
+        size = (size_t) c->length;
+        c->body_start = size;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
 
-    return ngx_http_file_cache_read(r, c);
+    rc = ngx_http_file_cache_read(r, c);
+
+    /* the time the worker was blocked, an asynchronous read is not counted */
+
+    ngx_http_file_cache_latency(cache->sh->open_blocked, start,
+                                ngx_http_file_cache_usec());
+
+    return rc;
 
 done:
 
@@ -524,22 +831,31 @@ wakeup:
 
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ssize_t  n;
+
+    n = ngx_http_file_cache_aio_read(r, c);
+
+    if (n < 0) {
+        return n;
+    }
+
+    return ngx_http_file_cache_validate(r, c, n);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_validate(ngx_http_request_t *r, ngx_http_cache_t *c,
+    ssize_t n)
 {
     u_char                        *p;
     time_t                         now;
-    ssize_t                        n;
     ngx_str_t                     *key;
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
-
-    if (n < 0) {
-        return n;
-    }
-
     if ((size_t) n < c->header_start) {
         ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
                       "cache file \"%s\" is too small", c->file.name.data);
@@ -634,6 +950,18 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     now = ngx_time();
 
+    if (c->partial) {
+        rc = ngx_http_file_cache_partial_read(r, c);
+
+        if (rc != NGX_OK) {
+            if (c->valid_sec < now) {
+                c->partial_fill = 0;
+            }
+
+            return rc;
+        }
+    }
+
     if (c->valid_sec < now) {
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
@@ -659,1617 +987,4001 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
-    return NGX_OK;
-}
+    if (c->memory) {
+        (void) ngx_atomic_fetch_add(&cache->sh->memory_hits, 1);
 
+    } else {
+        (void) ngx_atomic_fetch_add(&cache->sh->disk_hits, 1);
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+        if (cache->memory
+            && !c->partial
+            && n == c->length
+            && c->length <= (off_t) cache->memory_max_object)
+        {
+            ngx_http_file_cache_memory_add(cache, c);
+        }
+    }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+    return NGX_OK;
+}
 
-#if (NGX_HAVE_FILE_AIO)
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+#if (NGX_THREADS)
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
+static ngx_int_t
+ngx_http_file_cache_thread_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                           size, max;
+    ngx_thread_task_t               *task;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_file_cache_open_ctx_t  *ctx;
+
+    task = c->open_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_file_cache_open_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
         }
 
-        c->reading = 1;
+        c->open_task = task;
+    }
 
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+    cache = c->file_cache;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-        r->main->blocked++;
-        r->aio = 1;
+    /*
+     * the file size is not known yet, so the buffer is made large enough
+     * to read small files at once, as ngx_http_file_cache_open() does
+     */
 
-        return NGX_AGAIN;
+    size = c->body_start;
+    max = 0;
+
+    if (cache->memory && !c->partial && c->memory_promote) {
+        max = cache->memory_max_object;
     }
 
-#endif
+    c->buf = ngx_create_temp_buf(r->pool, ngx_max(size, max));
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
 
-#if (NGX_THREADS)
+    ctx = task->ctx;
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
-        c->file.thread_task = c->thread_task;
-        c->file.thread_handler = ngx_http_cache_thread_handler;
-        c->file.thread_ctx = r;
+    ctx->name = c->file.name.data;
+    ctx->fd = NGX_INVALID_FILE;
+    ctx->buf = c->buf->pos;
+    ctx->size = size;
+    ctx->max = max;
+    ctx->read_ahead = clcf->read_ahead;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    task->handler = ngx_http_file_cache_open_handler;
 
-        c->thread_task = c->file.thread_task;
-        c->reading = (n == NGX_AGAIN);
+    c->file.thread_ctx = r;
 
-        return n;
+    if (ngx_http_cache_thread_handler(task, &c->file) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-#endif
+    c->opening = 1;
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return NGX_AGAIN;
 }
 
 
-#if (NGX_HAVE_FILE_AIO)
-
 static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+ngx_http_file_cache_open_handler(void *data, ngx_log_t *log)
 {
-    ngx_event_aio_t     *aio;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    ngx_http_file_cache_open_ctx_t *ctx = data;
 
-    aio = ev->data;
-    r = aio->data;
-    c = r->connection;
+    off_t       size;
+    ngx_file_t  file;
 
-    ngx_http_set_log_request(c->log, r);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http file cache open handler: \"%s\"", ctx->name);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+    ctx->start = ngx_http_file_cache_usec();
 
-    r->main->blocked--;
-    r->aio = 0;
+    ctx->nbytes = 0;
+    ctx->err = 0;
 
-    r->write_event_handler(r);
+    ctx->fd = ngx_open_file(ctx->name, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                            NGX_FILE_OPEN, 0);
 
-    ngx_http_run_posted_requests(c);
-}
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_open_file_n;
+        goto done;
+    }
 
-#endif
+    if (ngx_fd_info(ctx->fd, &ctx->fi) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_fd_info_n;
+        goto done;
+    }
+
+    if (ngx_is_dir(&ctx->fi)) {
+        ctx->err = NGX_EISDIR;
+        ctx->failed = ngx_open_file_n;
+        goto done;
+    }
+
+    if (ctx->read_ahead) {
+        (void) ngx_read_ahead(ctx->fd, ctx->read_ahead);
+    }
 
+    size = ngx_file_size(&ctx->fi);
+
+    if (size > (off_t) ctx->size && size <= (off_t) ctx->max) {
+        ctx->size = (size_t) size;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = ctx->fd;
+    file.name.len = ngx_strlen(ctx->name);
+    file.name.data = ctx->name;
+    file.log = log;
+
+    ctx->nbytes = ngx_read_file(&file, ctx->buf, ctx->size, 0);
+
+done:
+
+    ctx->end = ngx_http_file_cache_usec();
+}
 
-#if (NGX_THREADS)
 
 static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+ngx_http_file_cache_opened(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_str_t                  name;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_pool_cleanup_t              *cln;
+    ngx_pool_cleanup_file_t         *clnf;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_open_ctx_t  *ctx;
 
-    r = file->thread_ctx;
+    c->opening = 0;
+    c->open_task->event.complete = 0;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+    ctx = c->open_task->ctx;
+    cache = c->file_cache;
+
+    if (ctx->fd != NGX_INVALID_FILE) {
+        cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+        if (cln == NULL) {
+            if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", ctx->name);
+            }
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
-        {
             return NGX_ERROR;
         }
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+        cln->handler = ngx_pool_cleanup_file;
+        clnf = cln->data;
 
-        if (tp == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
-        }
-    }
+        clnf->fd = ctx->fd;
+        clnf->name = ctx->name;
+        clnf->log = r->pool->log;
 
-    task->event.data = r;
-    task->event.handler = ngx_http_cache_thread_event_handler;
-
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
-        return NGX_ERROR;
+        ngx_http_file_cache_latency(cache->sh->open_offloaded, ctx->start,
+                                    ctx->end);
     }
 
-    r->main->blocked++;
-    r->aio = 1;
+    if (ctx->err) {
 
-    return NGX_OK;
-}
+        if (ctx->err == NGX_ENOENT || ctx->err == NGX_ENOTDIR) {
 
+            /* see the "done" label in ngx_http_file_cache_open() */
 
-static void
-ngx_http_cache_thread_event_handler(ngx_event_t *ev)
-{
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+            if (c->temp_file) {
+                return ngx_http_file_cache_lock(r, c);
+            }
 
-    r = ev->data;
-    c = r->connection;
+            return NGX_HTTP_CACHE_SCARCE;
+        }
 
-    ngx_http_set_log_request(c->log, r);
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ctx->err,
+                      "%s \"%s\" failed", ctx->failed, ctx->name);
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
+    if (ctx->nbytes == NGX_ERROR) {
+        return NGX_ERROR;
+    }
 
-    r->main->blocked--;
-    r->aio = 0;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fd: %d", ctx->fd);
 
-    r->write_event_handler(r);
+    c->file.fd = ctx->fd;
+    c->file.log = r->connection->log;
+    c->uniq = ngx_file_uniq(&ctx->fi);
+    c->length = ngx_file_size(&ctx->fi);
+    c->fs_size = (ngx_file_fs_size(&ctx->fi) + cache->bsize - 1)
+                 / cache->bsize;
+    c->body_start = ctx->size;
 
-    ngx_http_run_posted_requests(c);
+    return ngx_http_file_cache_validate(r, c, ctx->nbytes);
 }
 
 #endif
 
 
-static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static uint64_t
+ngx_http_file_cache_usec(void)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    struct timeval  tv;
 
-    fcn = c->node;
+    ngx_gettimeofday(&tv);
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
-    }
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
 
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
-        }
+static void
+ngx_http_file_cache_latency(ngx_atomic_t *buckets, uint64_t start,
+    uint64_t end)
+{
+    uint64_t    usec, bound;
+    ngx_uint_t  i;
 
-        if (fcn->error) {
+    usec = (end > start) ? end - start : 0;
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+    /* 100us, 1ms, 10ms, 100ms, 1s, and the rest */
 
-            rc = NGX_OK;
+    bound = 100;
 
-            goto done;
+    for (i = 0; i < NGX_HTTP_CACHE_OPEN_BUCKETS - 1; i++) {
+        if (usec < bound) {
+            break;
         }
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
-
-            c->exists = fcn->exists;
-            if (fcn->body_start) {
-                c->body_start = fcn->body_start;
-            }
+        bound *= 10;
+    }
 
-            rc = NGX_OK;
+    (void) ngx_atomic_fetch_add(&buckets[i], 1);
+}
 
-            goto done;
-        }
 
-        rc = NGX_AGAIN;
+static ngx_int_t
+ngx_http_file_cache_memory_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                         len;
+    ngx_int_t                      rc;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_memory_t  *mem;
 
-        goto done;
-    }
+    cache = c->file_cache;
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    mem = ngx_http_file_cache_memory_get(cache, c->node);
+    len = mem ? mem->len : 0;
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    if (len == 0) {
+        return NGX_DECLINED;
+    }
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
-        }
+    c->buf = ngx_create_temp_buf(r->pool, ngx_max(len, c->body_start));
+    if (c->buf == NULL) {
+        return NGX_ERROR;
     }
 
-    cache->sh->count++;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    mem = ngx_http_file_cache_memory_get(cache, c->node);
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (mem == NULL || mem->len != len) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
 
-    fcn->uses = 1;
-    fcn->count = 1;
+    ngx_memcpy(c->buf->pos, mem->data, len);
 
-renew:
+    ngx_queue_remove(&mem->queue);
+    ngx_queue_insert_head(&cache->memory_sh->queue, &mem->queue);
 
-    rc = NGX_DECLINED;
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    c->uniq = c->node->uniq;
+    c->fs_size = c->node->fs_size;
 
-done:
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    fcn->expire = ngx_time() + cache->inactive;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory: %uz", len);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    c->memory = 1;
+    c->length = len;
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+    rc = ngx_http_file_cache_read(r, c);
 
-failed:
+    if (rc == NGX_DECLINED) {
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        /* the file is opened and validated again */
+
+        c->memory = 0;
+    }
 
     return rc;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+static void
+ngx_http_file_cache_memory_add(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
-
-    c = r->cache;
-
-    if (c->file.name.len) {
-        return NGX_OK;
-    }
+    size_t                         size;
+    ngx_queue_t                   *q;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_memory_t  *mem;
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    size = sizeof(ngx_http_file_cache_memory_t) + (size_t) c->length;
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
+    if (size > cache->memory) {
+        return;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
-
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+    fcn = c->node;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    if (ngx_http_file_cache_memory_get(cache, fcn)
+        || fcn->uses < cache->memory_min_uses
+        || fcn->updating
+        || (fcn->uniq && fcn->uniq != c->uniq))
+    {
+        goto done;
+    }
 
-    return NGX_OK;
-}
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
 
+    for ( ;; ) {
+        mem = ngx_slab_alloc_locked(cache->memory_shpool, size);
+        if (mem) {
+            break;
+        }
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
-{
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+        if (ngx_queue_empty(&cache->memory_sh->queue)) {
+            ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+            goto done;
+        }
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+        /* demote the least recently used object to disk only */
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+        q = ngx_queue_last(&cache->memory_sh->queue);
+        mem = ngx_queue_data(q, ngx_http_file_cache_memory_t, queue);
 
-    while (node != sentinel) {
+        /* the node is not touched if it is not in the current keys zone */
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
+        if ((u_char *) mem->node >= (u_char *) cache->shpool
+            && (u_char *) (mem->node + 1) <= cache->shpool->end
+            && mem->node->memory == mem)
+        {
+            mem->node->memory = NULL;
         }
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
+        ngx_queue_remove(q);
+        ngx_slab_free_locked(cache->memory_shpool, mem);
+    }
 
-        /* node_key == node->key */
+    mem->node = fcn;
+    mem->len = (size_t) c->length;
+    mem->data = (u_char *) &mem[1];
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    ngx_memcpy(mem->data, c->buf->pos, mem->len);
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    ngx_queue_insert_head(&cache->memory_sh->queue, &mem->queue);
 
-        if (rc == 0) {
-            return fcn;
-        }
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
 
-        node = (rc < 0) ? node->left : node->right;
-    }
+    fcn->memory = mem;
 
-    /* not found */
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache memory add: %uz", mem->len);
 
-    return NULL;
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 }
 
 
 static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
-
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
-
-            p = &temp->left;
-
-        } else if (node->key > temp->key) {
+    ngx_http_file_cache_memory_t  *mem;
 
-            p = &temp->right;
+    /* the keys zone mutex must be held */
 
-        } else { /* node->key == temp->key */
+    mem = ngx_http_file_cache_memory_get(cache, fcn);
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    if (mem == NULL) {
+        return;
+    }
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
 
-        if (*p == sentinel) {
-            break;
-        }
+    ngx_queue_remove(&mem->queue);
+    ngx_slab_free_locked(cache->memory_shpool, mem);
 
-        temp = *p;
-    }
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    fcn->memory = NULL;
 }
 
 
-static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+static ngx_http_file_cache_memory_t *
+ngx_http_file_cache_memory_get(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    ngx_slab_pool_t               *pool;
+    ngx_http_file_cache_memory_t  *mem;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    /* the keys zone mutex must be held */
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    mem = fcn->memory;
 
-    ngx_strlow(buf, vary, len);
+    if (mem == NULL) {
+        return NULL;
+    }
 
-    p = buf;
-    last = buf + len;
+    /*
+     * the keys zone may be reused on reload while the memory zone
+     * is recreated or removed, so the copy is checked to be in
+     * the current memory zone and to belong to the node
+     */
 
-    while (p < last) {
+    pool = cache->memory_shpool;
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
-
-        name.data = p;
+    if (pool == NULL
+        || (u_char *) mem < (u_char *) pool
+        || (u_char *) (mem + 1) > pool->end
+        || mem->node != fcn)
+    {
+        fcn->memory = NULL;
+        return NULL;
+    }
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    return mem;
+}
 
-        name.len = p - name.data;
 
-        if (name.len == 0) {
-            break;
-        }
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
+#endif
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+    if (c->memory) {
+        return (ssize_t) c->length;
+    }
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+#if (NGX_HAVE_FILE_AIO)
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
-    }
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
 
-    ngx_md5_final(hash, &md5);
-}
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
+        }
 
+        c->reading = 1;
 
-static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
-{
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
 
-    multiple = 0;
-    normalize = 0;
+        r->main->blocked++;
+        r->aio = 1;
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+        return NGX_AGAIN;
+    }
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+#endif
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
-    }
+#if (NGX_THREADS)
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_task = c->thread_task;
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
 
-    for (i = 0; /* void */ ; i++) {
+        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+        c->thread_task = c->file.thread_task;
+        c->reading = (n == NGX_AGAIN);
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+        return n;
+    }
 
-        if (header[i].hash == 0) {
-            continue;
-        }
+#endif
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+}
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
-        }
 
-        if (!normalize) {
+#if (NGX_HAVE_FILE_AIO)
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+static void
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
 
-            multiple = 1;
+    ngx_http_set_log_request(c->log, r);
 
-            continue;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
 
-        /* normalize spaces */
+    r->main->blocked--;
+    r->aio = 0;
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+    r->write_event_handler(r);
 
-        while (p < last) {
+    ngx_http_run_posted_requests(c);
+}
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+#endif
 
-            start = p;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+#if (NGX_THREADS)
 
-            len = p - start;
+static ngx_thread_pool_t *
+ngx_http_cache_thread_pool(ngx_http_request_t *r)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_core_loc_conf_t  *clcf;
 
-            if (len == 0) {
-                break;
-            }
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NULL;
+        }
 
-            ngx_md5_update(md5, start, len);
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
 
-            multiple = 1;
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NULL;
         }
     }
+
+    return tp;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
 {
-    ngx_http_file_cache_t  *cache;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
-
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_thread_pool_t   *tp;
+    ngx_http_request_t  *r;
 
-    cache = c->file_cache;
+    r = file->thread_ctx;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    tp = ngx_http_cache_thread_pool(r);
 
-    c->node->count--;
-    c->node = NULL;
+    if (tp == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    r->main->blocked++;
+    r->aio = 1;
 
-    return ngx_http_file_cache_open(r);
+    return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static void
+ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
-
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+    r = ev->data;
+    c = r->connection;
 
-    c = r->cache;
+    ngx_http_set_log_request(c->log, r);
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->updating_sec = c->updating_sec;
-    h->error_sec = c->error_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    r->main->blocked--;
+    r->aio = 0;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
-    }
+    r->write_event_handler(r);
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+    ngx_http_run_posted_requests(c);
+}
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+#endif
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
-    }
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                    rc;
+    ngx_http_file_cache_node_t  *fcn;
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+    fcn = c->node;
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
     }
 
-    *p = LF;
+    if (fcn) {
+        ngx_queue_remove(&fcn->queue);
 
-    return NGX_OK;
-}
+        if (c->node == NULL) {
+            if (fcn->uses < 1023) {
+                fcn->uses++;
+            }
 
+            fcn->count++;
+        }
 
-static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_t  *cache;
+        if (fcn->error) {
 
-    if (!c->secondary) {
-        return NGX_OK;
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->exists || fcn->uses >= c->min_uses) {
+
+            c->exists = fcn->exists;
+            if (fcn->body_start) {
+                c->body_start = fcn->body_start;
+            }
+
+            c->memory_promote = (fcn->uses >= cache->memory_min_uses);
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
     }
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
-        return NGX_OK;
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
+        }
     }
 
-    /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
-     */
+    cache->sh->count++;
 
-    cache = c->file_cache;
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
+    fcn->uses = 1;
+    fcn->count = 1;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+renew:
 
-    c->file.name.len = 0;
+    rc = NGX_DECLINED;
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_http_file_cache_memory_free(cache, fcn);
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
-    }
+done:
 
-    return NGX_OK;
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_queue(cache, fcn);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    u_char            *p;
+    ngx_http_cache_t  *c;
 
     c = r->cache;
 
-    if (c->updated) {
-        return;
+    if (c->file.name.len) {
+        return NGX_OK;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-    cache = c->file_cache;
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
 
-    c->updated = 1;
-    c->updating = 0;
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
 
-    uniq = 0;
-    fs_size = 0;
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    return NGX_OK;
+}
 
-    if (rc == NGX_OK) {
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
 
-            rc = NGX_ERROR;
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
         }
-    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        /* node_key == node->key */
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
     }
 
-    c->node->updating = 0;
+    /* not found */
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NULL;
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    for ( ;; ) {
 
-    c = r->cache;
+        if (node->key < temp->key) {
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+            p = &temp->left;
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+        } else if (node->key > temp->key) {
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+            p = &temp->right;
 
-        /* cache file may have been deleted */
+        } else { /* node->key == temp->key */
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 1;
+    c->memory = 0;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->updating = 0;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->partial) {
+        ngx_http_file_cache_partial_store(r, tf);
+        return;
+    }
+
+    ngx_http_file_cache_update_node(r, &tf->file, NGX_OK, NULL);
+}
+
+
+/*
+ * rc is NGX_OK if the file is to be renamed to the cache file,
+ * NGX_DONE if the cache file itself was updated and fi describes it,
+ * NGX_DECLINED if the cache file is left as is, and NGX_ERROR otherwise
+ */
+
+static void
+ngx_http_file_cache_update_node(ngx_http_request_t *r, ngx_file_t *file,
+    ngx_int_t rc, ngx_file_info_t *fi)
+{
+    off_t                   fs_size;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         info;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (rc == NGX_DECLINED) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        c->node->count--;
+
+        if (c->updating) {
+            c->node->updating = 0;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        c->updating = 0;
+
+        return;
+    }
+
+    uniq = 0;
+    fs_size = 0;
+
+    if (rc == NGX_OK) {
+        fi = &info;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache rename: \"%s\" to \"%s\"",
+                       file->name.data, c->file.name.data);
+
+        ext.access = NGX_FILE_OWNER_ACCESS;
+        ext.path_access = NGX_FILE_OWNER_ACCESS;
+        ext.time = -1;
+        ext.create_path = 1;
+        ext.delete_file = 1;
+        ext.log = r->connection->log;
+
+        rc = ngx_ext_rename_file(&file->name, &c->file.name, &ext);
+
+        if (rc == NGX_OK && ngx_fd_info(file->fd, fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", file->name.data);
+
+            rc = NGX_ERROR;
+        }
+    }
+
+    if (rc == NGX_OK || rc == NGX_DONE) {
+        uniq = ngx_file_uniq(fi);
+        fs_size = (ngx_file_fs_size(fi) + cache->bsize - 1) / cache->bsize;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_memory_free(cache, c->node);
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->snapshot = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    cache->sh->size += fs_size - c->node->fs_size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+    }
+
+    c->node->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
                       ngx_open_file_n " \"%s\" failed", file.name.data);
         return;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), 0);
+
+    cache = c->file_cache;
+
+    if (cache->memory) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_memory_free(cache, c->node);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->memory) {
+        b->start = c->buf->start;
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+        b->end = b->last;
+
+        b->memory = (c->length - c->body_start) ? 1 : 0;
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1: 0;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_partial_range(ngx_http_request_t *r)
+{
+    off_t              start, end, length;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    length = c->partial_fill ? c->partial_length : -1;
+
+    ngx_http_file_cache_partial_client_range(r, length, &start, &end);
+
+    c->partial_start = start - start % (off_t) c->partial_block;
+
+    if (end == -1) {
+        c->partial_end = -1;
+
+    } else {
+        c->partial_end = end + (off_t) c->partial_block - 1;
+        c->partial_end -= c->partial_end % (off_t) c->partial_block;
+
+        if (length != -1 && c->partial_end > length) {
+            c->partial_end = length;
+        }
+    }
+
+    if (c->partial_end != -1 && c->partial_end <= c->partial_start) {
+        c->partial_start = 0;
+        c->partial_end = -1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial range: %O-%O",
+                   c->partial_start, c->partial_end);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_partial_header(ngx_http_request_t *r)
+{
+    off_t              start, end, length, block;
+    ngx_int_t          rc;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    block = (off_t) c->partial_block;
+
+    if (r->headers_out.status == NGX_HTTP_OK) {
+
+        if (!r->cached) {
+            length = r->headers_out.content_length_n;
+
+            if (length == -1
+                || (length + block - 1) / block
+                   > NGX_HTTP_CACHE_PARTIAL_MAX_BLOCKS)
+            {
+                return NGX_DECLINED;
+            }
+
+            c->partial_start = 0;
+            c->partial_end = r->headers_out.content_length_n;
+            c->partial_length = c->partial_end;
+        }
+
+        r->allow_ranges = 1;
+
+        return NGX_OK;
+    }
+
+    if (r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_file_cache_partial_content_range(r->headers_out.content_range,
+                                                  &start, &end, &length)
+        != NGX_OK
+        || length == -1
+        || end > length)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "invalid range in partial cache response");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_OK;
+
+    if (r->cached) {
+
+        /* the cache file holds the body at its natural offsets */
+
+        start = 0;
+        length = c->partial_length;
+
+    } else {
+
+        if (start > c->partial_start
+            || end < (c->partial_end == -1 ? length
+                                           : ngx_min(c->partial_end, length)))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "unexpected range in partial cache response: "
+                          "%O-%O", start, end);
+            return NGX_ERROR;
+        }
+
+        c->partial_start = start;
+        c->partial_end = end;
+        c->partial_length = length;
+
+        /* the block map of too large objects is not worth keeping */
+
+        if ((length + block - 1) / block > NGX_HTTP_CACHE_PARTIAL_MAX_BLOCKS) {
+            rc = NGX_DONE;
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = length;
+    r->headers_out.content_offset = start;
+    r->headers_out.content_range->hash = 0;
+    r->headers_out.content_range = NULL;
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                         *p;
+    off_t                           start, end, offset, block, first, last;
+    size_t                          size;
+    ssize_t                         n;
+    u_char                          map[1024];
+    ngx_http_file_cache_partial_t   pt;
+
+    block = (off_t) c->partial_block;
+
+    if (c->length < (off_t) (c->body_start + sizeof(pt))) {
+        goto invalid;
+    }
+
+    n = ngx_read_file(&c->file, (u_char *) &pt, sizeof(pt),
+                      c->length - sizeof(pt));
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if ((size_t) n != sizeof(pt)
+        || ngx_memcmp(pt.magic, "NGXPART1", 8) != 0
+        || pt.block != (uint64_t) block
+        || pt.length > (uint64_t) c->length)
+    {
+        goto invalid;
+    }
+
+    c->partial_length = (off_t) pt.length;
+
+    if (c->length != (off_t) (c->body_start + sizeof(pt))
+                     + c->partial_length + (c->partial_length + block - 1)
+                                           / block)
+    {
+        goto invalid;
+    }
+
+    ngx_http_file_cache_partial_client_range(r, c->partial_length,
+                                             &start, &end);
+
+    first = start / block;
+    last = (end > start) ? (end + block - 1) / block : first;
+
+    offset = c->body_start + c->partial_length + first;
+
+    while (first < last) {
+        size = (size_t) ngx_min(last - first, (off_t) sizeof(map));
+
+        n = ngx_read_file(&c->file, map, size, offset);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if ((size_t) n != size) {
+            goto invalid;
+        }
+
+        for (p = map; p < map + size; p++) {
+            if (*p == 0) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http file cache partial block %O is missing",
+                               first + (p - map));
+
+                c->partial_fill = 1;
+
+                return NGX_DECLINED;
+            }
+        }
+
+        first += size;
+        offset += size;
+    }
+
+    c->length = c->body_start + c->partial_length;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "cache file \"%s\" has invalid partial map",
+                  c->file.name.data);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_partial_client_range(ngx_http_request_t *r, off_t length,
+    off_t *start, off_t *end)
+{
+    u_char                    *p;
+    off_t                      s, e, cutoff, cutlim;
+    ngx_uint_t                 suffix;
+    ngx_table_elt_t           *h;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    /* the whole body, unless the range filter is to cut a single range */
+
+    *start = 0;
+    *end = length;
+
+    h = r->headers_in.range;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (h == NULL
+        || r != r->main
+        || r->http_version < NGX_HTTP_VERSION_10
+        || r->headers_in.if_range
+        || clcf->max_ranges == 0
+        || h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return;
+    }
+
+    p = h->value.data + 6;
+
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
+
+    s = 0;
+    e = 0;
+    suffix = 0;
+
+    while (*p == ' ') { p++; }
+
+    if (*p == '-') {
+        suffix = 1;
+        p++;
+
+        while (*p == ' ') { p++; }
+    }
+
+    if (*p < '0' || *p > '9') {
+        return;
+    }
+
+    while (*p >= '0' && *p <= '9') {
+        if (s >= cutoff && (s > cutoff || *p - '0' > cutlim)) {
+            return;
+        }
+
+        s = s * 10 + (*p++ - '0');
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (suffix) {
+        if (*p != '\0' || length == -1) {
+            return;
+        }
+
+        *start = (s < length) ? length - s : 0;
+
+        if (s == 0) {
+            *start = length;
+        }
+
+        return;
+    }
+
+    if (*p++ != '-') {
+        return;
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (*p == '\0') {
+        e = length;
+
+    } else {
+        if (*p < '0' || *p > '9') {
+            return;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            if (e >= cutoff && (e > cutoff || *p - '0' > cutlim)) {
+                return;
+            }
+
+            e = e * 10 + (*p++ - '0');
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p != '\0' || s > e) {
+            return;
+        }
+
+        e++;
+
+        if (length != -1 && e > length) {
+            e = length;
+        }
+    }
+
+    if (length != -1 && s >= length) {
+
+        /* not satisfiable, nothing to read */
+
+        *start = length;
+        return;
+    }
+
+    *start = s;
+    *end = e;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_content_range(ngx_table_elt_t *h, off_t *start,
+    off_t *end, off_t *length)
+{
+    u_char  *p;
+    off_t    s, e, l, cutoff, cutlim;
+
+    if (h == NULL
+        || h->value.len < 7
+        || ngx_strncmp(h->value.data, "bytes ", 6) != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    p = h->value.data + 6;
+
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
+
+    s = 0;
+    e = 0;
+    l = 0;
+
+    while (*p == ' ') { p++; }
+
+    if (*p < '0' || *p > '9') {
+        return NGX_ERROR;
+    }
+
+    while (*p >= '0' && *p <= '9') {
+        if (s >= cutoff && (s > cutoff || *p - '0' > cutlim)) {
+            return NGX_ERROR;
+        }
+
+        s = s * 10 + (*p++ - '0');
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (*p++ != '-') {
+        return NGX_ERROR;
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (*p < '0' || *p > '9') {
+        return NGX_ERROR;
+    }
+
+    while (*p >= '0' && *p <= '9') {
+        if (e >= cutoff && (e > cutoff || *p - '0' > cutlim)) {
+            return NGX_ERROR;
+        }
+
+        e = e * 10 + (*p++ - '0');
+    }
+
+    e++;
+
+    while (*p == ' ') { p++; }
+
+    if (*p++ != '/') {
+        return NGX_ERROR;
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (*p != '*') {
+        if (*p < '0' || *p > '9') {
+            return NGX_ERROR;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            if (l >= cutoff && (l > cutoff || *p - '0' > cutlim)) {
+                return NGX_ERROR;
+            }
+
+            l = l * 10 + (*p++ - '0');
+        }
+
+    } else {
+        l = -1;
+        p++;
+    }
+
+    while (*p == ' ') { p++; }
+
+    if (*p != '\0' || s >= e) {
+        return NGX_ERROR;
+    }
+
+    *start = s;
+    *end = e;
+    *length = l;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_partial_store(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char                             *map;
+    off_t                               block, nblocks, first, last;
+    ngx_int_t                           rc;
+    ngx_file_t                         *pf;
+    ngx_http_cache_t                   *c;
+    ngx_http_file_cache_partial_t       pt;
+    ngx_http_file_cache_partial_ctx_t  *ctx;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *tp;
+    ngx_thread_task_t                  *task;
+    ngx_http_core_loc_conf_t           *clcf;
+#endif
+
+    c = r->cache;
+
+    pf = NULL;
+    ctx = NULL;
+
+    if (tf->offset - (off_t) c->body_start
+        != c->partial_end - c->partial_start)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "partial cache response has %O bytes instead of %O",
+                      tf->offset - (off_t) c->body_start,
+                      c->partial_end - c->partial_start);
+        goto failed;
+    }
+
+#if (NGX_THREADS)
+
+    task = NULL;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_write) {
+        task = ngx_thread_task_alloc(r->pool,
+                                   sizeof(ngx_http_file_cache_partial_ctx_t));
+        if (task == NULL) {
+            goto failed;
+        }
+
+        ctx = task->ctx;
+
+    } else
+#endif
+    {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_file_cache_partial_ctx_t));
+        if (ctx == NULL) {
+            goto failed;
+        }
+    }
+
+    ctx->request = r;
+    ctx->temp_file = tf;
+    ctx->src = tf->file;
+
+    if (c->partial_fill) {
+        rc = ngx_http_file_cache_partial_fill(r, ctx);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        if (rc == NGX_BUSY) {
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+
+            ngx_http_file_cache_update_node(r, NULL, NGX_DECLINED, NULL);
+            return;
+        }
+    }
+
+    if (!ctx->fill) {
+        ctx->dst = tf->file;
+
+        if (c->partial_start) {
+
+            /* move the body to its natural offset in a new file */
+
+            pf = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+            if (pf == NULL) {
+                goto failed;
+            }
+
+            pf->fd = NGX_INVALID_FILE;
+            pf->name = tf->file.name;
+            pf->log = r->connection->log;
+
+            if (ngx_create_temp_file(pf, tf->path, r->pool, 1, 0, 0)
+                != NGX_OK)
+            {
+                pf->fd = NGX_INVALID_FILE;
+                goto failed;
+            }
+
+            ctx->dst = *pf;
+            ctx->header = c->body_start;
+            ctx->src_offset = c->body_start;
+            ctx->dst_offset = c->body_start + c->partial_start;
+            ctx->size = c->partial_end - c->partial_start;
+        }
+
+        block = (off_t) c->partial_block;
+        nblocks = (c->partial_length + block - 1) / block;
+
+        map = ngx_pcalloc(r->pool, (size_t) nblocks + sizeof(pt));
+        if (map == NULL) {
+            goto failed;
+        }
+
+        first = (c->partial_start + block - 1) / block;
+        last = (c->partial_end == c->partial_length) ? nblocks
+                                                     : c->partial_end / block;
+
+        if (first < last) {
+            ngx_memset(map + first, 1, last - first);
+        }
+
+        ngx_memcpy(pt.magic, "NGXPART1", 8);
+        pt.length = c->partial_length;
+        pt.block = block;
+
+        ngx_memcpy(map + nblocks, &pt, sizeof(pt));
+
+        ctx->map = map;
+        ctx->map_len = (size_t) nblocks + sizeof(pt);
+        ctx->map_offset = c->body_start + c->partial_length;
+    }
+
+    if (ctx->header || ctx->size) {
+        ctx->buf_size = 65536;
+
+        ctx->buf = ngx_pnalloc(r->pool, ctx->buf_size);
+        if (ctx->buf == NULL) {
+            goto failed;
+        }
+    }
+
+#if (NGX_THREADS)
+
+    /*
+     * the range may be large, so it is copied in a thread; the request
+     * is kept until the copy is finished to update the cache node
+     */
+
+    if (task) {
+        tp = ngx_http_cache_thread_pool(r);
+
+        if (tp) {
+            task->handler = ngx_http_file_cache_partial_write;
+            task->event.data = ctx;
+            task->event.handler = ngx_http_file_cache_partial_thread_handler;
+
+            if (ngx_thread_task_post(tp, task) == NGX_OK) {
+                r->main->count++;
+                r->main->blocked++;
+                return;
+            }
+        }
+    }
+
+#endif
+
+    ngx_http_file_cache_partial_write(ctx, r->connection->log);
+    ngx_http_file_cache_partial_stored(ctx);
+
+    return;
+
+failed:
+
+    rc = NGX_ERROR;
+
+    if (ctx && ctx->fill) {
+        if (ngx_close_file(ctx->dst.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed",
+                          ctx->dst.name.data);
+        }
+
+        /* the live file is left as is */
+
+        rc = NGX_DECLINED;
+    }
+
+    if (pf && pf->fd != NGX_INVALID_FILE
+        && ngx_delete_file(pf->name.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", pf->name.data);
+    }
+
+    if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tf->file.name.data);
+    }
+
+    ngx_http_file_cache_update_node(r, NULL, rc, NULL);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_fill(ngx_http_request_t *r,
+    ngx_http_file_cache_partial_ctx_t *ctx)
+{
+    u_char                         *map;
+    off_t                           block, nblocks, first, last, size;
+    ssize_t                         n;
+    ngx_int_t                       rc;
+    ngx_file_t                      file;
+    ngx_file_info_t                 fi;
+    ngx_http_cache_t               *c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_header_t    h;
+    ngx_http_file_cache_partial_t   pt;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, ngx_errno,
+                       "http file cache partial open \"%s\" failed",
+                       file.name.data);
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_DECLINED;
+
+    block = (off_t) c->partial_block;
+    nblocks = (c->partial_length + block - 1) / block;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto failed;
+    }
+
+    size = ngx_file_size(&fi);
+
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n == NGX_ERROR || (size_t) n != sizeof(h)) {
+        goto failed;
+    }
+
+    /* the entry is only extended with blocks of the same object */
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || h.last_modified != c->last_modified
+        || (size_t) h.etag_len != c->etag.len
+        || ngx_memcmp(h.etag, c->etag.data, c->etag.len) != 0
+        || size != (off_t) (h.body_start + sizeof(pt)) + c->partial_length
+                   + nblocks)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache partial entry changed");
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &pt, sizeof(pt), size - sizeof(pt));
+
+    if (n == NGX_ERROR
+        || (size_t) n != sizeof(pt)
+        || ngx_memcmp(pt.magic, "NGXPART1", 8) != 0
+        || pt.length != (uint64_t) c->partial_length
+        || pt.block != (uint64_t) block)
+    {
+        goto failed;
+    }
+
+    first = (c->partial_start + block - 1) / block;
+    last = (c->partial_end == c->partial_length) ? nblocks
+                                                 : c->partial_end / block;
+
+    map = NULL;
+
+    if (first < last) {
+        map = ngx_pnalloc(r->pool, last - first);
+        if (map == NULL) {
+            rc = NGX_ERROR;
+            goto failed;
+        }
+
+        ngx_memset(map, 1, last - first);
+    }
+
+    /* the live file is only written by the request updating the entry */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->updating) {
+        rc = NGX_BUSY;
+
+    } else {
+        c->node->updating = 1;
+        c->updating = 1;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (rc == NGX_BUSY) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache partial \"%s\" is being updated",
+                       file.name.data);
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial fill \"%s\": %O-%O",
+                   file.name.data, c->partial_start, c->partial_end);
+
+    ctx->dst = file;
+    ctx->src_offset = c->body_start;
+    ctx->dst_offset = h.body_start + c->partial_start;
+    ctx->size = c->partial_end - c->partial_start;
+    ctx->map = map;
+    ctx->map_len = (size_t) (last - first);
+    ctx->map_offset = h.body_start + c->partial_length + first;
+    ctx->fill = 1;
+
+    c->body_start = h.body_start;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_partial_write(void *data, ngx_log_t *log)
+{
+    ngx_http_file_cache_partial_ctx_t *ctx = data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http file cache partial write \"%s\": %O+%O",
+                   ctx->dst.name.data, ctx->dst_offset, ctx->size);
+
+    ctx->src.log = log;
+    ctx->dst.log = log;
+
+    ctx->rc = NGX_ERROR;
+
+    if (ngx_http_file_cache_partial_copy(&ctx->src, 0, &ctx->dst, 0,
+                                         ctx->header, ctx->buf, ctx->buf_size)
+        != NGX_OK
+        || ngx_http_file_cache_partial_copy(&ctx->src, ctx->src_offset,
+                                            &ctx->dst, ctx->dst_offset,
+                                            ctx->size, ctx->buf,
+                                            ctx->buf_size)
+           != NGX_OK)
+    {
+        return;
+    }
+
+    if (ctx->map_len
+        && ngx_write_file(&ctx->dst, ctx->map, ctx->map_len, ctx->map_offset)
+           == NGX_ERROR)
+    {
+        return;
+    }
+
+    if (ctx->fill && ngx_fd_info(ctx->dst.fd, &ctx->fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", ctx->dst.name.data);
+        return;
+    }
+
+    ctx->rc = NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_partial_stored(ngx_http_file_cache_partial_ctx_t *ctx)
+{
+    ngx_int_t            rc;
+    ngx_temp_file_t     *tf;
+    ngx_http_request_t  *r;
+
+    r = ctx->request;
+    tf = ctx->temp_file;
+
+    rc = ctx->rc;
+
+    if (ctx->buf) {
+        ngx_pfree(r->pool, ctx->buf);
+    }
+
+    if (ctx->fill) {
+        if (ngx_close_file(ctx->dst.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed",
+                          ctx->dst.name.data);
+        }
+
+    } else if (ctx->dst.fd != tf->file.fd) {
+
+        if (rc == NGX_OK) {
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+
+            /* the output may still refer to the temporary file */
+
+            ngx_http_file_cache_update_node(r, &ctx->dst, NGX_OK, NULL);
+            return;
+        }
+
+        if (ngx_delete_file(ctx->dst.name.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed",
+                          ctx->dst.name.data);
+        }
+
+    } else if (rc == NGX_OK) {
+        ngx_http_file_cache_update_node(r, &tf->file, NGX_OK, NULL);
+        return;
+    }
+
+    if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tf->file.name.data);
+    }
+
+    if (ctx->fill) {
+
+        /* a failed fill leaves the blocks unmarked in the live file */
+
+        rc = (rc == NGX_OK) ? NGX_DONE : NGX_DECLINED;
+
+    } else {
+        rc = NGX_ERROR;
+    }
+
+    ngx_http_file_cache_update_node(r, NULL, rc, &ctx->fi);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_file_cache_partial_thread_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_file_cache_partial_ctx_t  *ctx;
+
+    ctx = ev->data;
+    r = ctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache partial thread: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    r->main->blocked--;
+
+    ngx_http_file_cache_partial_stored(ctx);
+
+    if (r->done) {
+        /*
+         * trigger connection event handler if the request was already
+         * finalized, it may have been terminated while the task was running
+         */
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_copy(ngx_file_t *src, off_t src_offset,
+    ngx_file_t *dst, off_t dst_offset, off_t size, u_char *buf, size_t len)
+{
+    ssize_t  n;
+
+    while (size) {
+        n = ngx_read_file(src, buf, (size_t) ngx_min(size, (off_t) len),
+                          src_offset);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_CRIT, src->log, 0,
+                          "file \"%s\" was truncated", src->name.data);
+            return NGX_ERROR;
+        }
+
+        if (ngx_write_file(dst, buf, n, dst_offset) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        size -= n;
+        src_offset += n;
+        dst_offset += n;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+
+        if (fcn->protected) {
+            cache->sh->protected--;
+        }
+
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static void
+ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    /*
+     * with the segmented LRU policy entries used more than once
+     * move to the protected queue
+     */
+
+    if (cache->eviction == NGX_HTTP_CACHE_EVICTION_SLRU
+        && fcn->exists
+        && fcn->uses > 1)
+    {
+        if (!fcn->protected) {
+            fcn->protected = 1;
+            cache->sh->protected++;
+        }
+
+        ngx_queue_insert_head(&cache->sh->protected_queue, &fcn->queue);
+
+        return;
+    }
+
+    if (fcn->protected) {
+        fcn->protected = 0;
+        cache->sh->protected--;
+    }
+
+    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_oldest(ngx_http_file_cache_t *cache)
+{
+    ngx_queue_t                 *q, *p;
+    ngx_http_file_cache_node_t  *fcn, *pfcn;
+
+    q = ngx_queue_empty(&cache->sh->queue)
+        ? NULL : ngx_queue_last(&cache->sh->queue);
+
+    if (ngx_queue_empty(&cache->sh->protected_queue)) {
+        return q;
+    }
+
+    p = ngx_queue_last(&cache->sh->protected_queue);
+
+    if (q == NULL) {
+        return p;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    pfcn = ngx_queue_data(p, ngx_http_file_cache_node_t, queue);
+
+    return (pfcn->expire < fcn->expire) ? p : q;
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_victim(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                   n;
+    ngx_queue_t                 *queue, *q, *victim;
+    ngx_http_file_cache_node_t  *fcn, *vfcn;
+
+    /*
+     * the protected queue is limited to 80% of entries, the entries
+     * squeezed out of it get another chance in the probation queue
+     */
+
+    if (cache->sh->protected > cache->sh->count / 5 * 4) {
+        q = ngx_queue_last(&cache->sh->protected_queue);
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        fcn->protected = 0;
+        cache->sh->protected--;
+
+        ngx_queue_insert_head(&cache->sh->queue, q);
+    }
+
+    /* the protected queue is only used when the probation one is empty */
+
+    queue = &cache->sh->queue;
+
+    if (ngx_queue_empty(queue)) {
+        queue = &cache->sh->protected_queue;
+
+        if (ngx_queue_empty(queue)) {
+            return NULL;
+        }
+    }
+
+    if (cache->eviction != NGX_HTTP_CACHE_EVICTION_GDSF) {
+        return ngx_queue_last(queue);
+    }
+
+    /*
+     * of several least recently used entries, evict the one with
+     * the lowest number of uses per block on disk
+     */
+
+    victim = NULL;
+    vfcn = NULL;
+
+    for (q = ngx_queue_last(queue), n = 0;
+         q != ngx_queue_sentinel(queue) && n < NGX_HTTP_CACHE_GDSF_SAMPLE;
+         q = ngx_queue_prev(q), n++)
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (fcn->count) {
+            continue;
+        }
+
+        if (vfcn == NULL
+            || (off_t) fcn->uses * ngx_max(vfcn->fs_size, 1)
+               < (off_t) vfcn->uses * ngx_max(fcn->fs_size, 1))
+        {
+            victim = q;
+            vfcn = fcn;
+        }
+    }
+
+    return victim ? victim : ngx_queue_last(queue);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_path_t                  *path;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_atomic_t                *evicted;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    evicted = (cache->sh->size >= cache->max_size)
+              ? &cache->sh->evicted_max_size : &cache->sh->evicted_keys_zone;
+
+    for ( ;; ) {
+        q = ngx_http_file_cache_victim(cache);
+
+        if (q == NULL || q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            if (fcn->exists) {
+                (*evicted)++;
+            }
+
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_queue(cache, fcn);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_path_t                  *path;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_oldest(cache);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            if (fcn->exists) {
+                cache->sh->evicted_inactive++;
+            }
+
+            ngx_http_file_cache_delete(cache, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_queue(cache, fcn);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_http_file_cache_memory_free(cache, fcn);
+
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+
+        if (fcn->protected) {
+            cache->sh->protected--;
+        }
+
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size;
+    time_t      wait, now;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
-    }
+    if (cache->snapshot && !cache->sh->cold) {
+        now = ngx_time();
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
+        if (cache->snapshot_next == 0) {
+            cache->snapshot_next = now + cache->snapshot;
+
+        } else if (now >= cache->snapshot_next
+                   && ngx_http_file_cache_write_snapshot(cache) != NGX_AGAIN)
+        {
+            ngx_time_update();
+            cache->snapshot_next = ngx_time() + cache->snapshot;
+        }
     }
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-    if (n == NGX_ERROR) {
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
         goto done;
     }
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+            break;
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+done:
+
+    if (cache->snapshot_ctx) {
+
+        /* the snapshot is continued after the usual pause */
+
+        if (cache->manager_sleep < next) {
+            next = cache->manager_sleep;
+        }
+
+    } else if (cache->snapshot) {
+        wait = cache->snapshot_next ? cache->snapshot_next - ngx_time()
+                                    : cache->snapshot;
+
+        if (wait <= 0) {
+            next = 1;
+
+        } else if ((ngx_msec_t) wait * 1000 < next) {
+            next = (ngx_msec_t) wait * 1000;
+        }
     }
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.updating_sec = c->updating_sec;
-    h.error_sec = c->error_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+    return next;
+}
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    if (cache->snapshot) {
+        cache->snapshot_time = ngx_http_file_cache_load_snapshot(cache);
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
 
-done:
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    if (cache->snapshot_dirs) {
+        ngx_http_file_cache_reconcile_snapshot(cache);
+
+        ngx_free(cache->snapshot_dirs);
+        cache->snapshot_dirs = NULL;
     }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    return NGX_OK;
+}
 
-    c = r->cache;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
-    }
+    cache = ctx->data;
 
-    /* we need to allocate all before the header would be sent */
+    if (cache->snapshot
+        && path->len >= cache->snapshot_name.len
+        && ngx_strncmp(path->data, cache->snapshot_name.data,
+                       cache->snapshot_name.len)
+           == 0)
+    {
+        return NGX_OK;
+    }
 
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
     }
 
-    rc = ngx_http_send_header(r);
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    cache = ctx->data;
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+    /*
+     * files created or deleted after the snapshot was taken change
+     * the modification time of the last level directories they are in
+     */
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    if (path->len == cache->path->name.len + cache->path->len) {
+
+        if (cache->snapshot_time && ctx->mtime < cache->snapshot_time) {
+            return NGX_DECLINED;
+        }
 
-    out.buf = b;
-    out.next = NULL;
+        if (cache->snapshot_dirs) {
+            ngx_http_file_cache_snapshot_walked(cache, path);
+        }
+    }
 
-    return ngx_http_output_filter(r, &out);
+    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
-
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+    ngx_msleep(cache->loader_sleep);
 
-    cache = c->file_cache;
+    ngx_time_update();
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    fcn = c->node;
-    fcn->count--;
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
     }
 
-    if (c->error) {
-        fcn->error = c->error;
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
-        }
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
 
-    c->updated = 1;
-    c->updating = 0;
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
         }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+        p += 2;
+
+        c.key[i] = (u_char) n;
     }
+
+    return ngx_http_file_cache_add(cache, &c);
 }
 
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_http_cache_t  *c = data;
-
-    if (c->updated) {
-        return;
-    }
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    ngx_http_file_cache_node_t  *fcn;
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
-    }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_http_file_cache_free(c, NULL);
-}
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
 
+    if (fcn == NULL) {
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+        cache->sh->count++;
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
 
-        q = ngx_queue_last(&cache->sh->queue);
+        cache->sh->size += c->fs_size;
 
-        if (q == sentinel) {
-            break;
-        }
+    } else {
+        ngx_queue_remove(&fcn->queue);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        /* the file of a node loaded from the snapshot is still there */
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        if (fcn->snapshot) {
+            fcn->snapshot = 0;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
+            if (fcn->exists && fcn->count == 0) {
+                cache->sh->size += c->fs_size - fcn->fs_size;
+                fcn->fs_size = c->fs_size;
+            }
         }
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    fcn->expire = ngx_time() + cache->inactive;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    ngx_http_file_cache_queue(cache, fcn);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    return NGX_OK;
+}
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
 
-        if (--tries) {
-            continue;
-        }
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-        wait = 1;
-        break;
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-    ngx_free(name);
 
-    return wait;
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_write_snapshot(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    size_t                                  size;
+    ssize_t                                 n;
+    ngx_msec_t                              start, elapsed;
+    ngx_uint_t                              count;
+    ngx_rbtree_node_t                      *node, *sentinel;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_t         *sn;
+    ngx_http_file_cache_snapshot_entry_t   *entry;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    sn = cache->snapshot_ctx;
+
+    if (sn == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache snapshot");
+
+        size = sizeof(ngx_http_file_cache_snapshot_t)
+               + sizeof(ngx_http_file_cache_snapshot_block_t)
+               + NGX_HTTP_CACHE_SNAPSHOT_BLOCK
+                 * sizeof(ngx_http_file_cache_snapshot_entry_t)
+               + cache->snapshot_name.len + sizeof(".tmp");
+
+        sn = ngx_alloc(size, ngx_cycle->log);
+        if (sn == NULL) {
+            return NGX_ERROR;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+        sn->block = (ngx_http_file_cache_snapshot_block_t *) &sn[1];
+        sn->temp = (u_char *) sn + size - cache->snapshot_name.len
+                   - sizeof(".tmp");
+        sn->total = 0;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_sprintf(sn->temp, "%V.tmp%Z", &cache->snapshot_name);
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+        sn->fd = ngx_open_file(sn->temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                               NGX_FILE_DEFAULT_ACCESS);
+
+        if (sn->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", sn->temp);
+            ngx_free(sn);
+            return NGX_ERROR;
+        }
+
+        cache->snapshot_ctx = sn;
+
+        ngx_memzero(&header, sizeof(ngx_http_file_cache_snapshot_header_t));
+        ngx_memcpy(header.magic, "NGXCSNAP", 8);
+        header.version = NGX_HTTP_CACHE_SNAPSHOT_VERSION;
+        header.entry_size = sizeof(ngx_http_file_cache_snapshot_entry_t);
+        header.time = ngx_time();
+        header.bsize = cache->bsize;
+
+        if (ngx_write_fd(sn->fd, &header, sizeof(header)) != sizeof(header)) {
+            goto failed;
+        }
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    now = ngx_time();
+    /*
+     * the tree is copied in blocks under the mutex, every block continues
+     * from the key following the last one written, so nodes may be freely
+     * added and removed between the blocks; the snapshot is written
+     * in slices of manager_threshold, so expiring entries is not delayed
+     */
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    entry = (ngx_http_file_cache_snapshot_entry_t *) &sn->block[1];
+    sentinel = cache->sh->rbtree.sentinel;
+    start = ngx_current_msec;
 
     for ( ;; ) {
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
+        if (sn->total == 0) {
+            node = cache->sh->rbtree.root;
+            node = (node == sentinel) ? NULL : ngx_rbtree_min(node, sentinel);
+
+        } else {
+            node = ngx_http_file_cache_snapshot_next(cache, sn->key);
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        for (count = 0;
+             node && count < NGX_HTTP_CACHE_SNAPSHOT_BLOCK;
+             node = ngx_rbtree_next(&cache->sh->rbtree, node))
+        {
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+            ngx_memcpy(sn->key, &node->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&sn->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        wait = fcn->expire - now;
+            sn->total++;
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+            if (!fcn->exists || fcn->deleting || fcn->purged || fcn->error) {
+                continue;
+            }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+            ngx_memcpy(entry[count].key, sn->key, NGX_HTTP_CACHE_KEY_LEN);
+            entry[count].uniq = fcn->uniq;
+            entry[count].fs_size = fcn->fs_size;
+            entry[count].valid_sec = fcn->valid_sec;
+            entry[count].body_start = fcn->body_start;
+            entry[count].uses = fcn->uses;
+            entry[count].valid_msec = fcn->valid_msec;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
+            count++;
         }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        sn->block->count = count;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        ngx_crc32_init(sn->block->crc32);
+        ngx_crc32_update(&sn->block->crc32, (u_char *) entry,
+                         count * sizeof(ngx_http_file_cache_snapshot_entry_t));
+        ngx_crc32_final(sn->block->crc32);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        size = sizeof(ngx_http_file_cache_snapshot_block_t)
+               + count * sizeof(ngx_http_file_cache_snapshot_entry_t);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+        n = ngx_write_fd(sn->fd, sn->block, size);
 
-next:
+        if (n == -1 || (size_t) n != size) {
+            goto failed;
+        }
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
+        /* an empty block ends the snapshot */
+
+        if (count == 0) {
             break;
         }
 
+        if (ngx_terminate) {
+            goto failed;
+        }
+
         ngx_time_update();
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - start));
 
         if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
+            return NGX_AGAIN;
         }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    cache->snapshot_ctx = NULL;
 
-    ngx_free(name);
+    if (ngx_close_file(sn->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", sn->temp);
+        ngx_free(sn);
+        return NGX_ERROR;
+    }
 
-    return wait;
+    if (ngx_rename_file(sn->temp, cache->snapshot_name.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      sn->temp, &cache->snapshot_name);
+        ngx_free(sn);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot: %ui nodes", sn->total);
+
+    ngx_free(sn);
+
+    return NGX_OK;
+
+failed:
+
+    cache->snapshot_ctx = NULL;
+
+    if (!ngx_terminate) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed", sn->temp);
+    }
+
+    if (ngx_close_file(sn->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", sn->temp);
+    }
+
+    if (ngx_delete_file(sn->temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", sn->temp);
+    }
+
+    ngx_free(sn);
+
+    return NGX_ERROR;
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static ngx_rbtree_node_t *
+ngx_http_file_cache_snapshot_next(ngx_http_file_cache_t *cache, u_char *key)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
     ngx_http_file_cache_node_t  *fcn;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /* the first node with the key greater than the given one */
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+    next = NULL;
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    while (node != sentinel) {
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        if (node_key < node->key) {
+            rc = -1;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        } else if (node_key > node->key) {
+            rc = 1;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
-    }
+        if (rc < 0) {
+            next = node;
+            node = node->left;
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        } else {
+            node = node->right;
+        }
     }
+
+    return next;
 }
 
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
+static time_t
+ngx_http_file_cache_load_snapshot(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_t  *cache = data;
+    size_t                                  size;
+    time_t                                  time;
+    uint32_t                                crc32;
+    ngx_fd_t                                fd;
+    ngx_uint_t                              i, loaded;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_block_t    block;
+    ngx_http_file_cache_snapshot_entry_t   *entry;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    fd = ngx_open_file(cache->snapshot_name.data, NGX_FILE_RDONLY,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%V\" failed",
+                          &cache->snapshot_name);
+        }
 
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+        return 0;
+    }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    time = 0;
+    loaded = 0;
+    entry = NULL;
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    if (ngx_http_file_cache_snapshot_read(fd, &header, sizeof(header))
+        != NGX_OK
+        || ngx_memcmp(header.magic, "NGXCSNAP", 8) != 0
+        || header.version != NGX_HTTP_CACHE_SNAPSHOT_VERSION
+        || header.entry_size != sizeof(ngx_http_file_cache_snapshot_entry_t)
+        || header.bsize != cache->bsize)
+    {
+        goto invalid;
+    }
 
-    if (next == 0) {
-        next = cache->manager_sleep;
+    size = NGX_HTTP_CACHE_SNAPSHOT_BLOCK
+           * sizeof(ngx_http_file_cache_snapshot_entry_t);
+
+    entry = ngx_alloc(size, ngx_cycle->log);
+    if (entry == NULL) {
         goto done;
     }
 
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
-
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
-
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
 
-        if (size < cache->max_size && count < watermark) {
-            break;
+        if (ngx_quit || ngx_terminate) {
+            goto done;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
-
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
+        if (ngx_http_file_cache_snapshot_read(fd, &block, sizeof(block))
+            != NGX_OK
+            || block.count > NGX_HTTP_CACHE_SNAPSHOT_BLOCK)
+        {
+            goto invalid;
         }
 
-        if (ngx_quit || ngx_terminate) {
+        if (block.count == 0) {
             break;
         }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
+        size = block.count * sizeof(ngx_http_file_cache_snapshot_entry_t);
 
-        ngx_time_update();
+        if (ngx_http_file_cache_snapshot_read(fd, entry, size) != NGX_OK) {
+            goto invalid;
+        }
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        ngx_crc32_init(crc32);
+        ngx_crc32_update(&crc32, (u_char *) entry, size);
+        ngx_crc32_final(crc32);
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (crc32 != block.crc32) {
+            goto invalid;
         }
-    }
 
-done:
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        for (i = 0; i < block.count; i++) {
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+            if (ngx_http_file_cache_lookup(cache, entry[i].key)) {
+                continue;
+            }
 
-    return next;
-}
+            fcn = ngx_slab_calloc_locked(cache->shpool,
+                                         sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                ngx_http_file_cache_set_watermark(cache);
+                ngx_shmtx_unlock(&cache->shpool->mutex);
 
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "could not allocate node%s",
+                              cache->shpool->log_ctx);
+                goto dirs;
+            }
 
-static void
-ngx_http_file_cache_loader(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+            cache->sh->count++;
 
-    ngx_tree_ctx_t  tree;
+            ngx_memcpy((u_char *) &fcn->node.key, entry[i].key,
+                       sizeof(ngx_rbtree_key_t));
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
-    }
+            ngx_memcpy(fcn->key, &entry[i].key[sizeof(ngx_rbtree_key_t)],
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+            fcn->uses = entry[i].uses;
+            fcn->valid_msec = entry[i].valid_msec;
+            fcn->exists = 1;
+            fcn->snapshot = 1;
+            fcn->uniq = (ngx_file_uniq_t) entry[i].uniq;
+            fcn->valid_sec = (time_t) entry[i].valid_sec;
+            fcn->body_start = entry[i].body_start;
+            fcn->fs_size = (off_t) entry[i].fs_size;
+            fcn->expire = ngx_time() + cache->inactive;
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+            cache->sh->size += fcn->fs_size;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+            loaded++;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    time = (time_t) header.time;
 
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
-
-
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
-}
-
-
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+                  "http file cache: %V %ui nodes loaded from snapshot",
+                  &cache->path->name, loaded);
 
-    cache = ctx->data;
+    goto dirs;
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
-    }
+invalid:
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "invalid cache snapshot \"%V\", %ui nodes loaded",
+                  &cache->snapshot_name, loaded);
 
-    } else {
-        ngx_time_update();
+dirs:
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    /*
+     * the nodes loaded are checked against the files in the directories
+     * walked, a bit per last level directory
+     */
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    if (loaded) {
+        size = ((size_t) 1 << (4 * ngx_http_file_cache_snapshot_levels(cache)))
+               / 8 + 1;
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+        cache->snapshot_dirs = ngx_calloc(size, ngx_cycle->log);
+
+        if (cache->snapshot_dirs && cache->path->len == 0) {
+            /* the files are in the cache directory itself */
+            cache->snapshot_dirs[0] = 1;
         }
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+done:
+
+    if (entry) {
+        ngx_free(entry);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed",
+                      &cache->snapshot_name);
+    }
+
+    return time;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_snapshot_read(ngx_fd_t fd, void *buf, size_t size)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    ssize_t  n;
+    u_char  *p;
+
+    p = buf;
+
+    while (size) {
+        n = ngx_read_fd(fd, p, size);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_read_fd_n " cache snapshot failed");
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            return NGX_DECLINED;
+        }
+
+        p += n;
+        size -= n;
     }
 
     return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+static ngx_uint_t
+ngx_http_file_cache_snapshot_levels(ngx_http_file_cache_t *cache)
 {
-    ngx_msleep(cache->loader_sleep);
+    ngx_uint_t  i, n;
 
-    ngx_time_update();
+    n = 0;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        n += cache->path->level[i];
+    }
+
+    return n;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+/*
+ * a last level directory holds the files whose names end with the names
+ * of its directories taken in the reverse order, these last characters
+ * of the name are used as the directory number
+ */
+
+static void
+ngx_http_file_cache_snapshot_walked(ngx_http_file_cache_t *cache,
+    ngx_str_t *path)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    u_char      *p;
+    ngx_int_t    n;
+    ngx_uint_t   i, j, dir;
+    ngx_path_t  *cp;
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+    cp = cache->path;
+    dir = 0;
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    for (i = NGX_MAX_PATH_LEVEL; i-- > 0; /* void */ ) {
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+        p = path->data + cp->name.len;
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+        for (j = 0; j < i; j++) {
+            p += 1 + cp->level[j];
+        }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+        for (j = 0; j < cp->level[i]; j++) {
+            n = ngx_hextoi(p + 1 + j, 1);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+            if (n == NGX_ERROR) {
+                return;
+            }
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+            dir = (dir << 4) | n;
+        }
+    }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    cache->snapshot_dirs[dir / 8] |= (u_char) (1 << (dir % 8));
+}
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
 
-        p += 2;
+static ngx_uint_t
+ngx_http_file_cache_snapshot_dir(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_uint_t  i, dir;
 
-        c.key[i] = (u_char) n;
+    dir = 0;
+
+    for (i = 2 * NGX_HTTP_CACHE_KEY_LEN
+             - ngx_http_file_cache_snapshot_levels(cache);
+         i < 2 * NGX_HTTP_CACHE_KEY_LEN;
+         i++)
+    {
+        dir = (dir << 4) | ((i & 1) ? (key[i / 2] & 0x0f) : (key[i / 2] >> 4));
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    return dir;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_reconcile_snapshot(ngx_http_file_cache_t *cache)
 {
+    ngx_uint_t                   n, dir, dropped;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
     ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /*
+     * nodes loaded from the snapshot, whose files were not found
+     * in the directories walked, were deleted after the snapshot was taken
+     */
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    sentinel = cache->sh->rbtree.sentinel;
+    dropped = 0;
+    n = 0;
 
-    if (fcn == NULL) {
+    for ( ;; ) {
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+        if (n == 0) {
+            node = cache->sh->rbtree.root;
+            node = (node == sentinel) ? NULL : ngx_rbtree_min(node, sentinel);
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+        } else {
+            node = ngx_http_file_cache_snapshot_next(cache, key);
         }
 
-        cache->sh->count++;
-
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
-
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        for (n = 1;
+             node && n <= NGX_HTTP_CACHE_SNAPSHOT_BLOCK;
+             node = next, n++)
+        {
+            next = ngx_rbtree_next(&cache->sh->rbtree, node);
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+            ngx_memcpy(key, &node->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+            if (!fcn->snapshot) {
+                continue;
+            }
 
-        cache->sh->size += c->fs_size;
+            fcn->snapshot = 0;
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+            if (fcn->count || fcn->deleting) {
+                continue;
+            }
 
-    fcn->expire = ngx_time() + cache->inactive;
+            dir = ngx_http_file_cache_snapshot_dir(cache, key);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+            if (!(cache->snapshot_dirs[dir / 8] & (1 << (dir % 8)))) {
+                continue;
+            }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_queue_remove(&fcn->queue);
 
-    return NGX_OK;
-}
+            if (fcn->protected) {
+                cache->sh->protected--;
+            }
 
+            ngx_http_file_cache_memory_free(cache, fcn);
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+            if (fcn->exists) {
+                cache->sh->size -= fcn->fs_size;
+            }
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
-    }
+            ngx_rbtree_delete(&cache->sh->rbtree, node);
+            ngx_slab_free_locked(cache->shpool, fcn);
+            cache->sh->count--;
 
-    return NGX_OK;
-}
+            dropped++;
+        }
 
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+        if (node == NULL || ngx_quit || ngx_terminate) {
+            break;
+        }
+    }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+                   "http file cache snapshot: %ui nodes dropped", dropped);
 }
 
 
@@ -2306,14 +5018,16 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     off_t                   max_size;
     u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
+    time_t                  inactive, snapshot;
+    ssize_t                 size, memory, memory_max_object;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_int_t               loader_files, manager_files, memory_min_uses;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_int_t               admission;
+    ngx_uint_t              i, n, use_temp_path, eviction;
     ngx_array_t            *caches;
+    ngx_shm_zone_t         *shm_zone;
     ngx_http_file_cache_t  *cache, **ce;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
@@ -2329,6 +5043,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     use_temp_path = 1;
 
     inactive = 600;
+    snapshot = 0;
+
+    memory = 0;
+    memory_max_object = 32768;
+    memory_min_uses = 2;
+
+    eviction = NGX_HTTP_CACHE_EVICTION_LRU;
+    admission = 10000;
 
     loader_files = 100;
     loader_sleep = 50;
@@ -2461,6 +5183,110 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            snapshot = ngx_parse_time(&s, 1);
+            if (snapshot == (time_t) NGX_ERROR || snapshot == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid snapshot value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            memory = ngx_parse_size(&s);
+            if (memory == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (memory && memory < (ssize_t) (2 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "memory zone \"%V\" is too small",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            memory_max_object = ngx_parse_size(&s);
+            if (memory_max_object == NGX_ERROR || memory_max_object == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            memory_min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (memory_min_uses == NGX_ERROR || memory_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                eviction = NGX_HTTP_CACHE_EVICTION_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "slru") == 0) {
+                eviction = NGX_HTTP_CACHE_EVICTION_SLRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "gdsf") == 0) {
+                eviction = NGX_HTTP_CACHE_EVICTION_GDSF;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid eviction value \"%V\", "
+                                   "it must be \"lru\", \"slru\" or \"gdsf\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            admission = NGX_ERROR;
+
+            if (value[i].len > 11 && value[i].data[value[i].len - 1] == '%') {
+                admission = ngx_atofp(value[i].data + 10, value[i].len - 11, 2);
+            }
+
+            if (admission == NGX_ERROR || admission == 0 || admission > 10000) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2584,6 +5410,21 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
 
+    if (snapshot) {
+        cache->snapshot = snapshot;
+
+        cache->snapshot_name.len = cache->path->name.len
+                                   + sizeof("/snapshot") - 1;
+        cache->snapshot_name.data = ngx_pnalloc(cf->pool,
+                                                cache->snapshot_name.len + 1);
+        if (cache->snapshot_name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_name.data, "%V/snapshot%Z",
+                    &cache->path->name);
+    }
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -2603,11 +5444,42 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (memory) {
+
+        /*
+         * objects are kept in a separate zone, so they cannot starve
+         * the keys zone; the name cannot clash as zone names have no ":"
+         */
+
+        s.len = name.len + sizeof(":memory") - 1;
+        s.data = ngx_pnalloc(cf->pool, s.len);
+        if (s.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(s.data, "%V:memory", &name);
+
+        shm_zone = ngx_shared_memory_add(cf, &s, memory, cmd->post);
+        if (shm_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_http_file_cache_memory_init;
+        shm_zone->data = cache;
+    }
+
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
     cache->max_size = max_size;
 
+    cache->memory = memory;
+    cache->memory_max_object = memory_max_object;
+    cache->memory_min_uses = memory_min_uses;
+
+    cache->eviction = eviction;
+    cache->admission = (ngx_uint_t) admission;
+
     caches = (ngx_array_t *) (confp + cmd->offset);
 
     ce = ngx_array_push(caches);
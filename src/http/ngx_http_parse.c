@@ -33,6 +33,40 @@ static uint32_t  usual[] = {
 };
 
 
+#if (NGX_HAVE_SSE42)
+
+#include <nmmintrin.h>
+
+
+/*
+ * the bytes that end a run of ordinary characters in the header value
+ * and in the URI, the latter being the complement of the usual[] bitmap
+ */
+
+#define NGX_HTTP_PARSE_VALUE_STOP  4
+
+static const u_char  ngx_http_parse_value_stop[16] = {
+    ' ', CR, LF, '\0'
+};
+
+#if (NGX_WIN32)
+#define NGX_HTTP_PARSE_URI_STOP    11
+#else
+#define NGX_HTTP_PARSE_URI_STOP    10
+#endif
+
+static const u_char  ngx_http_parse_uri_stop[16] = {
+    '\0', LF, CR, ' ', '#', '%', '+', '.', '/', '?', '\\'
+};
+
+
+__attribute__((target("sse4.2")))
+static u_char *ngx_http_parse_skip(u_char *p, u_char *last,
+    const u_char *stop, int n);
+
+#endif
+
+
 #if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
 
 #define ngx_str3_cmp(m, c0, c1, c2, c3)                                       \
@@ -578,6 +612,13 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HAVE_SSE42)
+                if (ngx_cpu_sse42) {
+                    p = ngx_http_parse_skip(p + 1, b->last,
+                                            ngx_http_parse_uri_stop,
+                                            NGX_HTTP_PARSE_URI_STOP) - 1;
+                }
+#endif
                 break;
             }
 
@@ -1076,6 +1117,15 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+#if (NGX_HAVE_SSE42)
+            default:
+                if (ngx_cpu_sse42) {
+                    p = ngx_http_parse_skip(p + 1, b->last,
+                                            ngx_http_parse_value_stop,
+                                            NGX_HTTP_PARSE_VALUE_STOP) - 1;
+                }
+                break;
+#endif
             }
             break;
 
@@ -2469,3 +2519,40 @@ invalid:
 
     return NGX_ERROR;
 }
+
+
+#if (NGX_HAVE_SSE42)
+
+/*
+ * skips 16 bytes at a time up to the first byte from the stop set;
+ * the tail shorter than 16 bytes is left to the byte-wise state machine,
+ * so the scan never reads past the buffer end
+ */
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_skip(u_char *p, u_char *last, const u_char *stop, int n)
+{
+    int      i;
+    __m128i  set, data;
+
+    set = _mm_loadu_si128((const __m128i *) stop);
+
+    while (last - p >= 16) {
+        data = _mm_loadu_si128((const __m128i *) p);
+
+        i = _mm_cmpestri(set, n, data, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
@@ -10,6 +10,11 @@
 #include <ngx_http.h>
 
 
+#define ngx_http_upstream_coalescing(u)                                       \
+    ((u)->coalesce && !(u)->coalesce->follower                                \
+     && !ngx_queue_empty(&(u)->coalesce->queue))
+
+
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -21,8 +26,18 @@ static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_partial(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_latency(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
@@ -30,6 +45,29 @@ static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
+static void ngx_http_upstream_start(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_coalesce(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_coalesce_handler(ngx_event_t *ev);
+static void ngx_http_upstream_coalesce_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_coalesce_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_coalesce_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_uint_t ngx_http_upstream_coalesce_shared(ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_coalesce_copy_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *leader);
+static ngx_int_t ngx_http_upstream_coalesce_input_filter(ngx_event_pipe_t *p,
+    ngx_buf_t *buf);
+static void ngx_http_upstream_coalesce_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_chain_t *in);
+static ngx_int_t ngx_http_upstream_coalesce_copy_body(
+    ngx_http_upstream_coalesce_t *co, ngx_chain_t *in, size_t size);
+static size_t ngx_http_upstream_coalesce_backlog(
+    ngx_http_upstream_coalesce_t *co);
+static void ngx_http_upstream_coalesce_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_int_t rc);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
 static void ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r);
@@ -421,6 +459,54 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_status, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_cache_tier"), NULL,
+      ngx_http_upstream_cache_tier, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_memory_hits"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, memory_hits),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_disk_hits"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, disk_hits),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted_inactive"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evicted_inactive),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted_max_size"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evicted_max_size),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted_keys_zone"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evicted_keys_zone),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_admission_rejected"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, admission_rejected),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_open_blocked"), NULL,
+      ngx_http_upstream_cache_latency,
+      offsetof(ngx_http_file_cache_sh_t, open_blocked),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_open_offloaded"), NULL,
+      ngx_http_upstream_cache_latency,
+      offsetof(ngx_http_file_cache_sh_t, open_offloaded),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_range"), NULL,
+      ngx_http_upstream_cache_range, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("upstream_cache_last_modified"), NULL,
       ngx_http_upstream_cache_last_modified, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
@@ -562,14 +648,9 @@ ngx_http_upstream_init(ngx_http_request_t *r)
 static void
 ngx_http_upstream_init_request(ngx_http_request_t *r)
 {
-    ngx_str_t                      *host;
-    ngx_uint_t                      i;
-    ngx_resolver_ctx_t             *ctx, temp;
-    ngx_http_cleanup_t             *cln;
-    ngx_http_upstream_t            *u;
-    ngx_http_core_loc_conf_t       *clcf;
-    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_cleanup_t        *cln;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
 
     // NȂiۂj
     if (r->aio) {
@@ -696,6 +777,34 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     cln->data = r;
     u->cleanup = &cln->handler;
 
+    if (u->conf->coalesce) {
+
+        switch (ngx_http_upstream_coalesce(r, u)) {
+
+        case NGX_ERROR:
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+
+        case NGX_BUSY:
+            return;
+        }
+    }
+
+    ngx_http_upstream_start(r, u);
+}
+
+
+static void
+ngx_http_upstream_start(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t                      *host;
+    ngx_uint_t                      i;
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
     if (u->resolved == NULL) {
 
         uscf = u->conf->upstream;
@@ -758,6 +867,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
             return;
         }
 
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
         temp.name = *host;
         /**
          * @brief
@@ -777,67 +888,771 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
             return;
         }
 
-        if (ctx == NGX_NO_RESOLVER) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "no resolver defined to resolve %V", host);
+        if (ctx == NGX_NO_RESOLVER) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "no resolver defined to resolve %V", host);
+
+            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+
+        // OzXgd|
+        ctx->name = *host;
+        // OɐɌĂяonhd|
+        ctx->handler = ngx_http_upstream_resolve_handler;
+        // X^u]oZbg
+        ctx->data = r;
+        // ^CAEgZbg
+        ctx->timeout = clcf->resolver_timeout;
+
+        u->resolved->ctx = ctx;
+
+        // X^u]oW[ŖO
+        if (ngx_resolve_name(ctx) != NGX_OK) {
+            u->resolved->ctx = NULL;
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        return;
+    }
+
+found:
+
+    if (uscf == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "no upstream configuration");
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    u->upstream = uscf;
+
+#if (NGX_HTTP_SSL)
+    u->ssl_name = uscf->host;
+#endif
+
+    if (uscf->peer.init(r, uscf) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    u->peer.start_time = ngx_current_msec;
+
+    if (u->conf->next_upstream_tries
+        && u->peer.tries > u->conf->next_upstream_tries)
+    {
+        u->peer.tries = u->conf->next_upstream_tries;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_coalesce(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    ngx_str_node_t                 *node;
+    ngx_http_upstream_coalesce_t   *co, *leader;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    /* a response to a request with credentials is never shared */
+
+    if (r != r->main
+        || r->post_action
+        || r->method != NGX_HTTP_GET
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked
+        || r->headers_in.authorization
+        || r->headers_in.cookies.nelts
+        || u->cacheable
+        || u->store)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_complex_value(r, u->conf->coalesce_key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    node = ngx_str_rbtree_lookup(&umcf->coalesce, &key, hash);
+
+    if (node) {
+        leader = (ngx_http_upstream_coalesce_t *) node;
+
+        if (leader->request->upstream->conf != u->conf) {
+            return NGX_DECLINED;
+        }
+
+    } else {
+
+        /*
+         * range and conditional requests are passed to the upstream
+         * and may get a response which is not usable by followers
+         */
+
+        if (r->headers_in.range
+            || r->headers_in.if_range
+            || r->headers_in.if_modified_since
+            || r->headers_in.if_unmodified_since
+            || r->headers_in.if_match
+            || r->headers_in.if_none_match)
+        {
+            return NGX_DECLINED;
+        }
+
+        leader = NULL;
+    }
+
+    co = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_coalesce_t));
+    if (co == NULL) {
+        return NGX_ERROR;
+    }
+
+    co->request = r;
+    u->coalesce = co;
+
+    if (leader == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream coalesce leader: \"%V\"", &key);
+
+        co->node.node.key = hash;
+        co->node.str = key;
+
+        ngx_rbtree_insert(&umcf->coalesce, &co->node.node);
+        co->linked = 1;
+
+        ngx_queue_init(&co->queue);
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream coalesce follower: \"%V\"", &key);
+
+    co->leader = leader;
+    co->follower = 1;
+    co->last = &co->out;
+
+    co->event.handler = ngx_http_upstream_coalesce_handler;
+    co->event.data = co;
+    co->event.log = r->connection->log;
+
+    ngx_queue_insert_tail(&leader->queue, &co->queue);
+
+    ngx_add_timer(&co->event, u->conf->coalesce_timeout);
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_coalesce_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_coalesce_t  *co;
+
+    co = ev->data;
+    r = co->request;
+    u = r->upstream;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream coalesce handler: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "upstream coalesced request timed out");
+
+        if (co->leader) {
+            ngx_queue_remove(&co->queue);
+            co->leader = NULL;
+        }
+
+        if (co->event.posted) {
+            ngx_delete_posted_event(&co->event);
+        }
+
+        u->coalesce = NULL;
+
+        ngx_http_upstream_start(r, u);
+
+    } else if (co->header) {
+        ngx_http_upstream_coalesce_send(r, u);
+
+    } else if (co->leader == NULL) {
+
+        /*
+         * the leader failed to get a response or the response
+         * cannot be shared, go to the upstream on its own
+         */
+
+        u->coalesce = NULL;
+
+        ngx_http_upstream_start(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_coalesce_downstream(ngx_http_request_t *r)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    c->log->action = "sending to client";
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, r->upstream,
+                                           NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_coalesce_send(r, r->upstream);
+}
+
+
+static void
+ngx_http_upstream_coalesce_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                      rc;
+    ngx_connection_t              *c;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_upstream_coalesce_t  *co;
+
+    c = r->connection;
+    co = u->coalesce;
+
+    if (!u->header_sent) {
+
+        if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+            return;
+        }
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        u->header_sent = 1;
+
+        if (r->header_only) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        r->write_event_handler = ngx_http_upstream_coalesce_downstream;
+    }
+
+    if (co->out || co->busy || c->buffered) {
+        rc = ngx_http_output_filter(r, co->out);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        ngx_chain_update_chains(r->pool, &co->free, &co->busy, &co->out,
+                                (ngx_buf_tag_t) &ngx_http_upstream_module);
+        co->last = &co->out;
+    }
+
+    if (co->done) {
+        ngx_http_upstream_finalize_request(r, u, co->rc);
+        return;
+    }
+
+    if (c->data != r) {
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (c->write->active && !c->write->ready) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_coalesce_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_uint_t                      shared;
+    ngx_queue_t                    *q, *next;
+    ngx_http_upstream_coalesce_t   *co, *f;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    co = u->coalesce;
+
+    if (co->follower) {
+        return;
+    }
+
+    /* requests arriving from now on will not get the whole response */
+
+    if (co->linked) {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+        ngx_rbtree_delete(&umcf->coalesce, &co->node.node);
+        co->linked = 0;
+    }
+
+    if (ngx_queue_empty(&co->queue)) {
+        return;
+    }
+
+    /*
+     * followers are fed from the buffered response only,
+     * and personalized responses are not shared
+     */
+
+    shared = u->buffering && !u->upgrade
+             && ngx_http_upstream_coalesce_shared(u);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream coalesce header, shared:%ui", shared);
+
+    for (q = ngx_queue_head(&co->queue);
+         q != ngx_queue_sentinel(&co->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        f = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
+
+        if (f->event.timer_set) {
+            ngx_del_timer(&f->event);
+        }
+
+        if (!shared
+            || ngx_http_upstream_coalesce_copy_header(f->request, u) != NGX_OK)
+        {
+            /* the follower goes to the upstream on its own */
+
+            ngx_queue_remove(q);
+            f->leader = NULL;
+
+        } else {
+            f->header = 1;
+        }
+
+        ngx_post_event(&f->event, &ngx_posted_events);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_coalesce_shared(ngx_http_upstream_t *u)
+{
+    u_char            *start, *last;
+    ngx_uint_t         i;
+    ngx_table_elt_t  **ph;
+
+    if (u->headers_in.cookies.nelts || u->headers_in.vary) {
+        return 0;
+    }
+
+    ph = u->headers_in.cache_control.elts;
+
+    for (i = 0; i < u->headers_in.cache_control.nelts; i++) {
+
+        start = ph[i]->value.data;
+        last = start + ph[i]->value.len;
+
+        if (ngx_strlcasestrn(start, last, (u_char *) "no-store", 8 - 1) != NULL
+            || ngx_strlcasestrn(start, last, (u_char *) "private", 7 - 1)
+               != NULL)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_coalesce_copy_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *leader)
+{
+    size_t                          len;
+    ngx_uint_t                      i;
+    ngx_list_part_t                *part;
+    ngx_table_elt_t                *h, *ho;
+    ngx_http_upstream_t            *u;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    /*
+     * the leader's response header is copied to the follower's pool
+     * and processed by the same handlers as if it was got from upstream
+     */
+
+    u = r->upstream;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    part = &leader->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        ho = ngx_list_push(&u->headers_in.headers);
+        if (ho == NULL) {
+            return NGX_ERROR;
+        }
+
+        ho->hash = h[i].hash;
+        ho->key.len = h[i].key.len;
+        ho->value.len = h[i].value.len;
+
+        len = ho->key.len + 1 + ho->value.len + 1 + ho->key.len;
+
+        ho->key.data = ngx_pnalloc(r->pool, len);
+        if (ho->key.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ho->lowcase_key = ho->key.data + ho->key.len + 1 + ho->value.len + 1;
+
+        ngx_memcpy(ho->key.data, h[i].key.data, ho->key.len);
+        ho->key.data[ho->key.len] = '\0';
+
+        if (h[i].value.data) {
+            ho->value.data = ho->key.data + ho->key.len + 1;
+            ngx_memcpy(ho->value.data, h[i].value.data, ho->value.len);
+            ho->value.data[ho->value.len] = '\0';
+
+        } else {
+            ho->value.data = NULL;
+        }
+
+        ngx_memcpy(ho->lowcase_key, h[i].lowcase_key, ho->key.len);
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, ho->hash,
+                           ho->lowcase_key, ho->key.len);
+
+        if (hh && hh->handler(r, ho, hh->offset) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    u->headers_in.status_n = leader->headers_in.status_n;
+    u->headers_in.content_length_n = leader->headers_in.content_length_n;
+    u->headers_in.chunked = leader->headers_in.chunked;
+
+    if (leader->headers_in.status_line.len) {
+        u->headers_in.status_line.len = leader->headers_in.status_line.len;
+        u->headers_in.status_line.data = ngx_pstrdup(r->pool,
+                                            &leader->headers_in.status_line);
+        if (u->headers_in.status_line.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (u->state) {
+        u->state->status = u->headers_in.status_n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_coalesce_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    ngx_chain_t         **ll;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    r = p->output_ctx;
+    u = r->upstream;
+
+    /*
+     * the data are passed to followers as soon as they are read,
+     * before the leader's buffers may go to a temporary file
+     */
+
+    ll = p->in ? p->last_in : &p->in;
+
+    if (u->coalesce->input_filter(p, buf) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_coalesce_body(r, u, *ll);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_coalesce_body(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_chain_t *in)
+{
+    size_t                         size, limit;
+    ngx_int_t                      rc;
+    ngx_chain_t                   *cl;
+    ngx_queue_t                   *q, *next;
+    ngx_http_upstream_coalesce_t  *co, *f;
+
+    co = u->coalesce;
+
+    if (ngx_queue_empty(&co->queue)) {
+        return;
+    }
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        if (ngx_buf_in_memory(cl->buf)) {
+            size += cl->buf->last - cl->buf->pos;
+        }
+    }
+
+    if (size == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream coalesce body: %uz", size);
+
+    limit = u->conf->bufs.num * u->conf->bufs.size;
+
+    for (q = ngx_queue_head(&co->queue);
+         q != ngx_queue_sentinel(&co->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        f = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
+
+        /*
+         * the leader never waits for a follower: a follower whose client
+         * does not accept more data while the data of the previous reads
+         * is still pending is detached
+         */
+
+        if (!f->request->connection->write->ready
+            && ngx_http_upstream_coalesce_backlog(f) > limit)
+        {
+            ngx_log_error(NGX_LOG_INFO, f->request->connection->log, 0,
+                          "client is too slow for coalesced response");
+            rc = NGX_ERROR;
+
+        } else {
+            rc = ngx_http_upstream_coalesce_copy_body(f, in,
+                                                      u->conf->buffer_size);
+        }
+
+        if (rc != NGX_OK) {
+            ngx_queue_remove(q);
+            f->leader = NULL;
+            f->done = 1;
+            f->rc = NGX_ERROR;
+
+            f->out = NULL;
+            f->last = &f->out;
+        }
+
+        ngx_post_event(&f->event, &ngx_posted_events);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_coalesce_copy_body(ngx_http_upstream_coalesce_t *co,
+    ngx_chain_t *in, size_t size)
+{
+    size_t        n;
+    u_char       *pos;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *tl;
+
+    /*
+     * data are copied to the follower's own buffers of "buffer_size",
+     * the buffers are reused once sent to the client
+     */
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            continue;
+        }
+
+        pos = cl->buf->pos;
+
+        while (pos < cl->buf->last) {
+
+            tl = ngx_chain_get_free_buf(co->request->pool, &co->free);
+            if (tl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = tl->buf;
+
+            if (b->start == NULL) {
+                b->start = ngx_palloc(co->request->pool, size);
+                if (b->start == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->end = b->start + size;
+                b->temporary = 1;
+                b->tag = (ngx_buf_tag_t) &ngx_http_upstream_module;
+            }
+
+            n = ngx_min((size_t) (cl->buf->last - pos),
+                        (size_t) (b->end - b->start));
+
+            b->pos = b->start;
+            b->last = ngx_cpymem(b->start, pos, n);
+
+            pos += n;
+
+            *co->last = tl;
+            co->last = &tl->next;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_upstream_coalesce_backlog(ngx_http_upstream_coalesce_t *co)
+{
+    size_t        size;
+    ngx_chain_t  *cl;
+
+    size = 0;
 
-            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
-            return;
-        }
+    for (cl = co->out; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
 
-        // OzXgd|
-        ctx->name = *host;
-        // OɐɌĂяonhd|
-        ctx->handler = ngx_http_upstream_resolve_handler;
-        // X^u]oZbg
-        ctx->data = r;
-        // ^CAEgZbg
-        ctx->timeout = clcf->resolver_timeout;
+    for (cl = co->busy; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
 
-        u->resolved->ctx = ctx;
+    return size;
+}
 
-        // X^u]oW[ŖO
-        if (ngx_resolve_name(ctx) != NGX_OK) {
-            u->resolved->ctx = NULL;
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
+
+static void
+ngx_http_upstream_coalesce_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_int_t rc)
+{
+    ngx_queue_t                    *q;
+    ngx_http_upstream_coalesce_t   *co, *f;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    co = u->coalesce;
+    u->coalesce = NULL;
+
+    if (co->follower) {
+
+        if (co->leader) {
+            ngx_queue_remove(&co->queue);
+            co->leader = NULL;
         }
 
-        return;
-    }
+        if (co->event.timer_set) {
+            ngx_del_timer(&co->event);
+        }
 
-found:
+        if (co->event.posted) {
+            ngx_delete_posted_event(&co->event);
+        }
 
-    if (uscf == NULL) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "no upstream configuration");
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    u->upstream = uscf;
+    if (co->linked) {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+        ngx_rbtree_delete(&umcf->coalesce, &co->node.node);
+        co->linked = 0;
+    }
 
-#if (NGX_HTTP_SSL)
-    u->ssl_name = uscf->host;
-#endif
+    /*
+     * followers which got the response header are finalized along with
+     * the leader, others go to the upstream on their own
+     */
 
-    if (uscf->peer.init(r, uscf) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
-    }
+    while (!ngx_queue_empty(&co->queue)) {
+        q = ngx_queue_head(&co->queue);
+        f = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
 
-    u->peer.start_time = ngx_current_msec;
+        ngx_queue_remove(q);
+        f->leader = NULL;
 
-    if (u->conf->next_upstream_tries
-        && u->peer.tries > u->conf->next_upstream_tries)
-    {
-        u->peer.tries = u->conf->next_upstream_tries;
-    }
+        if (f->event.timer_set) {
+            ngx_del_timer(&f->event);
+        }
 
-    ngx_http_upstream_connect(r, u);
+        if (f->header) {
+            f->done = 1;
+            f->rc = (rc == NGX_OK) ? NGX_OK : NGX_ERROR;
+        }
+
+        ngx_post_event(&f->event, &ngx_posted_events);
+    }
 }
 
 
@@ -878,6 +1693,11 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         /* TODO: add keys */
 
+        if (u->conf->cache_partial) {
+            r->cache->partial = 1;
+            r->cache->partial_block = u->conf->cache_partial;
+        }
+
         ngx_http_file_cache_create_key(r);
 
         if (r->cache->header_start + 256 > u->conf->buffer_size) {
@@ -1014,7 +1834,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+    if (c->partial) {
+        ngx_http_file_cache_partial_range(r);
+
+    } else if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
         u->cacheable = 0;
     }
 
@@ -1112,6 +1935,10 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->partial && ngx_http_upstream_cache_partial(r, u) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1159,6 +1986,33 @@ ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_partial(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    switch (ngx_http_file_cache_partial_header(r)) {
+
+    case NGX_ERROR:
+        return NGX_ERROR;
+
+    case NGX_DECLINED:
+        u->cacheable = 0;
+        return NGX_OK;
+
+    case NGX_DONE:
+        u->cacheable = 0;
+
+        /* fall through */
+
+    default: /* NGX_OK */
+
+        /* a part of the body is cached as the whole response */
+
+        u->headers_in.status_n = NGX_HTTP_OK;
+        return NGX_OK;
+    }
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -1379,7 +2233,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             }
         }
 
-        if (!u->cacheable) {
+        if (!u->cacheable && !ngx_http_upstream_coalescing(u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1408,7 +2262,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             ev->error = 1;
         }
 
-        if (!u->cacheable && u->peer.connection) {
+        if (!u->cacheable && u->peer.connection
+            && !ngx_http_upstream_coalescing(u))
+        {
             ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
                           "kevent() reported that client prematurely closed "
                           "connection, so upstream connection is closed too");
@@ -1421,7 +2277,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
                       "kevent() reported that client prematurely closed "
                       "connection");
 
-        if (u->peer.connection == NULL) {
+        if (u->peer.connection == NULL && !ngx_http_upstream_coalescing(u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1461,7 +2317,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             ev->error = 1;
         }
 
-        if (!u->cacheable && u->peer.connection) {
+        if (!u->cacheable && u->peer.connection
+            && !ngx_http_upstream_coalescing(u))
+        {
             ngx_log_error(NGX_LOG_INFO, ev->log, err,
                         "epoll_wait() reported that client prematurely closed "
                         "connection, so upstream connection is closed too");
@@ -1474,7 +2332,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
                       "epoll_wait() reported that client prematurely closed "
                       "connection");
 
-        if (u->peer.connection == NULL) {
+        if (u->peer.connection == NULL && !ngx_http_upstream_coalescing(u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1524,7 +2382,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ev->eof = 1;
     c->error = 1;
 
-    if (!u->cacheable && u->peer.connection) {
+    if (!u->cacheable && u->peer.connection
+        && !ngx_http_upstream_coalescing(u))
+    {
         ngx_log_error(NGX_LOG_INFO, ev->log, err,
                       "client prematurely closed connection, "
                       "so upstream connection is closed too");
@@ -1536,7 +2396,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ngx_log_error(NGX_LOG_INFO, ev->log, err,
                   "client prematurely closed connection");
 
-    if (u->peer.connection == NULL) {
+    if (u->peer.connection == NULL && !ngx_http_upstream_coalescing(u)) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_CLIENT_CLOSED_REQUEST);
     }
@@ -2478,6 +3338,17 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->partial
+        && ngx_http_upstream_cache_partial(r, u) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+#endif
+
     ngx_http_upstream_send_response(r, u);
 }
 
@@ -2950,11 +3821,22 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
+    if (u->coalesce) {
+        ngx_http_upstream_coalesce_header(r, u);
+    }
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
-        ngx_http_upstream_finalize_request(r, u, rc);
-        return;
+
+        if (rc != NGX_ERROR || !ngx_http_upstream_coalescing(u)) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        /* the response is still read for the followers */
+
+        u->pipe->downstream_error = 1;
     }
 
     u->header_sent = 1;
@@ -2982,7 +3864,7 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
-        if (!u->cacheable && !u->store) {
+        if (!u->cacheable && !u->store && !ngx_http_upstream_coalescing(u)) {
             ngx_http_upstream_finalize_request(r, u, rc);
             return;
         }
@@ -3279,6 +4161,11 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+    if (ngx_http_upstream_coalescing(u)) {
+        u->coalesce->input_filter = p->input_filter;
+        p->input_filter = ngx_http_upstream_coalesce_input_filter;
+    }
+
     u->read_event_handler = ngx_http_upstream_process_upstream;
     r->write_event_handler = ngx_http_upstream_process_downstream;
 
@@ -4098,7 +4985,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http upstream downstream error");
 
-        if (!u->cacheable && !u->store && u->peer.connection) {
+        if (!u->cacheable && !u->store && u->peer.connection
+            && !ngx_http_upstream_coalescing(u))
+        {
             ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
         }
     }
@@ -4380,6 +5269,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->coalesce) {
+        ngx_http_upstream_coalesce_finalize(r, u, rc);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -5704,6 +6597,151 @@ ngx_http_upstream_cache_status(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    if (r->upstream == NULL || r->cache == NULL || !r->cached) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (r->cache->memory) {
+        ngx_str_set(v, "memory");
+
+    } else {
+        ngx_str_set(v, "disk");
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                 *p;
+    ngx_atomic_uint_t       n;
+    ngx_http_file_cache_t  *cache;
+
+    if (r->cache == NULL || r->cache->file_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    cache = r->cache->file_cache;
+
+    n = *(ngx_atomic_t *) ((char *) cache->sh + data);
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uA", n) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_latency(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                 *p, *last;
+    ngx_uint_t              i;
+    ngx_atomic_t           *buckets;
+    ngx_http_file_cache_t  *cache;
+
+    if (r->cache == NULL || r->cache->file_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    cache = r->cache->file_cache;
+
+    buckets = (ngx_atomic_t *) ((char *) cache->sh + data);
+
+    /* counts of the 100us, 1ms, 10ms, 100ms, 1s, and longer buckets */
+
+    p = ngx_pnalloc(r->pool,
+                    NGX_HTTP_CACHE_OPEN_BUCKETS * (NGX_ATOMIC_T_LEN + 1));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = p;
+
+    for (i = 0; i < NGX_HTTP_CACHE_OPEN_BUCKETS; i++) {
+        if (i) {
+            *last++ = ' ';
+        }
+
+        last = ngx_sprintf(last, "%uA", buckets[i]);
+    }
+
+    v->len = last - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (r->upstream == NULL
+        || r->upstream->cache_status == NGX_HTTP_CACHE_BYPASS
+        || c == NULL
+        || !c->partial
+        || r->cached
+        || c->partial_end == 0)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (c->partial_end == -1) {
+        v->len = ngx_sprintf(p, "bytes=%O-", c->partial_start) - p;
+
+    } else {
+        v->len = ngx_sprintf(p, "bytes=%O-%O", c->partial_start,
+                             c->partial_end - 1)
+                 - p;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -5893,10 +6931,10 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_upstream_srv_conf_t  *uscf = conf;
 
     time_t                       fail_timeout;
-    ngx_str_t                   *value, s;
+    ngx_str_t                   *value, s, service;
     ngx_url_t                    u;
     ngx_int_t                    weight, max_conns, max_fails;
-    ngx_uint_t                   i;
+    ngx_uint_t                   i, resolve;
     ngx_http_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -5912,6 +6950,8 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    resolve = 0;
+    ngx_str_null(&service);
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -6000,13 +7040,38 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            service.len = value[i].len - 8;
+            service.data = &value[i].data[8];
+
+            if (service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         goto invalid;
     }
 
+    if (service.len && !resolve) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires "
+                           "\"resolve\" parameter", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
     u.default_port = 80;
+    u.no_resolve = resolve;
 
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
@@ -6017,6 +7082,38 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (resolve && u.naddrs == 0) {
+
+        /* the name is resolved at run time */
+
+        if (service.len && !u.no_port) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" may not have port",
+                               &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        us->host = u.host;
+        us->service = service;
+        us->port = u.port;
+        us->resolve = 1;
+
+        if (service.len == 0) {
+
+            /* addresses known at startup are used until the first update */
+
+            if (ngx_inet_resolve_host(cf->pool, &u) != NGX_OK) {
+                u.naddrs = 0;
+            }
+        }
+
+    } else if (service.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires a domain name",
+                           &u.url);
+        return NGX_CONF_ERROR;
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -6609,5 +7706,8 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ngx_rbtree_init(&umcf->coalesce, &umcf->coalesce_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return NGX_CONF_OK;
 }
@@ -74,6 +74,9 @@ typedef struct {
     ngx_hash_t                       headers_in_hash;
     ngx_array_t                      upstreams;
                                              /* ngx_http_upstream_srv_conf_t */
+
+    ngx_rbtree_t                     coalesce;
+    ngx_rbtree_node_t                coalesce_sentinel;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -102,7 +105,12 @@ typedef struct {
     ngx_msec_t                       slow_start;
     ngx_uint_t                       down;
 
+    ngx_str_t                        host;
+    ngx_str_t                        service;
+    in_port_t                        port;
+
     unsigned                         backup:1;
+    unsigned                         resolve:1;
 
     NGX_COMPAT_BEGIN(6)
     NGX_COMPAT_END
@@ -229,6 +237,10 @@ typedef struct {
     // 0
     ngx_flag_t                       socket_keepalive;
 
+    ngx_flag_t                       coalesce;
+    ngx_msec_t                       coalesce_timeout;
+    ngx_http_complex_value_t        *coalesce_key;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
     ngx_http_complex_value_t        *cache_value;
@@ -238,6 +250,7 @@ typedef struct {
     ngx_uint_t                       cache_methods;
 
     off_t                            cache_max_range_offset;
+    size_t                           cache_partial;
 
     // 0
     ngx_flag_t                       cache_lock;
@@ -366,6 +379,34 @@ typedef struct {
 typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
+typedef struct ngx_http_upstream_coalesce_s  ngx_http_upstream_coalesce_t;
+
+struct ngx_http_upstream_coalesce_s {
+    ngx_str_node_t                   node;
+
+    /* the leader's followers, or the link in the leader's queue */
+    ngx_queue_t                      queue;
+
+    ngx_http_request_t              *request;
+    ngx_http_upstream_coalesce_t    *leader;
+
+    ngx_chain_t                     *out;
+    ngx_chain_t                    **last;
+    ngx_chain_t                     *free;
+    ngx_chain_t                     *busy;
+
+    ngx_event_t                      event;
+    ngx_int_t                        rc;
+
+    /* the leader's original pipe input filter */
+    ngx_event_pipe_input_filter_pt   input_filter;
+
+    unsigned                         follower:1;
+    unsigned                         linked:1;
+    unsigned                         header:1;
+    unsigned                         done:1;
+};
+
 
 struct ngx_http_upstream_s {
     ngx_http_upstream_handler_pt     read_event_handler;
@@ -449,6 +490,8 @@ struct ngx_http_upstream_s {
 
     ngx_http_cleanup_pt             *cleanup;
 
+    ngx_http_upstream_coalesce_t    *coalesce;
+
     unsigned                         store:1;
     unsigned                         cacheable:1;
     // 1
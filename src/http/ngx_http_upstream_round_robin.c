@@ -17,6 +17,9 @@
 
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
+static ngx_http_upstream_host_t *ngx_http_upstream_init_host(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_server_t *server,
+    ngx_http_upstream_rr_peers_t *peers);
 
 #if (NGX_HTTP_SSL)
 
@@ -33,7 +36,8 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n, w;
+    ngx_uint_t                     i, j, n, r, w;
+    ngx_http_upstream_host_t      *host;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
@@ -44,6 +48,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         server = us->servers->elts;
 
         n = 0;
+        r = 0;
         w = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
@@ -53,9 +58,13 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
+
+            if (server[i].resolve) {
+                r++;
+            }
         }
 
-        if (n == 0) {
+        if (n == 0 && r == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no servers in upstream \"%V\" in %s:%ui",
                           &us->host, us->file_name, us->line);
@@ -86,6 +95,15 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 continue;
             }
 
+            host = NULL;
+
+            if (server[i].resolve) {
+                host = ngx_http_upstream_init_host(cf, us, &server[i], peers);
+                if (host == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
             for (j = 0; j < server[i].naddrs; j++) {
                 peer[n].sockaddr = server[i].addrs[j].sockaddr;
                 peer[n].socklen = server[i].addrs[j].socklen;
@@ -98,6 +116,9 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+                peer[n].host = host;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -110,6 +131,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         /* backup servers */
 
         n = 0;
+        r = 0;
         w = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
@@ -119,9 +141,13 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
+
+            if (server[i].resolve) {
+                r++;
+            }
         }
 
-        if (n == 0) {
+        if (n == 0 && r == 0) {
             return NGX_OK;
         }
 
@@ -150,6 +176,15 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 continue;
             }
 
+            host = NULL;
+
+            if (server[i].resolve) {
+                host = ngx_http_upstream_init_host(cf, us, &server[i], backup);
+                if (host == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
             for (j = 0; j < server[i].naddrs; j++) {
                 peer[n].sockaddr = server[i].addrs[j].sockaddr;
                 peer[n].socklen = server[i].addrs[j].socklen;
@@ -162,6 +197,9 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+                peer[n].host = host;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -241,6 +279,72 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 }
 
 
+static ngx_http_upstream_host_t *
+ngx_http_upstream_init_host(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us,
+    ngx_http_upstream_server_t *server, ngx_http_upstream_rr_peers_t *peers)
+{
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    struct sockaddr_in            *sin;
+    ngx_http_upstream_host_t      *host;
+    ngx_http_upstream_rr_peer_t   *peer;
+
+    if (us->shm_zone == NULL) {
+        goto no_zone;
+    }
+
+    host = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_host_t));
+    if (host == NULL) {
+        return NULL;
+    }
+
+    peer = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_rr_peer_t));
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    /* the template keeps the port in a wildcard address */
+
+    sin = ngx_pcalloc(cf->pool, sizeof(struct sockaddr_in));
+    if (sin == NULL) {
+        return NULL;
+    }
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(server->port);
+
+    peer->sockaddr = (struct sockaddr *) sin;
+    peer->socklen = sizeof(struct sockaddr_in);
+    peer->server = server->name;
+    peer->weight = server->weight;
+    peer->effective_weight = server->weight;
+    peer->max_conns = server->max_conns;
+    peer->max_fails = server->max_fails;
+    peer->fail_timeout = server->fail_timeout;
+    peer->down = server->down;
+    peer->host = host;
+
+    peer->next = peers->resolve;
+    peers->resolve = peer;
+
+    host->name = server->host;
+    host->service = server->service;
+    host->peers = peers;
+    host->peer = peer;
+
+    return host;
+
+no_zone:
+#endif
+
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "resolving names at run time requires "
+                  "upstream \"%V\" in %s:%ui to be in shared memory",
+                  &us->host, us->file_name, us->line);
+
+    return NULL;
+}
+
+
 ngx_int_t
 ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
@@ -261,7 +365,14 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 
     rrp->peers = us->peer.data;
     rrp->current = NULL;
+
+    ngx_http_upstream_rr_peers_rlock(rrp->peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    rrp->config = rrp->peers->config ? *rrp->peers->config : 0;
+#else
     rrp->config = 0;
+#endif
 
     n = rrp->peers->number;
 
@@ -269,6 +380,10 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
         n = rrp->peers->next->number;
     }
 
+    r->upstream->peer.tries = ngx_http_upstream_tries(rrp->peers);
+
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
     if (n <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
         rrp->data = 0;
@@ -284,7 +399,6 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 
     r->upstream->peer.get = ngx_http_upstream_get_round_robin_peer;
     r->upstream->peer.free = ngx_http_upstream_free_round_robin_peer;
-    r->upstream->peer.tries = ngx_http_upstream_tries(rrp->peers);
 #if (NGX_HTTP_SSL)
     r->upstream->peer.set_session =
                                ngx_http_upstream_set_round_robin_peer_session;
@@ -456,6 +570,10 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     // 炭AEhr͑SXbhLȂ̂ŃbNKv
     ngx_http_upstream_rr_peers_wlock(peers);
 
+    if (ngx_http_upstream_rr_peers_changed(rrp)) {
+        goto busy;
+    }
+
     if (peers->single) {
         // tH[hvLV^pȂAʂ͂
         peer = peers->peer;
@@ -528,6 +646,8 @@ failed:
         ngx_http_upstream_rr_peers_wlock(peers);
     }
 
+busy:
+
     ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
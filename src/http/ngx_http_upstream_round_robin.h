@@ -15,6 +15,8 @@
 
 
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
+typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
+typedef struct ngx_http_upstream_host_s      ngx_http_upstream_host_t;
 
 struct ngx_http_upstream_rr_peer_s {
     // ̃sÃAhXE|[g
@@ -44,6 +46,9 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_uint_t                      response_time;
+    ngx_msec_t                      response_time_updated;
+
     // ÃsA_EĎgpłȂǂ
     ngx_uint_t                      down;
 
@@ -54,6 +59,11 @@ struct ngx_http_upstream_rr_peer_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_atomic_t                    lock;
+
+    ngx_uint_t                      check_fails;
+    ngx_uint_t                      check_passes;
+
+    ngx_http_upstream_host_t       *host;
 #endif
 
     ngx_http_upstream_rr_peer_t    *next;
@@ -63,8 +73,6 @@ struct ngx_http_upstream_rr_peer_s {
 };
 
 
-typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
-
 // ƂAbvXg[T[o\
 struct ngx_http_upstream_rr_peers_s {
     // sAQ̐
@@ -74,6 +82,9 @@ struct ngx_http_upstream_rr_peers_s {
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
     ngx_http_upstream_rr_peers_t   *zone_next;
+    ngx_msec_t                      next_check;
+    ngx_uint_t                     *config;
+    ngx_http_upstream_rr_peer_t    *resolve;
 #endif
 
     // ׂẴsÃEFCg̍v
@@ -96,6 +107,36 @@ struct ngx_http_upstream_rr_peers_s {
 };
 
 
+/*
+ * peer->down is NGX_HTTP_UPSTREAM_PEER_DOWN for a server marked "down"
+ * in the configuration; active health checks set a separate bit, so
+ * balancers testing peer->down skip both
+ */
+
+#define NGX_HTTP_UPSTREAM_PEER_DOWN      0x01
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY 0x02
+
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+/*
+ * a server with the "resolve" parameter; its addresses are kept as
+ * regular peers with peer->host set, and peer is a template they are
+ * created from when the name is resolved again; peers removed while
+ * still in use wait in the zombies list
+ */
+
+struct ngx_http_upstream_host_s {
+    ngx_str_t                       name;
+    ngx_str_t                       service;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peer_t    *zombies;
+};
+
+#endif
+
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
 
 #define ngx_http_upstream_rr_peers_rlock(peers)                               \
@@ -129,6 +170,12 @@ struct ngx_http_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+
+/* peers were added or removed since the request started */
+
+#define ngx_http_upstream_rr_peers_changed(rrp)                               \
+    ((rrp)->peers->config && (rrp)->config != *(rrp)->peers->config)
+
 #else
 
 #define ngx_http_upstream_rr_peers_rlock(peers)
@@ -136,6 +183,7 @@ struct ngx_http_upstream_rr_peers_s {
 #define ngx_http_upstream_rr_peers_unlock(peers)
 #define ngx_http_upstream_rr_peer_lock(peers, peer)
 #define ngx_http_upstream_rr_peer_unlock(peers, peer)
+#define ngx_http_upstream_rr_peers_changed(rrp)  0
 
 #endif
 
@@ -168,6 +168,7 @@ static ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_cookie(ngx_http_request_t *r,
     ngx_http_v2_header_t *header);
 static ngx_int_t ngx_http_v2_construct_cookie_header(ngx_http_request_t *r);
+static void ngx_http_v2_priority(ngx_http_request_t *r, ngx_str_t *value);
 static void ngx_http_v2_run_request(ngx_http_request_t *r);
 static void ngx_http_v2_run_request_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
@@ -189,6 +190,8 @@ static ngx_int_t ngx_http_v2_adjust_windows(ngx_http_v2_connection_t *h2c,
 static void ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_node_t *node, ngx_uint_t depend, ngx_uint_t exclusive);
 static void ngx_http_v2_node_children_update(ngx_http_v2_node_t *node);
+static ngx_int_t ngx_http_v2_node_rank(ngx_http_v2_node_t *node,
+    ngx_uint_t rank);
 
 static void ngx_http_v2_pool_cleanup(void *data);
 
@@ -271,6 +274,10 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
 
+    h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.free = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.limit = NGX_HTTP_V2_TABLE_SIZE;
+
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
@@ -440,7 +447,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if ((h2c->last_out || h2c->out_urgencies)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -479,7 +488,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (h2c->last_out == NULL && h2c->out_urgencies == 0 && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -529,6 +538,8 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
+    ngx_http_v2_dequeue_frames(h2c);
+
     cl = NULL;
     out = NULL;
 
@@ -600,6 +611,8 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
 
     h2c->last_out = frame;
 
+    ngx_http_v2_requeue_frames(h2c);
+
     if (!wev->ready) {
         ngx_add_timer(wev, clcf->send_timeout);
         return NGX_AGAIN;
@@ -630,7 +643,9 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t        *c;
     ngx_http_v2_srv_conf_t  *h2scf;
 
-    if (h2c->last_out || h2c->processing || h2c->pushing) {
+    if (h2c->last_out || h2c->out_urgencies || h2c->processing
+        || h2c->pushing)
+    {
         return;
     }
 
@@ -1195,6 +1210,8 @@ ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
         ngx_http_v2_set_dependency(h2c, node, depend, excl);
     }
 
+    stream->urgency = node->urgency;
+
     if (h2c->connection->requests >= h2scf->max_requests) {
         h2c->goaway = 1;
 
@@ -1559,6 +1576,7 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
     ngx_http_core_main_conf_t  *cmcf;
 
     static ngx_str_t cookie = ngx_string("cookie");
+    static ngx_str_t priority = ngx_string("priority");
 
     header = &h2c->state.header;
 
@@ -1696,6 +1714,12 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
         if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
             goto error;
         }
+
+        if (header->name.len == priority.len
+            && ngx_memcmp(header->name.data, priority.data, priority.len) == 0)
+        {
+            ngx_http_v2_priority(r, &header->value);
+        }
     }
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -2097,6 +2121,13 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
+            value = ngx_min(value, NGX_HTTP_V2_TABLE_SIZE);
+
+            if (!h2c->table_update || value < h2c->hpack_enc.update) {
+                h2c->hpack_enc.update = value;
+            }
+
+            h2c->hpack_enc.limit = value;
             h2c->table_update = 1;
             break;
 
@@ -2604,6 +2635,8 @@ ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path)
     node->weight = NGX_HTTP_V2_DEFAULT_WEIGHT;
     ngx_http_v2_set_dependency(h2c, node, parent->node->id, 0);
 
+    stream->urgency = node->urgency;
+
     r->method_name = ngx_http_core_get_method;
     r->method = NGX_HTTP_GET;
 
@@ -3213,13 +3246,11 @@ ngx_http_v2_get_closed_node(ngx_http_v2_connection_t *h2c)
 
     if (parent == NGX_HTTP_V2_ROOT) {
         node->rank = 0;
-        node->rel_weight = 1.0;
 
         children = &h2c->dependencies;
 
     } else {
         node->rank = parent->rank;
-        node->rel_weight = parent->rel_weight;
 
         children = &parent->children;
     }
@@ -3647,6 +3678,49 @@ ngx_http_v2_cookie(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 }
 
 
+static void
+ngx_http_v2_priority(ngx_http_request_t *r, ngx_str_t *value)
+{
+    u_char                *p, *end;
+    ngx_http_v2_stream_t  *stream;
+
+    /* the "u" parameter of the RFC 9218 "priority" header, "i" is ignored */
+
+    stream = r->stream;
+
+    if (stream->queued) {
+        return;
+    }
+
+    p = value->data;
+    end = p + value->len;
+
+    while (p < end) {
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        if (end - p >= 3 && p[0] == 'u' && p[1] == '='
+            && p[2] >= '0' && p[2] <= '7'
+            && (end - p == 3 || p[3] == ',' || p[3] == ';'
+                || p[3] == ' ' || p[3] == '\t'))
+        {
+            stream->urgency = p[2] - '0';
+            stream->priority = 1;
+        }
+
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 priority sid:%ui urgency:%ui",
+                   stream->node->id, (ngx_uint_t) stream->urgency);
+}
+
+
 static ngx_int_t
 ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 {
@@ -4454,7 +4528,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if ((h2c->last_out || h2c->out_urgencies)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4560,6 +4636,9 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    ngx_memzero(h2c->out_queue, sizeof(h2c->out_queue));
+    h2c->out_urgencies = 0;
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
@@ -4685,8 +4764,7 @@ ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
             exclusive = 0;
         }
 
-        node->rank = 1;
-        node->rel_weight = (1.0 / 256) * node->weight;
+        (void) ngx_http_v2_node_rank(node, 1);
 
         children = &h2c->dependencies;
 
@@ -4707,13 +4785,11 @@ ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
                 parent->parent = node->parent;
 
                 if (node->parent == NGX_HTTP_V2_ROOT) {
-                    parent->rank = 1;
-                    parent->rel_weight = (1.0 / 256) * parent->weight;
+                    (void) ngx_http_v2_node_rank(parent, 1);
 
                 } else {
-                    parent->rank = node->parent->rank + 1;
-                    parent->rel_weight = (node->parent->rel_weight / 256)
-                                         * parent->weight;
+                    (void) ngx_http_v2_node_rank(parent,
+                                                 node->parent->rank + 1);
                 }
 
                 if (!exclusive) {
@@ -4724,8 +4800,7 @@ ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
             }
         }
 
-        node->rank = parent->rank + 1;
-        node->rel_weight = (parent->rel_weight / 256) * node->weight;
+        (void) ngx_http_v2_node_rank(node, parent->rank + 1);
 
         if (parent->stream == NULL) {
             ngx_queue_remove(&parent->reuse);
@@ -4772,11 +4847,40 @@ ngx_http_v2_node_children_update(ngx_http_v2_node_t *node)
     {
         child = ngx_queue_data(q, ngx_http_v2_node_t, queue);
 
-        child->rank = node->rank + 1;
-        child->rel_weight = (node->rel_weight / 256) * child->weight;
+        if (ngx_http_v2_node_rank(child, node->rank + 1) == NGX_OK) {
+            ngx_http_v2_node_children_update(child);
+        }
+    }
+}
+
+
+/*
+ * Ranks are limited by the number of urgency levels: a subtree is
+ * only walked while the rank or the urgency of its root changes, so
+ * reprioritizing a stream in a long dependency chain, as some clients
+ * build, does not update the whole chain.  The urgency is derived from
+ * the depth of the node and its weight, the default weight of a stream
+ * that depends on the root maps to the default urgency.
+ */
+
+static ngx_int_t
+ngx_http_v2_node_rank(ngx_http_v2_node_t *node, ngx_uint_t rank)
+{
+    ngx_uint_t  urgency;
+
+    rank = ngx_min(rank, NGX_HTTP_V2_URGENCY_LEVELS);
 
-        ngx_http_v2_node_children_update(child);
+    urgency = ngx_min(rank - 1 + (256 - node->weight) / 64,
+                      NGX_HTTP_V2_URGENCY_LEVELS - 1);
+
+    if (node->rank == rank && node->urgency == urgency) {
+        return NGX_DECLINED;
     }
+
+    node->rank = rank;
+    node->urgency = urgency;
+
+    return NGX_OK;
 }
 
 
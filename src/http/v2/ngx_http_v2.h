@@ -54,6 +54,12 @@
 
 #define NGX_HTTP_V2_DEFAULT_WEIGHT       16
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_TABLE_ENTRIES        (NGX_HTTP_V2_TABLE_SIZE / 32)
+
+#define NGX_HTTP_V2_URGENCY_LEVELS       8
+#define NGX_HTTP_V2_DEFAULT_URGENCY      3
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -70,6 +76,12 @@ typedef struct {
 } ngx_http_v2_header_t;
 
 
+typedef struct {
+    ngx_http_v2_out_frame_t         *first;
+    ngx_http_v2_out_frame_t         *last;
+} ngx_http_v2_out_queue_t;
+
+
 typedef struct {
     ngx_uint_t                       sid;
     size_t                           length;
@@ -115,6 +127,30 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       name_hash;
+    ngx_uint_t                       hash;
+    size_t                           name_len;
+    size_t                           value_len;
+    u_char                          *data;
+} ngx_http_v2_table_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_table_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           limit;
+    size_t                           update;
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -141,6 +177,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -151,6 +188,9 @@ struct ngx_http_v2_connection_s {
 
     ngx_http_v2_out_frame_t         *last_out;
 
+    ngx_http_v2_out_queue_t          out_queue[NGX_HTTP_V2_URGENCY_LEVELS];
+    ngx_uint_t                       out_urgencies;
+
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
 
@@ -175,7 +215,7 @@ struct ngx_http_v2_node_s {
     ngx_queue_t                      reuse;
     ngx_uint_t                       rank;
     ngx_uint_t                       weight;
-    double                           rel_weight;
+    ngx_uint_t                       urgency;
     ngx_http_v2_stream_t            *stream;
 };
 
@@ -216,6 +256,8 @@ struct ngx_http_v2_stream_s {
     unsigned                         rst_sent:1;
     unsigned                         no_flow_control:1;
     unsigned                         skip_data:1;
+    unsigned                         urgency:3;
+    unsigned                         priority:1;
 };
 
 
@@ -234,29 +276,94 @@ struct ngx_http_v2_out_frame_s {
 };
 
 
+/*
+ * Stream frames are scheduled in per-urgency FIFO queues and moved
+ * to the output list only when it is sent, so queueing a frame does
+ * not depend on the number of frames already queued.  The urgency
+ * of a stream is only changed while it has no frames queued, thus
+ * its frames are never reordered.
+ */
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_v2_out_queue_t  *q;
 
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    stream = frame->stream;
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
+    if (stream->queued == 0 && !stream->priority) {
+        stream->urgency = stream->node->urgency;
+    }
+
+    q = &h2c->out_queue[stream->urgency];
+
+    frame->next = NULL;
+
+    if (q->first == NULL) {
+        q->first = frame;
+        h2c->out_urgencies |= 1 << stream->urgency;
+
+    } else {
+        q->last->next = frame;
+    }
+
+    q->last = frame;
+}
+
+
+static ngx_inline void
+ngx_http_v2_dequeue_frames(ngx_http_v2_connection_t *h2c)
+{
+    ngx_uint_t                urgency;
+    ngx_http_v2_out_frame_t  *frame, *next;
+
+    if (h2c->out_urgencies == 0) {
+        return;
+    }
+
+    for (urgency = 0; urgency < NGX_HTTP_V2_URGENCY_LEVELS; urgency++) {
+
+        for (frame = h2c->out_queue[urgency].first; frame; frame = next) {
+            next = frame->next;
+            frame->next = h2c->last_out;
+            h2c->last_out = frame;
         }
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
+        h2c->out_queue[urgency].first = NULL;
+        h2c->out_queue[urgency].last = NULL;
+    }
+
+    h2c->out_urgencies = 0;
+}
+
+
+static ngx_inline void
+ngx_http_v2_requeue_frames(ngx_http_v2_connection_t *h2c)
+{
+    ngx_http_v2_out_frame_t  *frame;
+    ngx_http_v2_out_queue_t  *q;
+
+    for ( ;; ) {
+        frame = h2c->last_out;
+
+        if (frame == NULL || frame->blocked || frame->stream == NULL) {
             break;
         }
-    }
 
-    frame->next = *out;
-    *out = frame;
+        h2c->last_out = frame->next;
+
+        q = &h2c->out_queue[frame->stream->urgency];
+
+        if (q->first == NULL) {
+            q->last = frame;
+            h2c->out_urgencies |= 1 << frame->stream->urgency;
+        }
+
+        frame->next = q->first;
+        q->first = frame;
+    }
 }
 
 
@@ -282,6 +389,8 @@ static ngx_inline void
 ngx_http_v2_queue_ordered_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
+    ngx_http_v2_dequeue_frames(h2c);
+
     frame->next = h2c->last_out;
     h2c->last_out = frame;
 }
@@ -309,7 +418,15 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+ngx_uint_t ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t name_hash, ngx_uint_t hash,
+    ngx_uint_t *name_index);
+ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t name_hash, ngx_uint_t hash);
+void ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size);
+
 
+void ngx_http_v2_huff_decode_init(void);
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
 size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
@@ -416,6 +533,11 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_header_encode(ngx_http_v2_connection_t *h2c, u_char *dst,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing);
+u_char *ngx_http_v2_table_size_encode(ngx_http_v2_connection_t *h2c,
+    u_char *dst);
 
 
 #endif /* _NGX_HTTP_V2_H_INCLUDED_ */
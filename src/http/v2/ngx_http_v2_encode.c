@@ -40,6 +40,90 @@ ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len, u_char *tmp,
 }
 
 
+u_char *
+ngx_http_v2_header_encode(ngx_http_v2_connection_t *h2c, u_char *dst,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing)
+{
+    ngx_uint_t  i, found, name_hash, hash;
+
+    if (indexing) {
+        name_hash = 0;
+
+        for (i = 0; i < name->len; i++) {
+            name_hash = ngx_hash(name_hash, ngx_tolower(name->data[i]));
+        }
+
+        hash = name_hash;
+
+        for (i = 0; i < value->len; i++) {
+            hash = ngx_hash(hash, value->data[i]);
+        }
+
+        found = ngx_http_v2_table_find(h2c, name, value, name_hash, hash,
+                                       &index);
+
+        if (found) {
+            *dst = 128;
+            return ngx_http_v2_write_int(dst, ngx_http_v2_prefix(7), found);
+        }
+
+        /* the header is sent without indexing if it cannot be added */
+
+        indexing = (ngx_http_v2_table_insert(h2c, name, value, name_hash, hash)
+                    == NGX_OK);
+    }
+
+    if (indexing) {
+        *dst = 64;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(6), index);
+
+    } else {
+        *dst = 0;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(4), index);
+    }
+
+    if (index == 0) {
+        dst = ngx_http_v2_write_name(dst, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(dst, value->data, value->len, tmp);
+}
+
+
+u_char *
+ngx_http_v2_table_size_encode(ngx_http_v2_connection_t *h2c, u_char *dst)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    /* the smallest size since the last update has to be signalled first */
+
+    if (enc->update < enc->limit) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", enc->update);
+
+        ngx_http_v2_table_resize(h2c, enc->update);
+
+        *dst = 32;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(5), enc->update);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", enc->limit);
+
+    ngx_http_v2_table_resize(h2c, enc->limit);
+
+    *dst = 32;
+    dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(5), enc->limit);
+
+    h2c->table_update = 0;
+
+    return dst;
+}
+
+
 static u_char *
 ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 {
@@ -58,6 +58,8 @@ static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
 
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end, ngx_uint_t fin);
+static void ngx_http_v2_update_headers_frame(ngx_http_v2_out_frame_t *frame,
+    u_char *pos, u_char *end);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_push_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_trailers_frame(
@@ -134,9 +136,9 @@ static ngx_int_t
 ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
-    size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
-    ngx_uint_t                 i, port, fin;
+    size_t                     len, tmp_len, n;
+    ngx_str_t                  host, location, value;
+    ngx_uint_t                 i, port, fin, indexing;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
     ngx_connection_t          *fc;
@@ -147,19 +149,25 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
-#if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
-#endif
+    static ngx_str_t  status_name = ngx_string(":status");
+    static ngx_str_t  server_name = ngx_string("server");
+    static ngx_str_t  date_name = ngx_string("date");
+    static ngx_str_t  content_type_name = ngx_string("content-type");
+    static ngx_str_t  content_length_name = ngx_string("content-length");
+    static ngx_str_t  last_modified_name = ngx_string("last-modified");
+    static ngx_str_t  location_name = ngx_string("location");
+    static ngx_str_t  set_cookie_name = ngx_string("set-cookie");
 
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
+    static ngx_str_t  nginx_ver_build = ngx_string(NGINX_VER_BUILD);
 
-    static size_t nginx_ver_build_len =
-                                  ngx_http_v2_literal_size(NGINX_VER_BUILD);
-    static u_char nginx_ver_build[ngx_http_v2_literal_size(NGINX_VER_BUILD)];
+#if (NGX_HTTP_GZIP)
+    static ngx_str_t  vary_name = ngx_string("vary");
+    static ngx_str_t  accept_encoding = ngx_string("Accept-Encoding");
+#endif
 
     stream = r->stream;
 
@@ -253,7 +261,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    len = h2c->table_update ? 2 * (1 + NGX_HTTP_V2_INT_OCTETS) : 0;
 
     len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
@@ -262,13 +270,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += 1 + nginx_ver_len;
+            len += 1 + ngx_http_v2_literal_size(NGINX_VER);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += 1 + nginx_ver_build_len;
+            len += 1 + ngx_http_v2_literal_size(NGINX_VER_BUILD);
 
         } else {
-            len += 1 + sizeof(nginx);
+            len += 1 + ngx_http_v2_literal_size("nginx");
         }
     }
 
@@ -277,25 +285,47 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
         {
-            len += sizeof("; charset=") - 1 + r->headers_out.charset.len;
+            n = r->headers_out.content_type.len + sizeof("; charset=") - 1
+                + r->headers_out.charset.len;
+
+            p = ngx_pnalloc(r->pool, n);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            p = ngx_cpymem(p, r->headers_out.content_type.data,
+                           r->headers_out.content_type.len);
+
+            p = ngx_cpymem(p, "; charset=", sizeof("; charset=") - 1);
+
+            p = ngx_cpymem(p, r->headers_out.charset.data,
+                           r->headers_out.charset.len);
+
+            /* updated r->headers_out.content_type is also needed for logging */
+
+            r->headers_out.content_type.len = n;
+            r->headers_out.content_type.data = p - n;
         }
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
     }
 
+    /* headers sent without indexing need two octets for the name index */
+
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += 2 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -373,7 +403,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -381,7 +411,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += 1 + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -441,13 +471,23 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    fin = r->header_only
+          || (r->headers_out.content_length_n == 0 && !r->expect_trailers);
+
+    /*
+     * the frame is created before the dynamic table is changed: a header
+     * block which is not sent would leave the client's table out of sync
+     */
+
+    frame = ngx_http_v2_create_headers_frame(r, pos, pos + len, fin);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_table_size_encode(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -458,9 +498,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.len = 3;
+        value.data = buf;
+
+        ngx_sprintf(buf, "%03ui", r->headers_out.status);
+
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                        &status_name, &value, tmp, 1);
     }
 
     if (r->headers_out.server == NULL) {
@@ -480,29 +524,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
+            pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                            &server_name, &nginx_ver, tmp, 1);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            if (nginx_ver_build[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver_build,
-                                            (u_char *) NGINX_VER_BUILD,
-                                            sizeof(NGINX_VER_BUILD) - 1, tmp);
-                nginx_ver_build_len = p - nginx_ver_build;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
+            pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                            &server_name, &nginx_ver_build,
+                                            tmp, 1);
 
         } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
+            pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                            &server_name, &nginx, tmp, 1);
         }
     }
 
@@ -511,45 +544,22 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        value.len = ngx_cached_http_time.len;
+        value.data = ngx_cached_http_time.data;
+
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_DATE_INDEX,
+                                        &date_name, &value, tmp, 1);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
-
-        if (r->headers_out.content_type_len == r->headers_out.content_type.len
-            && r->headers_out.charset.len)
-        {
-            len = r->headers_out.content_type.len + sizeof("; charset=") - 1
-                  + r->headers_out.charset.len;
-
-            p = ngx_pnalloc(r->pool, len);
-            if (p == NULL) {
-                return NGX_ERROR;
-            }
-
-            p = ngx_cpymem(p, r->headers_out.content_type.data,
-                           r->headers_out.content_type.len);
-
-            p = ngx_cpymem(p, "; charset=", sizeof("; charset=") - 1);
-
-            p = ngx_cpymem(p, r->headers_out.charset.data,
-                           r->headers_out.charset.len);
-
-            /* updated r->headers_out.content_type is also needed for logging */
-
-            r->headers_out.content_type.len = len;
-            r->headers_out.content_type.data = p - len;
-        }
-
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                        &content_type_name,
+                                        &r->headers_out.content_type, tmp, 1);
     }
 
     if (r->headers_out.content_length == NULL
@@ -559,30 +569,28 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
+        value.data = buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_CONTENT_LENGTH_INDEX,
+                                        &content_length_name, &value, tmp, 0);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
-
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
+        value.data = buf;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"", &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_LAST_MODIFIED_INDEX,
+                                        &last_modified_name, &value, tmp, 0);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -590,9 +598,10 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                        &location_name,
+                                        &r->headers_out.location->value,
+                                        tmp, 0);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -600,8 +609,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                        &vary_name, &accept_encoding, tmp, 1);
     }
 #endif
 
@@ -634,22 +643,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
+        /* cookies are not indexed to avoid exposing them to compression */
 
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
+        indexing = (header[i].key.len != set_cookie_name.len
+                    || ngx_strncasecmp(header[i].key.data, set_cookie_name.data,
+                                       set_cookie_name.len)
+                       != 0);
 
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, 0, &header[i].key,
+                                        &header[i].value, tmp, indexing);
     }
 
-    fin = r->header_only
-          || (r->headers_out.content_length_n == 0 && !r->expect_trailers);
-
-    frame = ngx_http_v2_create_headers_frame(r, start, pos, fin);
-    if (frame == NULL) {
-        return NGX_ERROR;
-    }
+    ngx_http_v2_update_headers_frame(frame, start, pos);
 
     ngx_http_v2_queue_blocked_frame(h2c, frame);
 
@@ -909,6 +914,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_http_v2_connection_t    *h2c;
     ngx_http_v2_push_header_t   *ph;
 
+    static ngx_str_t  path_name = ngx_string(":path");
+    static ngx_str_t  scheme_name = ngx_string(":scheme");
+
     fc = r->connection;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0, "http2 push resource");
@@ -975,7 +983,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             value = &(*h)->value;
 
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+            len = 2 + NGX_HTTP_V2_INT_OCTETS + value->len;
 
             pos = ngx_pnalloc(r->pool, len);
             if (pos == NULL) {
@@ -984,14 +992,14 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             binary[i].data = pos;
 
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
-            pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+            pos = ngx_http_v2_header_encode(h2c, pos, ph[i].index, &ph[i].name,
+                                            value, tmp, 0);
 
             binary[i].len = pos - binary[i].data;
         }
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = (h2c->table_update ? 2 * (1 + NGX_HTTP_V2_INT_OCTETS) : 0)
           + 1
           + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
           + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
@@ -1008,10 +1016,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_table_size_encode(h2c, pos);
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1022,8 +1027,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
-    pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+    pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_PATH_INDEX,
+                                    &path_name, path, tmp, 0);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":scheme: %V\"", &r->schema);
@@ -1037,8 +1042,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_SCHEME_HTTP_INDEX,
+                                        &scheme_name, &r->schema, tmp, 0);
     }
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
@@ -1079,7 +1084,6 @@ static ngx_http_v2_out_frame_t *
 ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
     u_char *end, ngx_uint_t fin)
 {
-    u_char                    type, flags;
     size_t                    rest, frame_size;
     ngx_buf_t                *b;
     ngx_chain_t              *cl, **ll;
@@ -1096,31 +1100,21 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
 
     frame->handler = ngx_http_v2_headers_frame_handler;
     frame->stream = stream;
-    frame->length = rest;
     frame->blocked = 1;
     frame->fin = fin;
 
     ll = &frame->first;
 
-    type = NGX_HTTP_V2_HEADERS_FRAME;
-    flags = fin ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
     frame_size = stream->connection->frame_size;
 
-    for ( ;; ) {
-        if (rest <= frame_size) {
-            frame_size = rest;
-            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
-        }
+    /* a frame header and a buffer with the header block part per frame */
 
+    for ( ;; ) {
         b = ngx_create_temp_buf(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
         if (b == NULL) {
             return NULL;
         }
 
-        b->last = ngx_http_v2_write_len_and_type(b->last, frame_size, type);
-        *b->last++ = flags;
-        b->last = ngx_http_v2_write_sid(b->last, stream->node->id);
-
         b->tag = (ngx_buf_tag_t) &ngx_http_v2_module;
 
         cl = ngx_alloc_chain_link(r->pool);
@@ -1138,13 +1132,6 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
             return NULL;
         }
 
-        b->pos = pos;
-
-        pos += frame_size;
-
-        b->last = pos;
-        b->start = b->pos;
-        b->end = b->last;
         b->temporary = 1;
 
         cl = ngx_alloc_chain_link(r->pool);
@@ -1157,6 +1144,64 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
         *ll = cl;
         ll = &cl->next;
 
+        if (rest <= frame_size) {
+            break;
+        }
+
+        rest -= frame_size;
+    }
+
+    *ll = NULL;
+
+    ngx_http_v2_update_headers_frame(frame, pos, end);
+
+    return frame;
+}
+
+
+static void
+ngx_http_v2_update_headers_frame(ngx_http_v2_out_frame_t *frame, u_char *pos,
+    u_char *end)
+{
+    u_char                 type, flags;
+    size_t                 rest, frame_size;
+    ngx_buf_t             *b;
+    ngx_chain_t           *cl;
+    ngx_http_v2_stream_t  *stream;
+
+    /* the header block must not be longer than the frame was created for */
+
+    stream = frame->stream;
+    rest = end - pos;
+
+    frame->length = rest;
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = frame->fin ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+    frame_size = stream->connection->frame_size;
+
+    for (cl = frame->first; /* void */; cl = cl->next->next) {
+        if (rest <= frame_size) {
+            frame_size = rest;
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        b = cl->buf;
+
+        b->last = ngx_http_v2_write_len_and_type(b->pos, frame_size, type);
+        *b->last++ = flags;
+        b->last = ngx_http_v2_write_sid(b->last, stream->node->id);
+
+        b = cl->next->buf;
+
+        b->pos = pos;
+
+        pos += frame_size;
+
+        b->last = pos;
+        b->start = b->pos;
+        b->end = b->last;
+
         rest -= frame_size;
 
         if (rest) {
@@ -1167,15 +1212,16 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
             continue;
         }
 
-        b->last_buf = fin;
-        cl->next = NULL;
-        frame->last = cl;
+        b->last_buf = frame->fin;
+        cl->next->next = NULL;
+        frame->last = cl->next;
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, stream->request->connection->log, 0,
                        "http2:%ui create HEADERS frame %p: len:%uz fin:%ui",
-                       stream->node->id, frame, frame->length, fin);
+                       stream->node->id, frame, frame->length,
+                       (ngx_uint_t) frame->fin);
 
-        return frame;
+        return;
     }
 }
 
@@ -1794,10 +1840,7 @@ ngx_http_v2_waiting_queue(ngx_http_v2_connection_t *h2c,
     {
         s = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
 
-        if (s->node->rank < stream->node->rank
-            || (s->node->rank == stream->node->rank
-                && s->node->rel_weight >= stream->node->rel_weight))
-        {
+        if (s->urgency <= stream->urgency) {
             break;
         }
     }
@@ -2102,7 +2145,8 @@ ngx_http_v2_filter_cleanup(void *data)
     size_t                     window;
     ngx_event_t               *wev;
     ngx_queue_t               *q;
-    ngx_http_v2_out_frame_t   *frame, **fn;
+    ngx_http_v2_out_frame_t   *frame, *prev, **fn;
+    ngx_http_v2_out_queue_t   *oq;
     ngx_http_v2_connection_t  *h2c;
 
     if (stream->waiting) {
@@ -2116,7 +2160,10 @@ ngx_http_v2_filter_cleanup(void *data)
 
     window = 0;
     h2c = stream->connection;
-    fn = &h2c->last_out;
+
+    oq = &h2c->out_queue[stream->urgency];
+    prev = NULL;
+    fn = &oq->first;
 
     for ( ;; ) {
         frame = *fn;
@@ -2125,6 +2172,39 @@ ngx_http_v2_filter_cleanup(void *data)
             break;
         }
 
+        if (frame->stream == stream) {
+            *fn = frame->next;
+
+            if (oq->last == frame) {
+                oq->last = prev;
+            }
+
+            window += frame->length;
+
+            if (--stream->queued == 0) {
+                break;
+            }
+
+            continue;
+        }
+
+        prev = frame;
+        fn = &frame->next;
+    }
+
+    if (oq->first == NULL) {
+        h2c->out_urgencies &= ~(1 << stream->urgency);
+    }
+
+    fn = &h2c->last_out;
+
+    while (stream->queued) {
+        frame = *fn;
+
+        if (frame == NULL) {
+            break;
+        }
+
         if (frame->stream == stream && !frame->blocked) {
             *fn = frame->next;
 
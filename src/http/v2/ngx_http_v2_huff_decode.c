@@ -18,8 +18,19 @@ typedef struct {
 } ngx_http_v2_huff_decode_code_t;
 
 
-static ngx_inline ngx_int_t ngx_http_v2_huff_decode_bits(u_char *state,
-    u_char *ending, ngx_uint_t bits, u_char **dst);
+typedef struct {
+    u_char  next;
+    u_char  flags;
+    u_char  sym[2];
+} ngx_http_v2_huff_decode_byte_t;
+
+
+#define NGX_HTTP_V2_HUFF_EMIT    0x03
+#define NGX_HTTP_V2_HUFF_ENDING  0x04
+#define NGX_HTTP_V2_HUFF_ERROR   0x08
+
+
+static ngx_http_v2_huff_decode_byte_t  ngx_http_v2_huff_decode_bytes[256][256];
 
 
 static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
@@ -2639,11 +2650,64 @@ static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 };
 
 
+void
+ngx_http_v2_huff_decode_init(void)
+{
+    u_char                           state, next;
+    ngx_uint_t                       ch;
+    ngx_http_v2_huff_decode_code_t   hi, lo;
+    ngx_http_v2_huff_decode_byte_t  *code;
+
+    /*
+     * The byte table is composed from the nibble table, so a code
+     * consumes a whole octet and emits at most two symbols.
+     */
+
+    for (state = 0; /* void */; state++) {
+
+        for (ch = 0; ch < 256; ch++) {
+            code = &ngx_http_v2_huff_decode_bytes[state][ch];
+
+            hi = ngx_http_v2_huff_decode_codes[state][ch >> 4];
+
+            if (hi.next == state) {
+                code->flags = NGX_HTTP_V2_HUFF_ERROR;
+                continue;
+            }
+
+            next = hi.next;
+            lo = ngx_http_v2_huff_decode_codes[next][ch & 0xf];
+
+            if (lo.next == next) {
+                code->flags = NGX_HTTP_V2_HUFF_ERROR;
+                continue;
+            }
+
+            code->next = lo.next;
+            code->flags = lo.ending ? NGX_HTTP_V2_HUFF_ENDING : 0;
+
+            if (hi.emit) {
+                code->sym[code->flags++ & NGX_HTTP_V2_HUFF_EMIT] = hi.sym;
+            }
+
+            if (lo.emit) {
+                code->sym[code->flags++ & NGX_HTTP_V2_HUFF_EMIT] = lo.sym;
+            }
+        }
+
+        if (state == 255) {
+            break;
+        }
+    }
+}
+
+
 ngx_int_t
 ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char                          *end, ch, ending;
+    ngx_http_v2_huff_decode_byte_t   code;
 
     ch = 0;
     ending = 1;
@@ -2653,25 +2717,30 @@ ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
+        code = ngx_http_v2_huff_decode_bytes[*state][ch];
+
+        if (code.flags & NGX_HTTP_V2_HUFF_ERROR) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+                           "bad code 0x%Xd", *state, ch);
 
             return NGX_ERROR;
         }
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
+        switch (code.flags & NGX_HTTP_V2_HUFF_EMIT) {
 
-            return NGX_ERROR;
+        case 2:
+            *(*dst)++ = code.sym[0];
+            *(*dst)++ = code.sym[1];
+            break;
+
+        case 1:
+            *(*dst)++ = code.sym[0];
+            break;
         }
+
+        ending = code.flags & NGX_HTTP_V2_HUFF_ENDING;
+        *state = code.next;
     }
 
     if (last) {
@@ -2688,27 +2757,3 @@ ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
 
     return NGX_OK;
 }
-
-
-
-static ngx_inline ngx_int_t
-ngx_http_v2_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
-    u_char **dst)
-{
-    ngx_http_v2_huff_decode_code_t  code;
-
-    code = ngx_http_v2_huff_decode_codes[*state][bits];
-
-    if (code.next == *state) {
-        return NGX_ERROR;
-    }
-
-    if (code.emit) {
-        *(*dst)++ = code.sym;
-    }
-
-    *ending = code.ending;
-    *state = code.next;
-
-    return NGX_OK;
-}
@@ -10,9 +10,6 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
 
@@ -361,3 +358,160 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+/*
+ * The encoder's dynamic table mirrors the table of the client decoder.
+ * Names and values are kept contiguously in a ring storage; when the
+ * storage is reused before an entry is evicted by the table accounting,
+ * the entry just can no longer be referenced.
+ */
+
+ngx_uint_t
+ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t name_hash, ngx_uint_t hash,
+    ngx_uint_t *name_index)
+{
+    ngx_uint_t                  i, index;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_table_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    for (i = enc->added; i != enc->deleted; /* void */) {
+        i--;
+
+        entry = &enc->entries[i % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->data == NULL
+            || entry->name_hash != name_hash
+            || entry->name_len != name->len
+            || ngx_strncasecmp(entry->data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - i;
+
+        if (entry->hash == hash
+            && entry->value_len == value->len
+            && ngx_memcmp(entry->data + name->len, value->data, value->len)
+               == 0)
+        {
+            return index;
+        }
+
+        if (name_index && *name_index == 0) {
+            *name_index = index;
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t name_hash, ngx_uint_t hash)
+{
+    u_char                     *last, *storage;
+    size_t                      size, len;
+    ngx_uint_t                  i;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_table_entry_t  *entry, *entries;
+
+    enc = &h2c->hpack_enc;
+
+    len = name->len + value->len;
+    size = 32 + len;
+
+    /* large entries would flush the whole table */
+
+    if (size > enc->size / 4) {
+        return NGX_DECLINED;
+    }
+
+    if (enc->entries == NULL) {
+        entries = ngx_palloc(h2c->connection->pool,
+                             sizeof(ngx_http_v2_table_entry_t)
+                             * NGX_HTTP_V2_TABLE_ENTRIES);
+        if (entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        storage = ngx_palloc(h2c->connection->pool, NGX_HTTP_V2_TABLE_SIZE);
+        if (storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->entries = entries;
+        enc->storage = storage;
+        enc->pos = storage;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table insert: \"%V: %V\"", name, value);
+
+    while (size > enc->free) {
+        entry = &enc->entries[enc->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        enc->free += 32 + entry->name_len + entry->value_len;
+    }
+
+    enc->free -= size;
+
+    if (enc->pos + len > enc->storage + NGX_HTTP_V2_TABLE_SIZE) {
+        enc->pos = enc->storage;
+    }
+
+    last = enc->pos + len;
+
+    for (i = enc->deleted; i != enc->added; i++) {
+        entry = &enc->entries[i % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->data
+            && entry->data < last
+            && entry->data + entry->name_len + entry->value_len > enc->pos)
+        {
+            entry->data = NULL;
+        }
+    }
+
+    entry = &enc->entries[enc->added++ % NGX_HTTP_V2_TABLE_ENTRIES];
+
+    entry->name_hash = name_hash;
+    entry->hash = hash;
+    entry->name_len = name->len;
+    entry->value_len = value->len;
+    entry->data = enc->pos;
+
+    ngx_strlow(enc->pos, name->data, name->len);
+    ngx_memcpy(enc->pos + name->len, value->data, value->len);
+
+    enc->pos = last;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    size_t                      used;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_table_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table resize: %uz was:%uz", size, enc->size);
+
+    used = enc->size - enc->free;
+
+    while (used > size) {
+        entry = &enc->entries[enc->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        used -= 32 + entry->name_len + entry->value_len;
+    }
+
+    enc->size = size;
+    enc->free = size - used;
+}
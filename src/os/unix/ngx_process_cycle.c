@@ -23,6 +23,12 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
 static void ngx_worker_process_exit(ngx_cycle_t *cycle);
 static void ngx_channel_handler(ngx_event_t *ev);
+static ngx_uint_t ngx_cache_manager_processes(ngx_cycle_t *cycle,
+    ngx_uint_t loader);
+static ngx_uint_t ngx_cache_manager_owns(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_uint_t loader);
+static void ngx_cache_manager_process(ngx_cycle_t *cycle, void *data);
+static void ngx_cache_loader_process(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
@@ -56,6 +62,8 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_pass_connection_pt  ngx_pass_connection_handler;
+
 
 static u_char  master_process[] = "master process";
 
@@ -68,6 +76,8 @@ static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
     ngx_cache_loader_process_handler, "cache loader process", 60000
 };
 
+static ngx_uint_t  ngx_cache_manager_slot;
+
 
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
@@ -411,55 +421,90 @@ static void
 ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 {
     ngx_uint_t       i, manager, loader;
-    ngx_path_t     **path;
     ngx_channel_t    ch;
 
-    manager = 0;
-    loader = 0;
+    /*
+     * cache paths are distributed round-robin among the cache manager
+     * and loader processes, so a slow disk does not hold up other caches
+     */
 
-    path = ngx_cycle->paths.elts;
-    for (i = 0; i < ngx_cycle->paths.nelts; i++) {
+    manager = ngx_cache_manager_processes(cycle, 0);
 
-        if (path[i]->manager) {
-            manager = 1;
-        }
+    if (manager == 0) {
+        return;
+    }
 
-        if (path[i]->loader) {
-            loader = 1;
-        }
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    for (i = 0; i < manager; i++) {
+
+        ngx_spawn_process(cycle, ngx_cache_manager_process,
+                          (void *) (intptr_t) i, "cache manager process",
+                          respawn ? NGX_PROCESS_JUST_RESPAWN
+                                  : NGX_PROCESS_RESPAWN);
+
+        ch.command = NGX_CMD_OPEN_CHANNEL;
+        ch.pid = ngx_processes[ngx_process_slot].pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+        ngx_pass_open_channel(cycle, &ch);
     }
 
-    if (manager == 0) {
-        return;
+    loader = ngx_cache_manager_processes(cycle, 1);
+
+    for (i = 0; i < loader; i++) {
+
+        ngx_spawn_process(cycle, ngx_cache_loader_process,
+                          (void *) (intptr_t) i, "cache loader process",
+                          respawn ? NGX_PROCESS_JUST_SPAWN
+                                  : NGX_PROCESS_NORESPAWN);
+
+        ch.command = NGX_CMD_OPEN_CHANNEL;
+        ch.pid = ngx_processes[ngx_process_slot].pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+        ngx_pass_open_channel(cycle, &ch);
     }
+}
 
-    ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
-                      &ngx_cache_manager_ctx, "cache manager process",
-                      respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
 
-    ngx_memzero(&ch, sizeof(ngx_channel_t));
+static ngx_uint_t
+ngx_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t loader)
+{
+    ngx_uint_t        i, n;
+    ngx_path_t      **path;
+    ngx_core_conf_t  *ccf;
 
-    ch.command = NGX_CMD_OPEN_CHANNEL;
-    ch.pid = ngx_processes[ngx_process_slot].pid;
-    ch.slot = ngx_process_slot;
-    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+    n = 0;
 
-    ngx_pass_open_channel(cycle, &ch);
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
 
-    if (loader == 0) {
-        return;
+        if (loader ? path[i]->loader != NULL : path[i]->manager != NULL) {
+            n++;
+        }
     }
 
-    ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
-                      &ngx_cache_loader_ctx, "cache loader process",
-                      respawn ? NGX_PROCESS_JUST_SPAWN : NGX_PROCESS_NORESPAWN);
+    if (n == 0 || (loader && ngx_cache_manager_processes(cycle, 0) == 0)) {
+        return 0;
+    }
 
-    ch.command = NGX_CMD_OPEN_CHANNEL;
-    ch.pid = ngx_processes[ngx_process_slot].pid;
-    ch.slot = ngx_process_slot;
-    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    return ngx_min(n, (ngx_uint_t) ccf->cache_manager_processes);
+}
+
+
+static ngx_uint_t
+ngx_cache_manager_owns(ngx_cycle_t *cycle, ngx_uint_t n, ngx_uint_t loader)
+{
+    ngx_uint_t  processes;
+
+    processes = ngx_cache_manager_processes(cycle, loader);
 
-    ngx_pass_open_channel(cycle, &ch);
+    return (processes && n % processes == ngx_cache_manager_slot);
 }
 
 
@@ -1173,11 +1218,47 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_PASS_CONNECTION:
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get connection s:%i pid:%P fd:%d",
+                           ch.slot, ch.pid, ch.fd);
+
+            if (ngx_pass_connection_handler) {
+                ngx_pass_connection_handler(&ch);
+                break;
+            }
+
+            if (ngx_close_socket(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                              ngx_close_socket_n " failed");
+            }
+
+            break;
         }
     }
 }
 
 
+static void
+ngx_cache_manager_process(ngx_cycle_t *cycle, void *data)
+{
+    ngx_cache_manager_slot = (ngx_uint_t) (intptr_t) data;
+
+    ngx_cache_manager_process_cycle(cycle, &ngx_cache_manager_ctx);
+}
+
+
+static void
+ngx_cache_loader_process(ngx_cycle_t *cycle, void *data)
+{
+    ngx_cache_manager_slot = (ngx_uint_t) (intptr_t) data;
+
+    ngx_cache_manager_process_cycle(cycle, &ngx_cache_loader_ctx);
+}
+
+
 // ngx_master_process_cycle() ł̂݌Ă΂
 // OK
 static void
@@ -1236,16 +1317,20 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 static void
 ngx_cache_manager_process_handler(ngx_event_t *ev)
 {
-    ngx_uint_t    i;
+    ngx_uint_t    i, k;
     ngx_msec_t    next, n;
     ngx_path_t  **path;
 
     next = 60 * 60 * 1000;
 
     path = ngx_cycle->paths.elts;
-    for (i = 0; i < ngx_cycle->paths.nelts; i++) {
+    for (i = 0, k = 0; i < ngx_cycle->paths.nelts; i++) {
 
-        if (path[i]->manager) {
+        if (path[i]->manager == NULL) {
+            continue;
+        }
+
+        if (ngx_cache_manager_owns((ngx_cycle_t *) ngx_cycle, k++, 0)) {
             n = path[i]->manager(path[i]->data);
 
             next = (n <= next) ? n : next;
@@ -1267,11 +1352,12 @@ ngx_cache_manager_process_handler(ngx_event_t *ev)
 static void
 ngx_cache_loader_process_handler(ngx_event_t *ev)
 {
-    ngx_uint_t     i;
+    ngx_uint_t     i, k;
     ngx_path_t   **path;
     ngx_cycle_t   *cycle;
 
     cycle = (ngx_cycle_t *) ngx_cycle;
+    k = 0;
 
     path = cycle->paths.elts;
     for (i = 0; i < cycle->paths.nelts; i++) {
@@ -1280,7 +1366,11 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
             break;
         }
 
-        if (path[i]->loader) {
+        if (path[i]->loader == NULL) {
+            continue;
+        }
+
+        if (ngx_cache_manager_owns(cycle, k++, 1)) {
             path[i]->loader(path[i]->data);
             ngx_time_update();
         }
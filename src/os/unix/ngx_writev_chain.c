@@ -281,6 +281,8 @@ eintr:
                    "writev: %z of %uz", n, vec->size);
 
     if (n == -1) {
+        err = ngx_errno;
+
         switch (err) {
         case NGX_EAGAIN:
             ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
@@ -404,10 +404,10 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_stream_upstream_srv_conf_t  *uscf = conf;
 
     time_t                         fail_timeout;
-    ngx_str_t                     *value, s;
+    ngx_str_t                     *value, s, service;
     ngx_url_t                      u;
     ngx_int_t                      weight, max_conns, max_fails;
-    ngx_uint_t                     i;
+    ngx_uint_t                     i, resolve;
     ngx_stream_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -423,6 +423,8 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    resolve = 0;
+    ngx_str_null(&service);
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -511,12 +513,37 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            service.len = value[i].len - 8;
+            service.data = &value[i].data[8];
+
+            if (service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         goto invalid;
     }
 
+    if (service.len && !resolve) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires "
+                           "\"resolve\" parameter", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
+    u.no_resolve = resolve;
 
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
@@ -527,7 +554,44 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    if (u.no_port) {
+    if (resolve && u.naddrs == 0) {
+
+        /* the name is resolved at run time */
+
+        if (service.len && !u.no_port) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" may not have port",
+                               &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        if (service.len == 0 && u.no_port) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "no port in upstream \"%V\"", &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        us->host = u.host;
+        us->service = service;
+        us->port = u.port;
+        us->resolve = 1;
+
+        if (service.len == 0) {
+
+            /* addresses known at startup are used until the first update */
+
+            if (ngx_inet_resolve_host(cf->pool, &u) != NGX_OK) {
+                u.naddrs = 0;
+            }
+        }
+
+    } else if (service.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires a domain name",
+                           &u.url);
+        return NGX_CONF_ERROR;
+
+    } else if (u.no_port) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "no port in upstream \"%V\"", &u.url);
         return NGX_CONF_ERROR;
@@ -60,7 +60,12 @@ typedef struct {
     ngx_msec_t                         slow_start;
     ngx_uint_t                         down;
 
+    ngx_str_t                          host;
+    ngx_str_t                          service;
+    in_port_t                          port;
+
     unsigned                           backup:1;
+    unsigned                           resolve:1;
 
     NGX_COMPAT_BEGIN(4)
     NGX_COMPAT_END
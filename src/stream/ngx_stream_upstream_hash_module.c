@@ -25,9 +25,19 @@ typedef struct {
 typedef struct {
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_uint_t                            bound;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
+typedef struct {
+    ngx_str_t                            *server;
+    ngx_int_t                             weight;
+    ngx_uint_t                            offset;
+    ngx_uint_t                            skip;
+    ngx_uint_t                            next;
+} ngx_stream_upstream_maglev_server_t;
+
+
 typedef struct {
     /* the round robin data must be first */
     ngx_stream_upstream_rr_peer_data_t    rrp;
@@ -58,6 +68,11 @@ static ngx_int_t ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 static ngx_int_t ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+
 static void *ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -66,7 +81,7 @@ static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_stream_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE123,
       ngx_stream_upstream_hash,
       NGX_STREAM_SRV_CONF_OFFSET,
       0,
@@ -88,6 +103,13 @@ static ngx_stream_module_t  ngx_stream_upstream_hash_module_ctx = {
 };
 
 
+/* lookup table sizes, primes */
+
+static ngx_uint_t  ngx_stream_upstream_maglev_sizes[] = {
+    251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 0
+};
+
+
 ngx_module_t  ngx_stream_upstream_hash_module = {
     NGX_MODULE_V1,
     &ngx_stream_upstream_hash_module_ctx,  /* module context */
@@ -178,7 +200,10 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || hp->rrp.peers->total_weight == 0
+        || ngx_stream_upstream_rr_peers_changed(&hp->rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -290,7 +315,7 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
     uint32_t                              hash, base_hash;
     ngx_str_t                            *server;
     ngx_uint_t                            npoints, i, j;
-    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_rr_peer_t        *peer, *resolve;
     ngx_stream_upstream_rr_peers_t       *peers;
     ngx_stream_upstream_chash_points_t   *points;
     ngx_stream_upstream_hash_srv_conf_t  *hcf;
@@ -308,6 +333,19 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
     peers = us->peer.data;
     npoints = peers->total_weight * 160;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+    /*
+     * servers resolved at run time get their points in advance,
+     * their addresses share the server name of the template
+     */
+
+    for (peer = peers->resolve; peer; peer = peer->next) {
+        npoints += peer->weight * 160;
+    }
+
+#endif
+
     size = sizeof(ngx_stream_upstream_chash_points_t)
            + sizeof(ngx_stream_upstream_chash_point_t) * (npoints - 1);
 
@@ -318,7 +356,25 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
 
     points->number = 0;
 
-    for (peer = peers->peer; peer; peer = peer->next) {
+    peer = peers->peer;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    resolve = peers->resolve;
+#else
+    resolve = NULL;
+#endif
+
+    for ( ;; ) {
+
+        if (peer == NULL) {
+            if (resolve == NULL) {
+                break;
+            }
+
+            peer = resolve;
+            resolve = NULL;
+        }
+
         server = &peer->server;
 
         /*
@@ -386,6 +442,8 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
             prev_hash.byte[3] = (u_char) ((hash >> 24) & 0xff);
 #endif
         }
+
+        peer = peer->next;
     }
 
     ngx_qsort(points->point,
@@ -500,7 +558,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                              m;
     ngx_str_t                            *server;
     ngx_int_t                             total;
-    ngx_uint_t                            i, n, best_i;
+    ngx_uint_t                            i, n, best_i, conns, weight;
     ngx_stream_upstream_rr_peer_t        *peer, *best;
     ngx_stream_upstream_chash_point_t    *point;
     ngx_stream_upstream_chash_points_t   *points;
@@ -511,7 +569,9 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_wlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || ngx_stream_upstream_rr_peers_changed(&hp->rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -524,6 +584,30 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    conns = 0;
+    weight = 0;
+
+    if (hcf->bound) {
+
+        /*
+         * consistent hashing with bounded loads: a peer is skipped
+         * if it already has more than "bound" times its weighted share
+         * of the active connections, counting the one being made
+         */
+
+        for (peer = hp->rrp.peers->peer; peer; peer = peer->next) {
+            if (peer->down) {
+                continue;
+            }
+
+            conns += peer->conns;
+            weight += peer->weight;
+        }
+
+        conns = (conns + 1) * hcf->bound;
+        weight *= 100;
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -568,6 +652,15 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (hcf->bound
+                && peer->conns * weight >= conns * (ngx_uint_t) peer->weight)
+            {
+                ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                               "consistent hash peer \"%V\" overloaded",
+                               &peer->name);
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -618,6 +711,184 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    size_t                                size;
+    ngx_str_t                            *server;
+    ngx_int_t                             w;
+    ngx_uint_t                            i, j, n, filled;
+    ngx_stream_upstream_rr_peer_t        *peer, *resolve;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_chash_point_t    *point;
+    ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+    ngx_stream_upstream_maglev_server_t  *ms;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+
+    n = peers->number;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    for (peer = peers->resolve; peer; peer = peer->next) {
+        n++;
+    }
+#endif
+
+    ms = ngx_palloc(cf->temp_pool,
+                    n * sizeof(ngx_stream_upstream_maglev_server_t));
+    if (ms == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * peers resolved from the same name share the server name,
+     * each name is placed into the table once
+     */
+
+    n = 0;
+    peer = peers->peer;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    resolve = peers->resolve;
+#else
+    resolve = NULL;
+#endif
+
+    for ( ;; ) {
+
+        if (peer == NULL) {
+            if (resolve == NULL) {
+                break;
+            }
+
+            peer = resolve;
+            resolve = NULL;
+        }
+
+        server = &peer->server;
+
+        for (i = 0; i < n; i++) {
+            if (ms[i].server->len == server->len
+                && ngx_strncmp(ms[i].server->data, server->data, server->len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == n) {
+            ms[n].server = server;
+            ms[n].weight = peer->weight;
+            n++;
+        }
+
+        peer = peer->next;
+    }
+
+    for (i = 0; ngx_stream_upstream_maglev_sizes[i + 1]; i++) {
+        if (ngx_stream_upstream_maglev_sizes[i] >= n * 100) {
+            break;
+        }
+    }
+
+    size = ngx_stream_upstream_maglev_sizes[i];
+
+    if (n >= size) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "too many servers for maglev hash in upstream \"%V\" "
+                      "in %s:%ui", &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    /*
+     * each server walks the table in its own permutation
+     * (offset + next * skip) % size, and takes the first free slot
+     * on each turn; a server gets as many turns in a round as its weight
+     */
+
+    for (i = 0; i < n; i++) {
+        ms[i].offset = ngx_crc32_long(ms[i].server->data, ms[i].server->len)
+                       % size;
+        ms[i].skip = ngx_murmur_hash2(ms[i].server->data, ms[i].server->len)
+                     % (size - 1) + 1;
+        ms[i].next = 0;
+    }
+
+    points = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_chash_points_t)
+                                   + sizeof(ngx_stream_upstream_chash_point_t)
+                                     * (size - 1));
+    if (points == NULL) {
+        return NGX_ERROR;
+    }
+
+    points->number = size;
+    point = &points->point[0];
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (i = 0; i < n; i++) {
+            for (w = 0; w < ms[i].weight; w++) {
+
+                do {
+                    j = (ms[i].offset + ms[i].next * ms[i].skip) % size;
+                    ms[i].next++;
+                } while (point[j].server);
+
+                point[j].hash = j;
+                point[j].server = ms[i].server;
+
+                if (++filled == size) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+    hcf->points = points;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_srv_conf_t   *hcf;
+    ngx_stream_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_stream_upstream_init_hash_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_chash_peer;
+
+    hp = s->upstream->peer.data;
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    /* the lookup table is never changed after configuration */
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len)
+               % hcf->points->number;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -629,6 +900,7 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->bound = 0;
 
     return conf;
 }
@@ -639,6 +911,7 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_stream_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                            bound;
     ngx_str_t                           *value;
     ngx_stream_upstream_srv_conf_t      *uscf;
     ngx_stream_compile_complex_value_t   ccv;
@@ -675,11 +948,33 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 4) {
+
+        if (ngx_strncmp(value[3].data, "bounded=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        bound = ngx_atofp(value[3].data + 8, value[3].len - 8, 2);
+
+        if (bound == NGX_ERROR || bound < 100) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid load bound \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        hcf->bound = bound;
+    }
+
     return NGX_CONF_OK;
 }
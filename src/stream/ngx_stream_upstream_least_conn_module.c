@@ -120,6 +120,10 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_wlock(peers);
 
+    if (ngx_stream_upstream_rr_peers_changed(rrp)) {
+        goto busy;
+    }
+
     best = NULL;
     total = 0;
 
@@ -276,6 +280,8 @@ failed:
         ngx_stream_upstream_rr_peers_wlock(peers);
     }
 
+busy:
+
     ngx_stream_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
@@ -17,6 +17,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                              two;
+    ngx_uint_t                              config;
     ngx_stream_upstream_random_range_t     *ranges;
 } ngx_stream_upstream_random_srv_conf_t;
 
@@ -117,7 +118,7 @@ ngx_stream_upstream_update_random(ngx_pool_t *pool,
     ngx_stream_upstream_srv_conf_t *us)
 {
     size_t                                  size;
-    ngx_uint_t                              i, total_weight;
+    ngx_uint_t                              i, n, total_weight;
     ngx_stream_upstream_rr_peer_t          *peer;
     ngx_stream_upstream_rr_peers_t         *peers;
     ngx_stream_upstream_random_range_t     *ranges;
@@ -127,13 +128,18 @@ ngx_stream_upstream_update_random(ngx_pool_t *pool,
                                             ngx_stream_upstream_random_module);
     peers = us->peer.data;
 
-    size = peers->number * sizeof(ngx_stream_upstream_random_range_t);
+    n = ngx_max(peers->number, 1);
+    size = n * sizeof(ngx_stream_upstream_random_range_t);
 
     ranges = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
     if (ranges == NULL) {
         return NGX_ERROR;
     }
 
+    if (pool == NULL && rcf->ranges) {
+        ngx_free(rcf->ranges);
+    }
+
     total_weight = 0;
 
     for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
@@ -144,6 +150,10 @@ ngx_stream_upstream_update_random(ngx_pool_t *pool,
 
     rcf->ranges = ranges;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    rcf->config = peers->config ? *peers->config : 0;
+#endif
+
     return NGX_OK;
 }
 
@@ -186,7 +196,9 @@ ngx_stream_upstream_init_random_peer(ngx_stream_session_t *s,
     ngx_stream_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
+    if (rp->rrp.peers->shpool
+        && (rcf->ranges == NULL || rcf->config != rp->rrp.config))
+    {
         if (ngx_stream_upstream_update_random(NULL, us) != NGX_OK) {
             ngx_stream_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
@@ -220,7 +232,9 @@ ngx_stream_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_rlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0
+        || ngx_stream_upstream_rr_peers_changed(rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(peers);
         return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -314,7 +328,9 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_wlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0
+        || ngx_stream_upstream_rr_peers_changed(rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(peers);
         return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
     }
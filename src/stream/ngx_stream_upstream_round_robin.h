@@ -15,6 +15,8 @@
 
 
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
+typedef struct ngx_stream_upstream_rr_peers_s  ngx_stream_upstream_rr_peers_t;
+typedef struct ngx_stream_upstream_host_s      ngx_stream_upstream_host_t;
 
 struct ngx_stream_upstream_rr_peer_s {
     struct sockaddr                 *sockaddr;
@@ -45,6 +47,11 @@ struct ngx_stream_upstream_rr_peer_s {
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_atomic_t                     lock;
+
+    ngx_uint_t                       check_fails;
+    ngx_uint_t                       check_passes;
+
+    ngx_stream_upstream_host_t      *host;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;
@@ -54,8 +61,6 @@ struct ngx_stream_upstream_rr_peer_s {
 };
 
 
-typedef struct ngx_stream_upstream_rr_peers_s  ngx_stream_upstream_rr_peers_t;
-
 struct ngx_stream_upstream_rr_peers_s {
     ngx_uint_t                       number;
 
@@ -63,6 +68,9 @@ struct ngx_stream_upstream_rr_peers_s {
     ngx_slab_pool_t                 *shpool;
     ngx_atomic_t                     rwlock;
     ngx_stream_upstream_rr_peers_t  *zone_next;
+    ngx_msec_t                       next_check;
+    ngx_uint_t                      *config;
+    ngx_stream_upstream_rr_peer_t   *resolve;
 #endif
 
     ngx_uint_t                       total_weight;
@@ -78,6 +86,36 @@ struct ngx_stream_upstream_rr_peers_s {
 };
 
 
+/*
+ * peer->down is NGX_STREAM_UPSTREAM_PEER_DOWN for a server marked "down"
+ * in the configuration; active health checks set a separate bit, so
+ * balancers testing peer->down skip both
+ */
+
+#define NGX_STREAM_UPSTREAM_PEER_DOWN      0x01
+#define NGX_STREAM_UPSTREAM_PEER_UNHEALTHY 0x02
+
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+/*
+ * a server with the "resolve" parameter; its addresses are kept as
+ * regular peers with peer->host set, and peer is a template they are
+ * created from when the name is resolved again; peers removed while
+ * still in use wait in the zombies list
+ */
+
+struct ngx_stream_upstream_host_s {
+    ngx_str_t                        name;
+    ngx_str_t                        service;
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peer_t   *zombies;
+};
+
+#endif
+
+
 #if (NGX_STREAM_UPSTREAM_ZONE)
 
 #define ngx_stream_upstream_rr_peers_rlock(peers)                             \
@@ -111,6 +149,12 @@ struct ngx_stream_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+
+/* peers were added or removed since the session started */
+
+#define ngx_stream_upstream_rr_peers_changed(rrp)                             \
+    ((rrp)->peers->config && (rrp)->config != *(rrp)->peers->config)
+
 #else
 
 #define ngx_stream_upstream_rr_peers_rlock(peers)
@@ -118,6 +162,7 @@ struct ngx_stream_upstream_rr_peers_s {
 #define ngx_stream_upstream_rr_peers_unlock(peers)
 #define ngx_stream_upstream_rr_peer_lock(peers, peer)
 #define ngx_stream_upstream_rr_peer_unlock(peers, peer)
+#define ngx_stream_upstream_rr_peers_changed(rrp)  0
 
 #endif
 
@@ -10,14 +10,40 @@
 #include <ngx_stream.h>
 
 
+typedef struct {
+    ngx_event_t                      event;
+    ngx_stream_upstream_host_t      *host;
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       timeout;
+} ngx_stream_upstream_zone_resolve_t;
+
+
+typedef struct {
+    struct sockaddr                *sockaddr;
+    socklen_t                       socklen;
+    ngx_int_t                       weight;
+} ngx_stream_upstream_zone_addr_t;
+
+
 static char *ngx_stream_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_stream_upstream_init_zone(ngx_shm_zone_t *shm_zone,
     void *data);
 static ngx_stream_upstream_rr_peers_t *ngx_stream_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_stream_upstream_zone_copy_hosts(
+    ngx_stream_upstream_rr_peers_t *peers);
 static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_zone_copy_peer(
     ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *src);
+static void ngx_stream_upstream_zone_free_peer(
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer);
+static ngx_int_t ngx_stream_upstream_zone_init(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static void ngx_stream_upstream_zone_resolve_timer(ngx_event_t *event);
+static void ngx_stream_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_stream_upstream_zone_update_peers(
+    ngx_stream_upstream_zone_resolve_t *rs, ngx_resolver_ctx_t *ctx);
 
 
 static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
@@ -35,7 +61,7 @@ static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
 
 static ngx_stream_module_t  ngx_stream_upstream_zone_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_stream_upstream_zone_init,         /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -52,7 +78,7 @@ ngx_module_t  ngx_stream_upstream_zone_module = {
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_stream_upstream_zone_init_worker,  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -212,6 +238,11 @@ ngx_stream_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
 
     peers->shpool = shpool;
 
+    peers->config = ngx_slab_calloc(shpool, sizeof(ngx_uint_t));
+    if (peers->config == NULL) {
+        return NULL;
+    }
+
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
         peer = ngx_stream_upstream_zone_copy_peer(peers, *peerp);
@@ -236,6 +267,7 @@ ngx_stream_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     backup->name = name;
 
     backup->shpool = shpool;
+    backup->config = peers->config;
 
     for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
@@ -249,14 +281,84 @@ ngx_stream_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
 
     peers->next = backup;
 
+    if (ngx_stream_upstream_zone_copy_hosts(backup) != NGX_OK) {
+        return NULL;
+    }
+
 done:
 
+    if (ngx_stream_upstream_zone_copy_hosts(peers) != NGX_OK) {
+        return NULL;
+    }
+
     uscf->peer.data = peers;
 
     return peers;
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_zone_copy_hosts(ngx_stream_upstream_rr_peers_t *peers)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_stream_upstream_host_t     *host, *src;
+    ngx_stream_upstream_rr_peer_t  *peer, **peerp;
+
+    shpool = peers->shpool;
+
+    for (peerp = &peers->resolve; *peerp; peerp = &peer->next) {
+        src = (*peerp)->host;
+
+        host = ngx_slab_calloc(shpool, sizeof(ngx_stream_upstream_host_t));
+        if (host == NULL) {
+            return NGX_ERROR;
+        }
+
+        host->name.data = ngx_slab_alloc(shpool, src->name.len);
+        if (host->name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(host->name.data, src->name.data, src->name.len);
+        host->name.len = src->name.len;
+
+        if (src->service.len) {
+            host->service.data = ngx_slab_alloc(shpool, src->service.len);
+            if (host->service.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(host->service.data, src->service.data,
+                       src->service.len);
+            host->service.len = src->service.len;
+        }
+
+        /* the addresses resolved at startup now refer to the copy */
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (peer->host == src) {
+                peer->host = host;
+            }
+        }
+
+        /* pool is unlocked */
+        peer = ngx_stream_upstream_zone_copy_peer(peers, *peerp);
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        peer->host = host;
+
+        host->peers = peers;
+        host->peer = peer;
+
+        *peerp = peer;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_stream_upstream_rr_peer_t *
 ngx_stream_upstream_zone_copy_peer(ngx_stream_upstream_rr_peers_t *peers,
     ngx_stream_upstream_rr_peer_t *src)
@@ -320,3 +422,471 @@ failed:
 
     return NULL;
 }
+
+static void
+ngx_stream_upstream_zone_free_peer(ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_slab_pool_t  *pool;
+
+    pool = peers->shpool;
+
+    if (peer->server.data) {
+        ngx_slab_free_locked(pool, peer->server.data);
+    }
+
+    if (peer->name.data) {
+        ngx_slab_free_locked(pool, peer->name.data);
+    }
+
+    if (peer->sockaddr) {
+        ngx_slab_free_locked(pool, peer->sockaddr);
+    }
+
+    if (peer->ssl_session) {
+        ngx_slab_free_locked(pool, peer->ssl_session);
+    }
+
+    ngx_slab_free_locked(pool, peer);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_zone_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_stream_core_srv_conf_t       *cscf;
+    ngx_stream_upstream_rr_peers_t   *peers;
+    ngx_stream_upstream_srv_conf_t  **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (peers->resolve == NULL
+            && (peers->next == NULL || peers->next->resolve == NULL))
+        {
+            continue;
+        }
+
+        if (cscf->resolver == NULL
+            || cscf->resolver == NGX_CONF_UNSET_PTR
+            || cscf->resolver->connections.nelts == 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no resolver defined to resolve names "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i, n;
+    ngx_core_conf_t                     *ccf;
+    ngx_stream_conf_ctx_t               *ctx;
+    ngx_stream_core_srv_conf_t          *cscf;
+    ngx_stream_upstream_rr_peer_t       *peer;
+    ngx_stream_upstream_rr_peers_t      *peers, *list;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_main_conf_t     *umcf;
+    ngx_stream_upstream_zone_resolve_t  *rs;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    ctx = (ngx_stream_conf_ctx_t *) cycle->conf_ctx[ngx_stream_module.index];
+    cscf = ctx->srv_conf[ngx_stream_core_module.ctx_index];
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    uscfp = umcf->upstreams.elts;
+    n = 0;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        for (list = peers; list; list = list->next) {
+            for (peer = list->resolve; peer; peer = peer->next) {
+
+                /* each name is resolved by one of the workers */
+
+                if (ngx_process == NGX_PROCESS_WORKER
+                    && n++ % ccf->worker_processes != ngx_worker)
+                {
+                    continue;
+                }
+
+                rs = ngx_pcalloc(cycle->pool,
+                                 sizeof(ngx_stream_upstream_zone_resolve_t));
+                if (rs == NULL) {
+                    return NGX_ERROR;
+                }
+
+                rs->host = peer->host;
+                rs->peers = peers;
+                rs->resolver = cscf->resolver;
+                rs->timeout = (cscf->resolver_timeout == NGX_CONF_UNSET_MSEC)
+                              ? 30000 : cscf->resolver_timeout;
+
+                rs->event.handler = ngx_stream_upstream_zone_resolve_timer;
+                rs->event.data = rs;
+                rs->event.log = cycle->log;
+                rs->event.cancelable = 1;
+
+                ngx_add_timer(&rs->event, 1);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_zone_resolve_timer(ngx_event_t *event)
+{
+    ngx_resolver_ctx_t                  *ctx;
+    ngx_stream_upstream_host_t          *host;
+    ngx_stream_upstream_zone_resolve_t  *rs;
+
+    rs = event->data;
+    host = rs->host;
+
+    ctx = ngx_resolve_start(rs->resolver, NULL);
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "no resolver defined to resolve %V", &host->name);
+        return;
+    }
+
+    ctx->name = host->name;
+    ctx->service = host->service;
+    ctx->handler = ngx_stream_upstream_zone_resolve_handler;
+    ctx->data = rs;
+    ctx->timeout = rs->timeout;
+    ctx->cancelable = 1;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+failed:
+
+    ngx_add_timer(event, 10000);
+}
+
+
+static void
+ngx_stream_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                               now;
+    ngx_msec_t                           timer;
+    ngx_stream_upstream_host_t          *host;
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_zone_resolve_t  *rs;
+
+    rs = ctx->data;
+    host = rs->host;
+    peers = rs->peers;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, rs->event.log, 0,
+                      "%V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        if (ctx->state != NGX_RESOLVE_NXDOMAIN) {
+
+            /* keep the peers until the name is resolved again */
+
+            goto done;
+        }
+
+        ctx->naddrs = 0;
+        ctx->nsrvs = 0;
+    }
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    if (host->peers != peers) {
+        ngx_stream_upstream_rr_peers_wlock(host->peers);
+    }
+
+    ngx_stream_upstream_zone_update_peers(rs, ctx);
+
+    if (host->peers != peers) {
+        ngx_stream_upstream_rr_peers_unlock(host->peers);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+done:
+
+    now = ngx_time();
+
+    timer = (ctx->valid > now) ? (ngx_msec_t) (ctx->valid - now) * 1000 : 1000;
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(&rs->event, timer);
+}
+
+
+static void
+ngx_stream_upstream_zone_update_peers(ngx_stream_upstream_zone_resolve_t *rs,
+    ngx_resolver_ctx_t *ctx)
+{
+    in_port_t                         port;
+    ngx_int_t                         w;
+    ngx_uint_t                        i, j, n, changed, priority;
+    ngx_slab_pool_t                  *shpool;
+    ngx_resolver_srv_name_t          *srv;
+    ngx_stream_upstream_host_t       *host;
+    ngx_stream_upstream_zone_addr_t  *addrs;
+    ngx_stream_upstream_rr_peer_t    *peer, **peerp;
+    ngx_stream_upstream_rr_peers_t   *peers;
+
+    host = rs->host;
+    peers = host->peers;
+    shpool = peers->shpool;
+
+    /* collect the new addresses, only the lowest SRV priority is used */
+
+    n = 0;
+    priority = 0x10000;
+
+    if (ctx->service.len) {
+        for (i = 0; i < ctx->nsrvs; i++) {
+            srv = &ctx->srvs[i];
+
+            if (srv->state || srv->naddrs == 0) {
+                continue;
+            }
+
+            if (srv->priority < priority) {
+                priority = srv->priority;
+                n = 0;
+            }
+
+            if (srv->priority == priority) {
+                n += srv->naddrs;
+            }
+        }
+
+    } else {
+        n = ctx->naddrs;
+    }
+
+    addrs = NULL;
+
+    if (n) {
+        addrs = ngx_alloc(n * sizeof(ngx_stream_upstream_zone_addr_t),
+                          rs->event.log);
+        if (addrs == NULL) {
+            return;
+        }
+    }
+
+    n = 0;
+
+    if (ctx->service.len) {
+        for (i = 0; i < ctx->nsrvs; i++) {
+            srv = &ctx->srvs[i];
+
+            if (srv->state || srv->priority != priority) {
+                continue;
+            }
+
+            for (j = 0; j < srv->naddrs; j++) {
+                addrs[n].sockaddr = srv->addrs[j].sockaddr;
+                addrs[n].socklen = srv->addrs[j].socklen;
+                addrs[n].weight = srv->weight ? srv->weight : 1;
+                n++;
+            }
+        }
+
+    } else {
+        port = ngx_inet_get_port(host->peer->sockaddr);
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            ngx_inet_set_port(ctx->addrs[i].sockaddr, port);
+
+            addrs[n].sockaddr = ctx->addrs[i].sockaddr;
+            addrs[n].socklen = ctx->addrs[i].socklen;
+            addrs[n].weight = host->peer->weight;
+            n++;
+        }
+    }
+
+    changed = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    /* peers removed earlier are freed once their connections are closed */
+
+    for (peerp = &host->zombies; *peerp; /* void */) {
+        peer = *peerp;
+
+        if (peer->conns) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        *peerp = peer->next;
+        ngx_stream_upstream_zone_free_peer(peers, peer);
+    }
+
+    /* remove the peers which are no longer resolved */
+
+    for (peerp = &peers->peer; *peerp; /* void */) {
+        peer = *peerp;
+
+        if (peer->host != host) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[i].sockaddr, addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < n) {
+            if (peer->weight != addrs[i].weight) {
+                peer->weight = addrs[i].weight;
+                peer->effective_weight = addrs[i].weight;
+                peer->current_weight = 0;
+                changed = 1;
+            }
+
+            peerp = &peer->next;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, rs->event.log, 0,
+                      "removed %V from upstream \"%V\"",
+                      &peer->name, peers->name);
+
+        *peerp = peer->next;
+        changed = 1;
+
+        if (peer->conns) {
+            peer->next = host->zombies;
+            host->zombies = peer;
+            continue;
+        }
+
+        ngx_stream_upstream_zone_free_peer(peers, peer);
+    }
+
+    /* add the new addresses */
+
+    for (i = 0; i < n; i++) {
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (peer->host == host
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    addrs[i].sockaddr, addrs[i].socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (peer) {
+            continue;
+        }
+
+        peer = ngx_stream_upstream_zone_copy_peer(peers, host->peer);
+        if (peer == NULL) {
+            break;
+        }
+
+        ngx_memcpy(peer->sockaddr, addrs[i].sockaddr, addrs[i].socklen);
+        peer->socklen = addrs[i].socklen;
+        peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->socklen,
+                                       peer->name.data, NGX_SOCKADDR_STRLEN,
+                                       1);
+
+        peer->weight = addrs[i].weight;
+        peer->effective_weight = addrs[i].weight;
+
+        peer->next = peers->peer;
+        peers->peer = peer;
+
+        ngx_log_error(NGX_LOG_NOTICE, rs->event.log, 0,
+                      "added %V to upstream \"%V\"",
+                      &peer->name, peers->name);
+
+        changed = 1;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (addrs) {
+        ngx_free(addrs);
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    n = 0;
+    w = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        n++;
+        w += peer->weight;
+    }
+
+    peers->number = n;
+    peers->total_weight = w;
+    peers->weighted = ((ngx_uint_t) w != n);
+    peers->single = (peers == rs->peers && n == 1 && peers->next == NULL);
+
+    (*peers->config)++;
+}